@@ -14,6 +14,8 @@
 #include <unistd.h>
 
 #include "act_dedupefiles.h"
+#include "actexec.h"
+#include "stream.h"
 #include "libjodycode.h"
 
 #ifdef __linux__
@@ -30,8 +32,22 @@
   #include "linux-dedupe-static.h"
  #endif /* FILE_DEDUPE_RANGE_SAME */
  #include <sys/ioctl.h>
+ #include <linux/fiemap.h>
+ #ifndef FS_IOC_FIEMAP
+  #define FS_IOC_FIEMAP _IOWR('f', 11, struct fiemap)
+ #endif
  #define JDUPES_DEDUPE_SUPPORTED 1
  #define KERNEL_DEDUP_MAX_SIZE 16777216
+ /* Destinations per FIDEDUPERANGE call; the kernel caps the request at
+  * one page (4 KiB pages hold the header plus 127 destinations) */
+ #define DEDUPE_MAX_DESTS 127
+ /* Extents fetched per FIEMAP call */
+ #define FIEMAP_BATCH 64
+ /* Largest set scanned to pick the source with the most shared data */
+ #define DEDUPE_SRC_SCAN_MAX 64
+ /* Extents whose physical location can't be compared between files */
+ #define FIEMAP_UNSHAREABLE (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_ENCODED \
+		 | FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_DATA_TAIL | FIEMAP_EXTENT_NOT_ALIGNED)
  /* Error messages */
  static const char s_err_dedupe_notabug[] = "This is not a bug in jdupes; check your file stats/permissions.";
  static const char s_err_dedupe_repeated[] = "This verbose error description will not be repeated.";
@@ -49,117 +65,365 @@
 #error Dedupe is only supported on Linux and macOS
 #endif
 
-void dedupefiles(file_t * restrict files)
-{
 #ifdef __linux__
+/* State of one destination file in a batch */
+struct dedupe_dest {
+  unsigned int idx;  /* Index into the set */
+  int fd;            /* -1 if hard linked to the source or not opened */
+  int status;        /* FIDEDUPERANGE status of the last range submitted */
+  int errnum;        /* errno if a call including this file failed */
+  int submitted;     /* Any range was passed to the kernel */
+};
+
+/* Physical layout of one file, from FIEMAP */
+struct extent_map {
+  struct fiemap_extent *ext;
+  unsigned int count;
+  int valid;  /* 0 if the layout is unknown; nothing is treated as shared */
+};
+
+
+/* Read a file's extent map; leaves map->valid at 0 on failure */
+static void get_extent_map(const int fd, struct extent_map * const restrict map)
+{
+  struct {
+    struct fiemap fm;
+    struct fiemap_extent fe[FIEMAP_BATCH];
+  } req;
+  uint64_t start = 0;
+  unsigned int alloc = 0;
+
+  map->ext = NULL;
+  map->count = 0;
+  map->valid = 0;
+  for (;;) {
+    unsigned int mapped;
+
+    memset(&req, 0, sizeof(req));
+    req.fm.fm_start = start;
+    req.fm.fm_length = ~0ULL - start;
+    req.fm.fm_extent_count = FIEMAP_BATCH;
+    if (ioctl(fd, FS_IOC_FIEMAP, &req.fm) != 0) goto error;
+    mapped = req.fm.fm_mapped_extents;
+    if (mapped == 0) break;
+    if (map->count + mapped > alloc) {
+      struct fiemap_extent *tmp;
+      alloc = (map->count + mapped) * 2;
+      tmp = (struct fiemap_extent *)realloc(map->ext, alloc * sizeof(struct fiemap_extent));
+      if (tmp == NULL) jc_oom("get_extent_map()");
+      map->ext = tmp;
+    }
+    memcpy(map->ext + map->count, req.fe, mapped * sizeof(struct fiemap_extent));
+    map->count += mapped;
+    if (req.fe[mapped - 1].fe_flags & FIEMAP_EXTENT_LAST) break;
+    start = req.fe[mapped - 1].fe_logical + req.fe[mapped - 1].fe_length;
+  }
+  map->valid = 1;
+  return;
+
+error:
+  free(map->ext);
+  map->ext = NULL;
+  map->count = 0;
+  return;
+}
+
+
+/* Index of the first extent ending after 'pos' (count if none) */
+static unsigned int find_extent(const struct extent_map * const restrict map, const uint64_t pos, unsigned int i)
+{
+  while (i < map->count && map->ext[i].fe_logical + map->ext[i].fe_length <= pos) i++;
+  return i;
+}
+
+
+/* Count the bytes of [start, end) that two files already store in the same
+ * physical blocks. Ranges that are holes in both files count as shared. */
+static uint64_t shared_bytes(const struct extent_map * const restrict m1,
+		const struct extent_map * const restrict m2, uint64_t start, const uint64_t end)
+{
+  uint64_t shared = 0;
+  unsigned int i = 0, j = 0;
+
+  if (m1->valid == 0 || m2->valid == 0) return 0;
+  while (start < end) {
+    const struct fiemap_extent *e1, *e2;
+    uint64_t next = end;
+
+    i = find_extent(m1, start, i);
+    j = find_extent(m2, start, j);
+    e1 = (i < m1->count && m1->ext[i].fe_logical <= start) ? &m1->ext[i] : NULL;
+    e2 = (j < m2->count && m2->ext[j].fe_logical <= start) ? &m2->ext[j] : NULL;
+
+    /* The range continues until either file's extent/hole state changes */
+    if (e1 != NULL) next = e1->fe_logical + e1->fe_length;
+    else if (i < m1->count && m1->ext[i].fe_logical < next) next = m1->ext[i].fe_logical;
+    if (e2 != NULL) {
+      if (e2->fe_logical + e2->fe_length < next) next = e2->fe_logical + e2->fe_length;
+    } else if (j < m2->count && m2->ext[j].fe_logical < next) next = m2->ext[j].fe_logical;
+    if (next > end) next = end;
+
+    if (e1 == NULL && e2 == NULL) shared += next - start;
+    else if (e1 != NULL && e2 != NULL
+        && !(e1->fe_flags & FIEMAP_UNSHAREABLE) && !(e2->fe_flags & FIEMAP_UNSHAREABLE)
+        && e1->fe_physical + (start - e1->fe_logical) == e2->fe_physical + (start - e2->fe_logical))
+      shared += next - start;
+    start = next;
+  }
+  return shared;
+}
+
+
+/* Choose the set member whose data is already shared with the most other
+ * members, so reruns over deduplicated data leave the most extents alone.
+ * Ties keep the earliest member. Returns an index into 'set' */
+static unsigned int pick_source(file_t ** const restrict set, struct extent_map * const restrict maps, const unsigned int count)
+{
+  unsigned int best = 0;
+  uint64_t best_shared = 0;
+
+  if (count > DEDUPE_SRC_SCAN_MAX) return 0;
+  for (unsigned int i = 0; i < count; i++) {
+    uint64_t total = 0;
+    if (maps[i].valid == 0) continue;
+    for (unsigned int j = 0; j < count; j++)
+      if (i != j) total += shared_bytes(&maps[i], &maps[j], 0, (uint64_t)set[i]->size);
+    if (total > best_shared) {
+      best = i;
+      best_shared = total;
+    }
+  }
+  return best;
+}
+
+
+/* Verbose error descriptions are shown once per run */
+static int err_twentytwo = 0, err_ninetyfive = 0;
+static uint64_t total_files = 0;
+
+
+/* Returns nonzero the first time an error description is due */
+static int first_error(int * const restrict shown)
+{
+  int first;
+
+  action_lock();
+  first = !*shown;
+  *shown = 1;
+  action_unlock();
+  return first;
+}
+
+
+/* Deduplicate one set of files against the member chosen as the source */
+static void dedupe_set(file_t * const restrict curfile, FILE * const restrict out,
+		FILE * const restrict err, void * const restrict ctx)
+{
   struct file_dedupe_range *fdr;
-  struct file_dedupe_range_info *fdri;
-  file_t *curfile, *curfile2, *dupefile;
+  struct dedupe_dest dests[DEDUPE_MAX_DESTS];
+  unsigned int slot[DEDUPE_MAX_DESTS];
+  file_t *dupefile, *srcfile;
+  file_t **set;
+  struct extent_map *maps;
+  unsigned int count, src;
   int src_fd;
-  int err_twentytwo = 0, err_ninetyfive = 0;
-  uint64_t total_files = 0;
-
-  LOUD(fprintf(stderr, "\ndedupefiles: %p\n", files);)
 
+  (void)ctx;
   fdr = (struct file_dedupe_range *)calloc(1,
         sizeof(struct file_dedupe_range)
-      + sizeof(struct file_dedupe_range_info) + 1);
-  fdr->dest_count = 1;
-  fdri = &fdr->info[0];
-  for (curfile = files; curfile; curfile = curfile->next) {
-    /* Skip all files that have no duplicates */
-    if (!ISFLAG(curfile->flags, FF_HAS_DUPES)) continue;
-    CLEARFLAG(curfile->flags, FF_HAS_DUPES);
-
-    /* For each duplicate list head, handle the duplicates in the list */
-    curfile2 = curfile;
-    src_fd = open(curfile->d_name, O_RDONLY);
-    /* If an open fails, keep going down the dupe list until it is exhausted */
-    while (src_fd == -1 && curfile2->duplicates && curfile2->duplicates->duplicates) {
-      fprintf(stderr, "dedupe: open failed (skipping): %s\n", curfile2->d_name);
-      exit_status = EXIT_FAILURE;
-      curfile2 = curfile2->duplicates;
-      src_fd = open(curfile2->d_name, O_RDONLY);
+      + sizeof(struct file_dedupe_range_info) * DEDUPE_MAX_DESTS);
+  if (fdr == NULL) jc_oom("dedupe_set()");
+
+  CLEARFLAG(curfile->flags, FF_HAS_DUPES);
+
+  /* Gather the set and the physical layout of each member */
+  count = 0;
+  for (dupefile = curfile; dupefile; dupefile = dupefile->duplicates) count++;
+  set = (file_t **)malloc(count * sizeof(file_t *));
+  maps = (struct extent_map *)malloc(count * sizeof(struct extent_map));
+  if (set == NULL || maps == NULL) jc_oom("dedupe_set() set");
+  count = 0;
+  for (dupefile = curfile; dupefile; dupefile = dupefile->duplicates) {
+    int fd = open(dupefile->d_name, O_RDONLY);
+    set[count] = dupefile;
+    maps[count].ext = NULL;
+    maps[count].count = 0;
+    maps[count].valid = 0;
+    if (fd == -1) {
+      fprintf(err, "dedupe: open failed (skipping): %s\n", dupefile->d_name);
+      action_failed();
+      continue;
     }
-    if (src_fd == -1) continue;
-    printf("  [SRC] %s\n", curfile2->d_name);
+    get_extent_map(fd, &maps[count]);
+    close(fd);
+    count++;
+  }
+  if (count < 2) goto finish;
+
+  /* Dedupe every other member of the set against the chosen source */
+  src = pick_source(set, maps, count);
+  srcfile = set[src];
+  src_fd = open(srcfile->d_name, O_RDONLY);
+  if (src_fd == -1) {
+    fprintf(err, "dedupe: open failed (skipping): %s\n", srcfile->d_name);
+    action_failed();
+    goto finish;
+  }
+  fprintf(out, "  [SRC] %s\n", srcfile->d_name);
+
+  /* Run dedupe for the set in batches of destinations, so each source
+   * range is read once per batch instead of once per destination */
+  for (unsigned int i = 0; i < count; ) {
+    unsigned int batch = 0, active = 0;
+    off_t remain;
 
-    /* Run dedupe for each set */
-    for (dupefile = curfile->duplicates; dupefile; dupefile = dupefile->duplicates) {
-      off_t remain;
-      int err;
+    /* Open the next batch of destination files, skipping any that fail */
+    for (; i < count && batch < DEDUPE_MAX_DESTS; i++) {
+      struct dedupe_dest *d = &dests[batch];
 
+      if (i == src) continue;
+      dupefile = set[i];
+      d->idx = i;
+      d->fd = -1;
+      d->status = FILE_DEDUPE_RANGE_SAME;
+      d->errnum = 0;
+      d->submitted = 0;
+      batch++;
       /* Don't pass hard links to dedupe */
-      if (dupefile->device == curfile->device && dupefile->inode == curfile->inode) {
-        printf("  -==-> %s\n", dupefile->d_name);
+      if (dupefile->device == srcfile->device && dupefile->inode == srcfile->inode) continue;
+      d->fd = open(dupefile->d_name, O_RDONLY);
+      if (d->fd == -1) {
+        fprintf(err, "dedupe: open failed (skipping): %s\n", dupefile->d_name);
+        action_failed();
         continue;
       }
+      active++;
+    }
+
+    /* Dedupe src <--> dests, 16 MiB or less at a time */
+    remain = srcfile->size;
+    /* Consume data blocks until no data remains */
+    while (remain && active) {
+      unsigned int n = 0;
+
+      fdr->src_offset = (uint64_t)(srcfile->size - remain);
+      fdr->src_length = (uint64_t)(remain <= KERNEL_DEDUP_MAX_SIZE ? remain : KERNEL_DEDUP_MAX_SIZE);
+      remain -= (off_t)fdr->src_length;
+      for (unsigned int k = 0; k < batch; k++) {
+        struct dedupe_dest *d = &dests[k];
 
-      /* Open destination file, skipping any that fail */
-      fdri->dest_fd = open(dupefile->d_name, O_RDONLY);
-      if (fdri->dest_fd == -1) {
-        fprintf(stderr, "dedupe: open failed (skipping): %s\n", dupefile->d_name);
-        exit_status = EXIT_FAILURE;
+        /* Destinations that failed drop out of later ranges */
+        if (d->fd == -1 || d->status != FILE_DEDUPE_RANGE_SAME || d->errnum != 0) continue;
+        /* Ranges a previous run already deduplicated need no kernel work */
+        if (shared_bytes(&maps[src], &maps[d->idx], fdr->src_offset, fdr->src_offset + fdr->src_length) == fdr->src_length) continue;
+        fdr->info[n].dest_fd = d->fd;
+        fdr->info[n].dest_offset = fdr->src_offset;
+        fdr->info[n].status = FILE_DEDUPE_RANGE_SAME;
+        fdr->info[n].bytes_deduped = 0;
+        fdr->info[n].reserved = 0;
+        slot[n] = k;
+        n++;
+      }
+      if (n == 0) continue;
+      fdr->dest_count = (uint16_t)n;
+      errno = 0;
+      if (ioctl(src_fd, FIDEDUPERANGE, fdr) != 0) {
+        /* The whole call failed; every destination in it gets the error */
+        for (unsigned int k = 0; k < n; k++) {
+          dests[slot[k]].errnum = errno;
+          dests[slot[k]].submitted = 1;
+        }
         continue;
       }
-
-      /* Dedupe src <--> dest, 16 MiB or less at a time */
-      remain = dupefile->size;
-      fdri->status = FILE_DEDUPE_RANGE_SAME;
-      /* Consume data blocks until no data remains */
-      while (remain) {
-        errno = 0;
-        fdr->src_offset = (uint64_t)(dupefile->size - remain);
-        fdri->dest_offset = fdr->src_offset;
-        fdr->src_length = (uint64_t)(remain <= KERNEL_DEDUP_MAX_SIZE ? remain : KERNEL_DEDUP_MAX_SIZE);
-        ioctl(src_fd, FIDEDUPERANGE, fdr);
-        if (fdri->status < 0) break;
-        remain -= (off_t)fdr->src_length;
+      for (unsigned int k = 0; k < n; k++) {
+        dests[slot[k]].status = fdr->info[k].status;
+        dests[slot[k]].submitted = 1;
       }
+    }
+
+    /* Report results and handle any errors in set order */
+    for (unsigned int k = 0; k < batch; k++) {
+      struct dedupe_dest *d = &dests[k];
+      int status = d->status;
 
-      /* Handle any errors */
-      err = fdri->status;
-      if (err != FILE_DEDUPE_RANGE_SAME || errno != 0) {
-        printf("  -XX-> %s\n", dupefile->d_name);
-        fprintf(stderr, "error: ");
-        if (err == FILE_DEDUPE_RANGE_DIFFERS) {
-          fprintf(stderr, "not identical (files modified between scan and dedupe?)\n");
-          exit_status = EXIT_FAILURE;
-        } else if (err != 0) {
-          fprintf(stderr, "%s (%d)\n", strerror(-err), err);
-          exit_status = EXIT_FAILURE;
-        } else if (errno != 0) {
-          fprintf(stderr, "%s (%d)\n", strerror(errno), errno);
-          exit_status = EXIT_FAILURE;
+      dupefile = set[d->idx];
+      if (d->fd == -1) {
+        if (dupefile->device == srcfile->device && dupefile->inode == srcfile->inode)
+          fprintf(out, "  -==-> %s\n", dupefile->d_name);
+        continue;
+      }
+      close(d->fd);
+      if (status != FILE_DEDUPE_RANGE_SAME || d->errnum != 0) {
+        fprintf(out, "  -XX-> %s\n", dupefile->d_name);
+        fprintf(err, "error: ");
+        if (status == FILE_DEDUPE_RANGE_DIFFERS) {
+          fprintf(err, "not identical (files modified between scan and dedupe?)\n");
+          action_failed();
+        } else if (status != 0) {
+          fprintf(err, "%s (%d)\n", strerror(-status), status);
+          action_failed();
+        } else if (d->errnum != 0) {
+          fprintf(err, "%s (%d)\n", strerror(d->errnum), d->errnum);
+          action_failed();
         }
-        if ((err == -22 || errno == 22) && err_twentytwo == 0) {
-          fprintf(stderr, "       One or more files being deduped are read-only or hard linked.\n");
-          fprintf(stderr, "       Read-only files can only be deduped by the root user.\n");
-          fprintf(stderr, "       %s\n", s_err_dedupe_notabug);
-          fprintf(stderr, "       %s\n", s_err_dedupe_repeated);
-          err_twentytwo = 1;
-	}
-        if ((err == -95 || errno == 95) && err_ninetyfive == 0) {
-          fprintf(stderr, "       One or more files is on a filesystem that does not support\n");
-          fprintf(stderr, "       block-level deduplication or are on different filesystems.\n");
-          fprintf(stderr, "       %s\n", s_err_dedupe_notabug);
-          fprintf(stderr, "       %s\n", s_err_dedupe_repeated);
-          err_ninetyfive = 1;
-	}
+        if ((status == -22 || d->errnum == 22) && first_error(&err_twentytwo)) {
+          fprintf(err, "       One or more files being deduped are read-only or hard linked.\n");
+          fprintf(err, "       Read-only files can only be deduped by the root user.\n");
+          fprintf(err, "       %s\n", s_err_dedupe_notabug);
+          fprintf(err, "       %s\n", s_err_dedupe_repeated);
+        }
+        if ((status == -95 || d->errnum == 95) && first_error(&err_ninetyfive)) {
+          fprintf(err, "       One or more files is on a filesystem that does not support\n");
+          fprintf(err, "       block-level deduplication or are on different filesystems.\n");
+          fprintf(err, "       %s\n", s_err_dedupe_notabug);
+          fprintf(err, "       %s\n", s_err_dedupe_repeated);
+        }
+      } else if (d->submitted == 0) {
+        /* All data was already shared with the source */
+        fprintf(out, "  -==-> %s\n", dupefile->d_name);
       } else {
         /* Dedupe OK; report to the user and add to file count */
-        printf("  ====> %s\n", dupefile->d_name);
+        fprintf(out, "  ====> %s\n", dupefile->d_name);
+        action_lock();
         total_files++;
+        action_unlock();
       }
-      close((int)fdri->dest_fd);
     }
-    printf("\n");
-    close(src_fd);
-    total_files++;
   }
+  fprintf(out, "\n");
+  close(src_fd);
+  action_lock();
+  total_files++;
+  action_unlock();
 
-  if (!ISFLAG(flags, F_HIDEPROGRESS)) fprintf(stderr, "Deduplication done (%" PRIuMAX " files processed)\n", total_files);
+finish:
+  for (unsigned int i = 0; i < count; i++) free(maps[i].ext);
+  free(set);
+  free(maps);
   free(fdr);
+  return;
+}
+#endif /* __linux__ */
+
+
+/* Print the deduplication totals */
+void dedupe_report(void)
+{
+#ifdef __linux__
+  if (!ISFLAG(flags, F_HIDEPROGRESS)) fprintf(stderr, "Deduplication done (%" PRIuMAX " files processed)\n", total_files);
+#endif
+  return;
+}
+
+
+void dedupefiles(file_t * restrict files)
+{
+#ifdef __linux__
+  LOUD(fprintf(stderr, "\ndedupefiles: %p\n", files);)
+
+  run_set_actions(files, dedupe_set, NULL);
+  /* -x stream reports once after the last group instead */
+  if (stream_actions == 0) dedupe_report();
 #endif /* __linux__ */
 
 /* On macOS, clonefile() is basically a "hard link" function, so linkfiles will do the work. */
@@ -10,6 +10,7 @@ extern "C" {
 
 #include "jdupes.h"
 void dedupefiles(file_t * restrict files);
+void dedupe_report(void);
 
 #ifdef __cplusplus
 }
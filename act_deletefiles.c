@@ -14,6 +14,7 @@
 #include "likely_unlikely.h"
 #include "act_deletefiles.h"
 #include "act_linkfiles.h"
+#include "actexec.h"
 #ifndef NO_HASHDB
  #include "hashdb.h"
 #endif
@@ -48,6 +49,70 @@ static unsigned int get_max_dupes(const file_t *files, unsigned int * const rest
 }
 
 
+/* Delete every file in a set that isn't marked for preservation */
+static void delete_unpreserved(file_t ** const restrict dupelist, const unsigned int * const restrict preserve,
+		const unsigned int counter, FILE * const restrict out)
+{
+  for (unsigned int x = 1; x <= counter; x++) {
+    if (preserve[x]) {
+      fprintf(out, "   [+] "); jc_fwprint(out, dupelist[x]->d_name, 1);
+    } else {
+      if (file_has_changed(dupelist[x])) {
+        fprintf(out, "   [!] "); jc_fwprint(out, dupelist[x]->d_name, 0);
+        fprintf(out, "-- file changed since being scanned\n");
+        action_failed();
+      } else if (jc_remove(dupelist[x]->d_name) == 0) {
+        fprintf(out, "   [-] "); jc_fwprint(out, dupelist[x]->d_name, 1);
+#ifndef NO_HASHDB
+        if (ISFLAG(flags, F_HASHDB)) {
+          dupelist[x]->mtime = 0;
+          action_lock();
+          add_hashdb_entry(NULL, 0, dupelist[x]);
+          action_unlock();
+        }
+#endif
+      } else {
+        fprintf(out, "   [!] "); jc_fwprint(out, dupelist[x]->d_name, 0);
+        fprintf(out, "-- unable to delete file\n");
+        action_failed();
+      }
+    }
+  }
+  return;
+}
+
+
+/* Non-interactive deletion of one set: preserve only the first file */
+static void delete_set(file_t * const restrict files, FILE * const restrict out,
+		FILE * const restrict err, void * const restrict ctx)
+{
+  file_t **dupelist;
+  unsigned int *preserve;
+  unsigned int counter = 1;
+
+  (void)err; (void)ctx;
+  for (file_t *tmpfile = files->duplicates; tmpfile; tmpfile = tmpfile->duplicates) counter++;
+  dupelist = (file_t **)malloc(sizeof(file_t *) * (counter + 1));
+  preserve = (unsigned int *)malloc(sizeof(unsigned int) * (counter + 1));
+  if (!dupelist || !preserve) jc_oom("delete_set() structures");
+
+  counter = 1;
+  dupelist[counter] = files;
+  preserve[counter] = 1;
+  for (file_t *tmpfile = files->duplicates; tmpfile; tmpfile = tmpfile->duplicates) {
+    dupelist[++counter] = tmpfile;
+    preserve[counter] = 0;
+  }
+
+  fprintf(out, "\n");
+  delete_unpreserved(dupelist, preserve, counter, out);
+  fprintf(out, "\n");
+  free(dupelist);
+  free(preserve);
+  return;
+}
+
+
 void deletefiles(file_t *files, int prompt, FILE *tty)
 {
   unsigned int counter, groups;
@@ -63,6 +128,12 @@ void deletefiles(file_t *files, int prompt, FILE *tty)
 
   LOUD(fprintf(stderr, "deletefiles: %p, %d, %p\n", files, prompt, tty));
 
+  /* Without prompting, sets are independent and may be deleted in parallel */
+  if (!prompt) {
+    run_set_actions(files, delete_set, NULL);
+    return;
+  }
+
   groups = get_max_dupes(files, &max);
 
   max++;
@@ -182,29 +253,7 @@ stop_scanning:
 
       printf("\n");
 
-      for (x = 1; x <= counter; x++) {
-        if (preserve[x]) {
-          printf("   [+] "); jc_fwprint(stdout, dupelist[x]->d_name, 1);
-        } else {
-          if (file_has_changed(dupelist[x])) {
-            printf("   [!] "); jc_fwprint(stdout, dupelist[x]->d_name, 0);
-            printf("-- file changed since being scanned\n");
-            exit_status = EXIT_FAILURE;
-          } else if (jc_remove(dupelist[x]->d_name) == 0) {
-            printf("   [-] "); jc_fwprint(stdout, dupelist[x]->d_name, 1);
-#ifndef NO_HASHDB
-            if (ISFLAG(flags, F_HASHDB)) {
-              dupelist[x]->mtime = 0;
-              add_hashdb_entry(NULL, 0, dupelist[x]);
-          }
-#endif
-          } else {
-            printf("   [!] "); jc_fwprint(stdout, dupelist[x]->d_name, 0);
-            printf("-- unable to delete file\n");
-            exit_status = EXIT_FAILURE;
-          }
-        }
-      }
+      delete_unpreserved(dupelist, preserve, counter, stdout);
 #if defined NO_HARDLINKS && defined NO_SYMLINKS
       /* label not needed */
 #else
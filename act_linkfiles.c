@@ -10,9 +10,16 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#ifndef ON_WINDOWS
+ #include <fcntl.h>
+ #include <unistd.h>
+ #include <sys/stat.h>
+#endif
 
 #include <libjodycode.h>
 #include "act_linkfiles.h"
+#include "actexec.h"
+#include "fdcache.h"
 #ifndef NO_HASHDB
  #include "hashdb.h"
 #endif
@@ -30,22 +37,226 @@
    #define ENABLE_CLONEFILE_LINK 1
   #endif /* NO_CLONEFILE */
  #endif /* __APPLE__ */
+ /* Linux FICLONE shares the source file's extents with a new file */
+ #if defined __linux__ && !defined NO_FICLONE
+  #include <fcntl.h>
+  #include <unistd.h>
+  #include <sys/ioctl.h>
+  #include <sys/stat.h>
+  #include <sys/xattr.h>
+  #include <linux/fs.h>
+  #ifndef FICLONE
+   #define FICLONE _IOW(0x94, 9, int)
+  #endif
+  #define ENABLE_FICLONE_LINK 1
+ #endif /* __linux__ */
 #endif /* ENABLE_DEDUPE */
 
 
 #ifdef ENABLE_CLONEFILE_LINK
-static void clonefile_error(const char * const restrict func, const char * const restrict name)
+static void clonefile_error(FILE * const restrict err, const char * const restrict func, const char * const restrict name)
 {
-  fprintf(stderr, "warning: %s failed for destination file, reverting:\n-##-> ", func);
-  jc_fwprint(stderr,name, 1);
-  exit_status = EXIT_FAILURE;
+  fprintf(err, "warning: %s failed for destination file, reverting:\n-##-> ", func);
+  jc_fwprint(err, name, 1);
+  action_failed();
   return;
 }
 #endif /* ENABLE_CLONEFILE_LINK */
 
 
+#ifdef ENABLE_FICLONE_LINK
+/* Copy extended attributes (including ACLs) from one open file to another
+ * Returns 0 on success or if the filesystem has no xattr support */
+static int ficlone_copy_xattrs(const int from, const int to)
+{
+  char *names = NULL, *value = NULL;
+  ssize_t len, vlen;
+  size_t valsize = 0;
+  int retval = -1;
+
+  len = flistxattr(from, NULL, 0);
+  if (len <= 0) return (len == 0 || errno == ENOTSUP) ? 0 : -1;
+  names = (char *)malloc((size_t)len);
+  if (names == NULL) jc_oom("ficlone_copy_xattrs()");
+  len = flistxattr(from, names, (size_t)len);
+  if (len < 0) goto finish;
+  for (char *name = names; name < names + len; name += strlen(name) + 1) {
+    vlen = fgetxattr(from, name, NULL, 0);
+    if (vlen < 0) goto finish;
+    if ((size_t)vlen > valsize) {
+      valsize = (size_t)vlen;
+      value = (char *)realloc(value, valsize);
+      if (value == NULL) jc_oom("ficlone_copy_xattrs() value");
+    }
+    vlen = fgetxattr(from, name, value, valsize);
+    if (vlen < 0 || fsetxattr(to, name, value, (size_t)vlen, 0) != 0) goto finish;
+  }
+  retval = 0;
+
+finish:
+  free(names);
+  free(value);
+  return retval;
+}
+
+
+/* Create 'dest' as a reflink clone of 'src' carrying the owner, mode,
+ * timestamps and extended attributes of 'orig' (the renamed duplicate)
+ * Returns 0 on success; on failure 'dest' is removed and errno is set */
+static int ficlone_file(const char * const restrict src, const char * const restrict dest, const char * const restrict orig)
+{
+  struct stat s;
+  struct timespec times[2];
+  int srcfd = -1, destfd = -1, origfd = -1, err;
+
+  origfd = open(orig, O_RDONLY);
+  if (origfd == -1 || fstat(origfd, &s) != 0) goto error_open;
+  srcfd = open(src, O_RDONLY);
+  if (srcfd == -1) goto error_open;
+  destfd = open(dest, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+  if (destfd == -1) goto error_open;
+
+  if (ioctl(destfd, FICLONE, srcfd) != 0) goto error_clone;
+  if (ficlone_copy_xattrs(origfd, destfd) != 0) goto error_clone;
+  /* Ownership first: chown clears set-user/group-ID bits */
+  if (fchown(destfd, s.st_uid, s.st_gid) != 0) goto error_clone;
+  if (fchmod(destfd, s.st_mode & 07777) != 0) goto error_clone;
+  times[0] = s.st_atim;
+  times[1] = s.st_mtim;
+  if (futimens(destfd, times) != 0) goto error_clone;
+  if (close(destfd) != 0) {
+    destfd = -1;
+    goto error_clone;
+  }
+  close(srcfd);
+  close(origfd);
+  return 0;
+
+error_clone:
+  err = errno;
+  if (destfd != -1) close(destfd);
+  unlink(dest);
+  errno = err;
+error_open:
+  err = errno;
+  if (srcfd != -1) close(srcfd);
+  if (origfd != -1) close(origfd);
+  errno = err;
+  return -1;
+}
+#endif /* ENABLE_FICLONE_LINK */
+
+
+#if !defined ON_WINDOWS && !defined NO_HARDLINKS && defined AT_FDCWD
+ #define ENABLE_LINKAT 1
+/* An open directory, reused while consecutive files live in it */
+struct dir_handle {
+  int fd;
+  size_t len;  /* Length of the directory part of the path, with the slash */
+  char path[PATHBUF_SIZE];
+};
+
+/* hardlink_at() results besides 0 and -1 */
+#define LINKAT_READONLY		1
+#define LINKAT_DEST_CHANGED	2
+#define LINKAT_SRC_CHANGED	3
+
+
+/* Get a descriptor for the directory holding 'path' and point *base at the
+ * file name within it; returns -1 if the directory can't be opened */
+static int open_parent(struct dir_handle * const restrict dh, const char * const restrict path, const char ** const restrict base)
+{
+  const char *slash = strrchr(path, '/');
+  size_t len = slash != NULL ? (size_t)(slash - path) + 1 : 0;
+
+  *base = path + len;
+  if (dh->fd != -1 && dh->len == len && strncmp(dh->path, path, len) == 0) return dh->fd;
+  if (dh->fd != -1) close(dh->fd);
+  dh->fd = -1;
+  if (len >= PATHBUF_SIZE) return -1;
+  if (len == 0) strcpy(dh->path, ".");
+  else {
+    memcpy(dh->path, path, len);
+    dh->path[len] = '\0';
+  }
+  dh->fd = open(dh->path, O_RDONLY | O_DIRECTORY);
+  if (len == 0) dh->path[0] = '\0';
+  dh->len = len;
+  return dh->fd;
+}
+
+
+/* Does a stat() result still describe the file as it was scanned? */
+static int stat_matches(const struct stat * const restrict s, const file_t * const restrict file)
+{
+  if (file->inode != s->st_ino || file->device != s->st_dev) return 0;
+  if (file->size != s->st_size || file->mode != s->st_mode) return 0;
+#ifndef NO_MTIME
+  if (file->mtime != s->st_mtime) return 0;
+#endif
+#ifndef NO_PERMS
+  if (file->uid != s->st_uid || file->gid != s->st_gid) return 0;
+#endif
+  return 1;
+}
+
+
+/* Replace 'dest' with a hard link to 'src' without ever removing it: link
+ * 'src' to a temporary name in the destination directory, make sure the
+ * new link is the unchanged source file, then rename it over 'dest'.
+ * Everything is relative to directory descriptors, so no full path is
+ * resolved per file. Returns 0 on success, -1 on error with errno set, or
+ * one of the LINKAT_* codes if a check failed and nothing was changed */
+static int hardlink_at(struct dir_handle * const restrict srcdir, struct dir_handle * const restrict destdir,
+		const file_t * const restrict src, const file_t * const restrict dest)
+{
+  const char *srcbase, *destbase;
+  char tmpname[PATHBUF_SIZE];
+  struct stat s;
+  int sfd, dfd, err;
+
+  sfd = open_parent(srcdir, src->d_name, &srcbase);
+  dfd = open_parent(destdir, dest->d_name, &destbase);
+  if (sfd == -1 || dfd == -1) return -1;
+  if (strlen(destbase) + 16 > PATHBUF_SIZE) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(tmpname, destbase);
+  strcat(tmpname, ".__jdupes__.tmp");
+
+  /* Do not attempt to hard link files for which we don't have write access */
+  if (faccessat(dfd, destbase, W_OK, 0) != 0) return LINKAT_READONLY;
+  if (!ISFLAG(flags, F_NOCHANGECHECK)) {
+    if (fstatat(dfd, destbase, &s, AT_SYMLINK_NOFOLLOW) != 0 || !stat_matches(&s, dest)) return LINKAT_DEST_CHANGED;
+  } else if (fstatat(dfd, destbase, &s, AT_SYMLINK_NOFOLLOW) != 0) return -1;
+  /* Linked to the source since the scan: renameat() does nothing when both
+   * names are the same inode and would leave the temporary link behind */
+  if (s.st_ino == src->inode && s.st_dev == src->device) return 0;
+  /* The target is about to be replaced; stop holding it open */
+  fdcache_drop(dest);
+
+  if (linkat(sfd, srcbase, dfd, tmpname, 0) != 0) return -1;
+  /* The new link shares the source inode, so this checks the source */
+  if (!ISFLAG(flags, F_NOCHANGECHECK)) {
+    if (fstatat(dfd, tmpname, &s, AT_SYMLINK_NOFOLLOW) != 0 || !stat_matches(&s, src)) {
+      unlinkat(dfd, tmpname, 0);
+      return LINKAT_SRC_CHANGED;
+    }
+  }
+  if (renameat(dfd, tmpname, dfd, destbase) != 0) {
+    err = errno;
+    unlinkat(dfd, tmpname, 0);
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+#endif /* ENABLE_LINKAT */
+
+
 /* Only build this function if some functionality does not exist */
-#if defined NO_SYMLINKS || defined NO_HARDLINKS || !defined ENABLE_CLONEFILE_LINK
+#if defined NO_SYMLINKS || defined NO_HARDLINKS || (!defined ENABLE_CLONEFILE_LINK && !defined ENABLE_FICLONE_LINK)
 static void linkfiles_nosupport(const char * const restrict call, const char * const restrict type)
 {
   fprintf(stderr, "internal error: linkfiles(%s) called without %s support\nPlease report this to the author as a program bug\n", call, type);
@@ -54,348 +265,403 @@ static void linkfiles_nosupport(const char * const restrict call, const char * c
 #endif /* anything unsupported */
 
 
-static void revert_failed(const char * const restrict orig, const char * const restrict current)
+static void revert_failed(FILE * const restrict err, const char * const restrict orig, const char * const restrict current)
 {
-  fprintf(stderr, "\nwarning: couldn't revert the file to its original name\n");
-  fprintf(stderr, "original: "); jc_fwprint(stderr, orig, 1);
-  fprintf(stderr, "current:  "); jc_fwprint(stderr, current, 1);
-  exit_status = EXIT_FAILURE;
+  fprintf(err, "\nwarning: couldn't revert the file to its original name\n");
+  fprintf(err, "original: "); jc_fwprint(err, orig, 1);
+  fprintf(err, "current:  "); jc_fwprint(err, current, 1);
+  action_failed();
   return;
 }
 
 
-/* linktype: 0=symlink, 1=hardlink, 2=clonefile() */
-void linkfiles(file_t *files, const int linktype, const int only_current)
+/* Link every file in one duplicate set to the first file
+ * ctx points to the linktype (see linkfiles()) */
+static void link_set(file_t * const restrict files, FILE * const restrict out,
+		FILE * const restrict err, void * const restrict ctx)
 {
-  static file_t *tmpfile;
-  static file_t *srcfile;
-  static file_t *curfile;
-  static file_t ** restrict dupelist;
-  static unsigned int counter = 0;
-  static unsigned int max = 0;
-  static unsigned int x = 0;
-  static size_t name_len = 0;
-  static int i, success;
+  const int linktype = *(const int *)ctx;
+  file_t *tmpfile;
+  file_t *srcfile;
+  file_t **dupelist;
+  unsigned int counter;
+  unsigned int x;
+  size_t name_len;
+  int i, success;
+  char tmpname[PATHBUF_SIZE * 2];
 #ifndef NO_SYMLINKS
-  static unsigned int symsrc;
-  static char rel_path[PATHBUF_SIZE];
+  unsigned int symsrc = 0;
+  char rel_path[PATHBUF_SIZE];
 #endif
-#if defined ON_WINDOWS || defined ENABLE_CLONEFILE_LINK
-  static struct JC_STAT s;
+#if defined ON_WINDOWS || defined ENABLE_CLONEFILE_LINK || (defined ENABLE_FICLONE_LINK && !defined NO_HASHDB)
+  struct JC_STAT s;
 #endif
 #ifdef ENABLE_CLONEFILE_LINK
-  static unsigned int srcfile_preserved_flags = 0;
-  static unsigned int dupfile_preserved_flags = 0;
-  static unsigned int dupfile_original_flags = 0;
-  static struct timeval dupfile_original_tval[2];
+  unsigned int srcfile_preserved_flags = 0;
+  unsigned int dupfile_preserved_flags = 0;
+  unsigned int dupfile_original_flags = 0;
+  struct timeval dupfile_original_tval[2];
 #endif
+#ifdef ENABLE_LINKAT
+  struct dir_handle srcdir, destdir;
 
-  LOUD(fprintf(stderr, "linkfiles(%d): %p\n", linktype, files);)
-  curfile = files;
-
-  /* Calculate a maximum */
-  while (curfile) {
-    if (ISFLAG(curfile->flags, FF_HAS_DUPES)) {
-      counter = 1;
-      tmpfile = curfile->duplicates;
-      while (tmpfile) {
-       counter++;
-       tmpfile = tmpfile->duplicates;
-      }
-
-      if (counter > max) max = counter;
-    }
-    curfile = curfile->next;
-  }
-
-  max++;
-
-  dupelist = (file_t**) malloc(sizeof(file_t*) * max);
-
-  if (!dupelist) jc_oom("linkfiles() dupelist");
-
-  while (files) {
-    if (ISFLAG(files->flags, FF_HAS_DUPES)) {
-      counter = 1;
-      dupelist[counter] = files;
+  srcdir.fd = destdir.fd = -1;
+#endif
 
-      tmpfile = files->duplicates;
+  counter = 1;
+  for (tmpfile = files->duplicates; tmpfile; tmpfile = tmpfile->duplicates) counter++;
+  dupelist = (file_t **)malloc(sizeof(file_t *) * (counter + 1));
+  if (!dupelist) jc_oom("link_set() dupelist");
 
-      while (tmpfile) {
-       counter++;
-       dupelist[counter] = tmpfile;
-       tmpfile = tmpfile->duplicates;
-      }
+  counter = 1;
+  dupelist[counter] = files;
+  for (tmpfile = files->duplicates; tmpfile; tmpfile = tmpfile->duplicates) {
+    counter++;
+    dupelist[counter] = tmpfile;
+  }
 
-      /* Link every file to the first file */
+  /* Link every file to the first file */
 
-      if (linktype != 0) {
+  if (linktype != 0) {
 #ifndef NO_HARDLINKS
-        x = 2;
-        srcfile = dupelist[1];
+    x = 2;
+    srcfile = dupelist[1];
 #else
-        linkfiles_nosupport("hard", "hard link");
+    linkfiles_nosupport("hard", "hard link");
 #endif
-      } else {
+  } else {
 #ifndef NO_SYMLINKS
-        x = 1;
-        /* Symlinks should target a normal file if one exists */
-        srcfile = NULL;
-        for (symsrc = 1; symsrc <= counter; symsrc++) {
-          if (!ISFLAG(dupelist[symsrc]->flags, FF_IS_SYMLINK)) {
-            srcfile = dupelist[symsrc];
-            break;
-          }
-        }
-        /* If no normal file exists, abort */
-        if (srcfile == NULL) goto linkfile_loop;
+    x = 1;
+    /* Symlinks should target a normal file if one exists */
+    srcfile = NULL;
+    for (symsrc = 1; symsrc <= counter; symsrc++) {
+      if (!ISFLAG(dupelist[symsrc]->flags, FF_IS_SYMLINK)) {
+        srcfile = dupelist[symsrc];
+        break;
+      }
+    }
+    /* If no normal file exists, abort */
+    if (srcfile == NULL) goto linkfile_done;
 #else
-        linkfiles_nosupport("soft", "symlink");
+    linkfiles_nosupport("soft", "symlink");
 #endif
-      }
-      if (!ISFLAG(flags, F_HIDEPROGRESS)) {
-        printf("[SRC] "); jc_fwprint(stdout, srcfile->d_name, 1);
-      }
-      if (linktype == 2) {
+  }
+  if (!ISFLAG(flags, F_HIDEPROGRESS)) {
+    fprintf(out, "[SRC] "); jc_fwprint(out, srcfile->d_name, 1);
+  }
+  if (linktype == 2) {
 #ifdef ENABLE_CLONEFILE_LINK
-        if (jc_stat(srcfile->d_name, &s) != 0) {
-          fprintf(stderr, "warning: stat() on source file failed, skipping:\n[SRC] ");
-          jc_fwprint(stderr, srcfile->d_name, 1);
-          exit_status = EXIT_FAILURE;
-          goto linkfile_loop;
-        }
+    if (jc_stat(srcfile->d_name, &s) != 0) {
+      fprintf(err, "warning: stat() on source file failed, skipping:\n[SRC] ");
+      jc_fwprint(err, srcfile->d_name, 1);
+      action_failed();
+      goto linkfile_done;
+    }
 
-        /* macOS unexpectedly copies the compressed flag when copying metadata
-         * (which can result in files being unreadable), so we want to retain
-         * the compression flag of srcfile */
-        srcfile_preserved_flags = s.st_flags & UF_COMPRESSED;
-#else
-        linkfiles_nosupport("clone", "clonefile");
+    /* macOS unexpectedly copies the compressed flag when copying metadata
+     * (which can result in files being unreadable), so we want to retain
+     * the compression flag of srcfile */
+    srcfile_preserved_flags = s.st_flags & UF_COMPRESSED;
+#elif !defined ENABLE_FICLONE_LINK
+    linkfiles_nosupport("clone", "clonefile");
 #endif
-      }
-      for (; x <= counter; x++) {
-        if (linktype == 1 || linktype == 2) {
-          /* Can't hard link files on different devices */
-          if (srcfile->device != dupelist[x]->device) {
-            fprintf(stderr, "warning: hard link target on different device, not linking:\n-//-> ");
-            jc_fwprint(stderr, dupelist[x]->d_name, 1);
-            exit_status = EXIT_FAILURE;
-            continue;
-          } else {
-            /* The devices for the files are the same, but we still need to skip
-             * anything that is already hard linked (-L and -H both set) */
-            if (srcfile->inode == dupelist[x]->inode) {
-              /* Don't show == arrows when not matching against other hard links */
-              if (ISFLAG(flags, F_CONSIDERHARDLINKS))
-                if (!ISFLAG(flags, F_HIDEPROGRESS)) {
-                  printf("-==-> "); jc_fwprint(stdout, dupelist[x]->d_name, 1);
-                }
-              continue;
+  }
+  for (; x <= counter; x++) {
+    if (linktype == 1 || linktype == 2) {
+      /* Can't hard link files on different devices */
+      if (srcfile->device != dupelist[x]->device) {
+        fprintf(err, "warning: hard link target on different device, not linking:\n-//-> ");
+        jc_fwprint(err, dupelist[x]->d_name, 1);
+        action_failed();
+        continue;
+      } else {
+        /* The devices for the files are the same, but we still need to skip
+         * anything that is already hard linked (-L and -H both set) */
+        if (srcfile->inode == dupelist[x]->inode) {
+          /* Don't show == arrows when not matching against other hard links */
+          if (ISFLAG(flags, F_CONSIDERHARDLINKS))
+            if (!ISFLAG(flags, F_HIDEPROGRESS)) {
+              fprintf(out, "-==-> "); jc_fwprint(out, dupelist[x]->d_name, 1);
             }
-          }
-        } else {
-          /* Symlink prerequisite check code can go here */
-          /* Do not attempt to symlink a file to itself or to another symlink */
+          continue;
+        }
+      }
+    } else {
+      /* Symlink prerequisite check code can go here */
+      /* Do not attempt to symlink a file to itself or to another symlink */
 #ifndef NO_SYMLINKS
-          if (ISFLAG(dupelist[x]->flags, FF_IS_SYMLINK) &&
-              ISFLAG(dupelist[symsrc]->flags, FF_IS_SYMLINK)) continue;
-          if (x == symsrc) continue;
+      if (ISFLAG(dupelist[x]->flags, FF_IS_SYMLINK) &&
+          ISFLAG(dupelist[symsrc]->flags, FF_IS_SYMLINK)) continue;
+      if (x == symsrc) continue;
 #endif
+    }
+
+#ifdef ENABLE_LINKAT
+    if (linktype == 1 && !ISFLAG(srcfile->flags, FF_IS_SYMLINK) && !ISFLAG(dupelist[x]->flags, FF_IS_SYMLINK)) {
+      errno = 0;
+      i = hardlink_at(&srcdir, &destdir, srcfile, dupelist[x]);
+      if (i == LINKAT_READONLY) {
+        fprintf(err, "warning: link target is a read-only file, not linking:\n-//-> ");
+        jc_fwprint(err, dupelist[x]->d_name, 1);
+        action_failed();
+      } else if (i == LINKAT_SRC_CHANGED) {
+        fprintf(err, "warning: source file modified since scanned; changing source file:\n[SRC] ");
+        jc_fwprint(err, dupelist[x]->d_name, 1);
+        srcfile = dupelist[x];
+        action_failed();
+      } else if (i == LINKAT_DEST_CHANGED) {
+        fprintf(err, "warning: target file modified since scanned, not linking:\n-//-> ");
+        jc_fwprint(err, dupelist[x]->d_name, 1);
+        action_failed();
+      } else if (i != 0) {
+        action_failed();
+        if (!ISFLAG(flags, F_HIDEPROGRESS)) {
+          fprintf(out, "-//-> "); jc_fwprint(out, dupelist[x]->d_name, 1);
+        }
+        fprintf(err, "warning: unable to link '"); jc_fwprint(err, dupelist[x]->d_name, 0);
+        fprintf(err, "' -> '"); jc_fwprint(err, srcfile->d_name, 0);
+        fprintf(err, "': %s\n", strerror(errno));
+      } else {
+        if (!ISFLAG(flags, F_HIDEPROGRESS)) {
+          fprintf(out, "----> "); jc_fwprint(out, dupelist[x]->d_name, 1);
         }
+ #ifndef NO_HASHDB
+        /* Delete the hashdb entry for new hard links */
+        if (ISFLAG(flags, F_HASHDB)) {
+          dupelist[x]->mtime = 0;
+          action_lock();
+          add_hashdb_entry(NULL, 0, dupelist[x]);
+          action_unlock();
+        }
+ #endif
+      }
+      continue;
+    }
+#endif /* ENABLE_LINKAT */
 
-        /* Do not attempt to hard link files for which we don't have write access */
+    /* Do not attempt to hard link files for which we don't have write access */
 	if (
 #ifdef ON_WINDOWS
-        !S_ISRO(dupelist[x]->mode) &&
+    !S_ISRO(dupelist[x]->mode) &&
 #endif
-        (jc_access(dupelist[x]->d_name, JC_W_OK) != 0))
-        {
-          fprintf(stderr, "warning: link target is a read-only file, not linking:\n-//-> ");
-          jc_fwprint(stderr, dupelist[x]->d_name, 1);
-          exit_status = EXIT_FAILURE;
-          continue;
-        }
-        /* Check file pairs for modification before linking */
-        /* Safe linking: don't actually delete until the link succeeds */
-        i = file_has_changed(srcfile);
-        if (i) {
-          fprintf(stderr, "warning: source file modified since scanned; changing source file:\n[SRC] ");
-          jc_fwprint(stderr, dupelist[x]->d_name, 1);
-          LOUD(fprintf(stderr, "file_has_changed: %d\n", i);)
-          srcfile = dupelist[x];
-          exit_status = EXIT_FAILURE;
-          continue;
-        }
-        if (file_has_changed(dupelist[x])) {
-          fprintf(stderr, "warning: target file modified since scanned, not linking:\n-//-> ");
-          jc_fwprint(stderr, dupelist[x]->d_name, 1);
-          exit_status = EXIT_FAILURE;
-          continue;
-        }
+    (jc_access(dupelist[x]->d_name, JC_W_OK) != 0))
+    {
+      fprintf(err, "warning: link target is a read-only file, not linking:\n-//-> ");
+      jc_fwprint(err, dupelist[x]->d_name, 1);
+      action_failed();
+      continue;
+    }
+    /* Check file pairs for modification before linking */
+    /* Safe linking: don't actually delete until the link succeeds */
+    i = file_has_changed(srcfile);
+    if (i) {
+      fprintf(err, "warning: source file modified since scanned; changing source file:\n[SRC] ");
+      jc_fwprint(err, dupelist[x]->d_name, 1);
+      LOUD(fprintf(err, "file_has_changed: %d\n", i);)
+      srcfile = dupelist[x];
+      action_failed();
+      continue;
+    }
+    if (file_has_changed(dupelist[x])) {
+      fprintf(err, "warning: target file modified since scanned, not linking:\n-//-> ");
+      jc_fwprint(err, dupelist[x]->d_name, 1);
+      action_failed();
+      continue;
+    }
 #ifdef ON_WINDOWS
-        /* For Windows, the hard link count maximum is 1023 (+1); work around
-         * by skipping linking or changing the link source file as needed */
-        if (jc_stat(srcfile->d_name, &s) != 0) {
-          fprintf(stderr, "warning: win_stat() on source file failed, changing source file:\n[SRC] ");
-          jc_fwprint(stderr, dupelist[x]->d_name, 1);
-          srcfile = dupelist[x];
-          exit_status = EXIT_FAILURE;
-          continue;
-        }
-        if (s.st_nlink >= 1024) {
-          fprintf(stderr, "warning: maximum source link count reached, changing source file:\n[SRC] ");
-          srcfile = dupelist[x];
-          exit_status = EXIT_FAILURE;
-          continue;
-        }
-        if (jc_stat(dupelist[x]->d_name, &s) != 0) continue;
-        if (s.st_nlink >= 1024) {
-          fprintf(stderr, "warning: maximum destination link count reached, skipping:\n-//-> ");
-          jc_fwprint(stderr, dupelist[x]->d_name, 1);
-          exit_status = EXIT_FAILURE;
-          continue;
-        }
+    /* For Windows, the hard link count maximum is 1023 (+1); work around
+     * by skipping linking or changing the link source file as needed */
+    if (jc_stat(srcfile->d_name, &s) != 0) {
+      fprintf(err, "warning: win_stat() on source file failed, changing source file:\n[SRC] ");
+      jc_fwprint(err, dupelist[x]->d_name, 1);
+      srcfile = dupelist[x];
+      action_failed();
+      continue;
+    }
+    if (s.st_nlink >= 1024) {
+      fprintf(err, "warning: maximum source link count reached, changing source file:\n[SRC] ");
+      srcfile = dupelist[x];
+      action_failed();
+      continue;
+    }
+    if (jc_stat(dupelist[x]->d_name, &s) != 0) continue;
+    if (s.st_nlink >= 1024) {
+      fprintf(err, "warning: maximum destination link count reached, skipping:\n-//-> ");
+      jc_fwprint(err, dupelist[x]->d_name, 1);
+      action_failed();
+      continue;
+    }
 #endif
 #ifdef ENABLE_CLONEFILE_LINK
-        if (linktype == 2) {
-          if (jc_stat(dupelist[x]->d_name, &s) != 0) {
-            fprintf(stderr, "warning: stat() on destination file failed, skipping:\n-##-> ");
-            jc_fwprint(stderr, dupelist[x]->d_name, 1);
-            exit_status = EXIT_FAILURE;
-            continue;
-          }
-
-          /* macOS unexpectedly copies the compressed flag when copying metadata
-           * (which can result in files being unreadable), so we want to ignore
-           * the compression flag on dstfile in favor of the one from srcfile */
-          dupfile_preserved_flags = s.st_flags & ~(unsigned int)UF_COMPRESSED;
-          dupfile_original_flags = s.st_flags;
-          dupfile_original_tval[0].tv_sec = s.st_atime;
-          dupfile_original_tval[1].tv_sec = s.st_mtime;
-          dupfile_original_tval[0].tv_usec = 0;
-          dupfile_original_tval[1].tv_usec = 0;
-        }
+    if (linktype == 2) {
+      if (jc_stat(dupelist[x]->d_name, &s) != 0) {
+        fprintf(err, "warning: stat() on destination file failed, skipping:\n-##-> ");
+        jc_fwprint(err, dupelist[x]->d_name, 1);
+        action_failed();
+        continue;
+      }
+
+      /* macOS unexpectedly copies the compressed flag when copying metadata
+       * (which can result in files being unreadable), so we want to ignore
+       * the compression flag on dstfile in favor of the one from srcfile */
+      dupfile_preserved_flags = s.st_flags & ~(unsigned int)UF_COMPRESSED;
+      dupfile_original_flags = s.st_flags;
+      dupfile_original_tval[0].tv_sec = s.st_atime;
+      dupfile_original_tval[1].tv_sec = s.st_mtime;
+      dupfile_original_tval[0].tv_usec = 0;
+      dupfile_original_tval[1].tv_usec = 0;
+    }
 #endif
 
-        /* Make sure the name will fit in the buffer before trying */
-        name_len = strlen(dupelist[x]->d_name) + 14;
-        if (name_len > PATHBUF_SIZE) continue;
-        /* Assemble a temporary file name */
-        strcpy(tempname, dupelist[x]->d_name);
-        strcat(tempname, ".__jdupes__.tmp");
-        /* Rename the destination file to the temporary name */
-        i = jc_rename(dupelist[x]->d_name, tempname);
-        if (i != 0) {
-          fprintf(stderr, "warning: cannot move link target to a temporary name, not linking:\n-//-> ");
-          jc_fwprint(stderr, dupelist[x]->d_name, 1);
-          exit_status = EXIT_FAILURE;
-          /* Just in case the rename succeeded yet still returned an error, roll back the rename */
-          jc_rename(tempname, dupelist[x]->d_name);
-          continue;
-        }
+    /* Make sure the name will fit in the buffer before trying */
+    name_len = strlen(dupelist[x]->d_name) + 14;
+    if (name_len > PATHBUF_SIZE) continue;
+    /* Assemble a temporary file name */
+    strcpy(tmpname, dupelist[x]->d_name);
+    strcat(tmpname, ".__jdupes__.tmp");
+    /* Rename the destination file to the temporary name */
+    i = jc_rename(dupelist[x]->d_name, tmpname);
+    if (i != 0) {
+      fprintf(err, "warning: cannot move link target to a temporary name, not linking:\n-//-> ");
+      jc_fwprint(err, dupelist[x]->d_name, 1);
+      action_failed();
+      /* Just in case the rename succeeded yet still returned an error, roll back the rename */
+      jc_rename(tmpname, dupelist[x]->d_name);
+      continue;
+    }
 
-        /* Create the desired hard link with the original file's name */
-        errno = 0;
-        success = 0;
-        if (linktype == 1) {
-          if (jc_link(srcfile->d_name, dupelist[x]->d_name) == 0) success = 1;
+    /* Create the desired hard link with the original file's name */
+    errno = 0;
+    success = 0;
+    if (linktype == 1) {
+      if (jc_link(srcfile->d_name, dupelist[x]->d_name) == 0) success = 1;
 #ifdef ENABLE_CLONEFILE_LINK
-        } else if (linktype == 2) {
-          if (clonefile(srcfile->d_name, dupelist[x]->d_name, 0) == 0) {
-            if (copyfile(tempname, dupelist[x]->d_name, NULL, COPYFILE_METADATA) == 0) {
-              /* If the preserved flags match what we just copied from the original dupfile, we're done.
-               * Otherwise, we need to update the flags to avoid data loss due to differing compression flags */
-              if (dupfile_original_flags == (srcfile_preserved_flags | dupfile_preserved_flags)) {
-                success = 1;
-              } else if (chflags(dupelist[x]->d_name, srcfile_preserved_flags | dupfile_preserved_flags) == 0) {
-                /* chflags overrides the timestamps that were restored by copyfile, so we need to reapply those as well */
-                if (utimes(dupelist[x]->d_name, dupfile_original_tval) == 0) {
-                  success = 1;
-                } else clonefile_error("utimes", dupelist[x]->d_name);
-              } else clonefile_error("chflags", dupelist[x]->d_name);
-            } else clonefile_error("copyfile", dupelist[x]->d_name);
-          } else clonefile_error("clonefile", dupelist[x]->d_name);
+    } else if (linktype == 2) {
+      if (clonefile(srcfile->d_name, dupelist[x]->d_name, 0) == 0) {
+        if (copyfile(tmpname, dupelist[x]->d_name, NULL, COPYFILE_METADATA) == 0) {
+          /* If the preserved flags match what we just copied from the original dupfile, we're done.
+           * Otherwise, we need to update the flags to avoid data loss due to differing compression flags */
+          if (dupfile_original_flags == (srcfile_preserved_flags | dupfile_preserved_flags)) {
+            success = 1;
+          } else if (chflags(dupelist[x]->d_name, srcfile_preserved_flags | dupfile_preserved_flags) == 0) {
+            /* chflags overrides the timestamps that were restored by copyfile, so we need to reapply those as well */
+            if (utimes(dupelist[x]->d_name, dupfile_original_tval) == 0) {
+              success = 1;
+            } else clonefile_error(err, "utimes", dupelist[x]->d_name);
+          } else clonefile_error(err, "chflags", dupelist[x]->d_name);
+        } else clonefile_error(err, "copyfile", dupelist[x]->d_name);
+      } else clonefile_error(err, "clonefile", dupelist[x]->d_name);
 #endif /* ENABLE_CLONEFILE_LINK */
-        }
+#ifdef ENABLE_FICLONE_LINK
+    } else if (linktype == 2) {
+      if (ficlone_file(srcfile->d_name, dupelist[x]->d_name, tmpname) == 0) success = 1;
+#endif /* ENABLE_FICLONE_LINK */
+    }
 #ifndef NO_SYMLINKS
-        else {
-          i = jc_make_relative_link_name(srcfile->d_name, dupelist[x]->d_name, rel_path);
-          LOUD(fprintf(stderr, "symlink MRLN: %s to %s = %s\n", srcfile->d_name, dupelist[x]->d_name, rel_path));
-          if (i < 0) {
-            fprintf(stderr, "warning: make_relative_link_name() failed (%d)\n", i);
-          } else if (i == 1) {
-            fprintf(stderr, "warning: files to be linked have the same canonical path; not linking\n");
-          } else if (symlink(rel_path, dupelist[x]->d_name) == 0) success = 1;
-        }
+    else {
+      action_lock();
+      i = jc_make_relative_link_name(srcfile->d_name, dupelist[x]->d_name, rel_path);
+      action_unlock();
+      LOUD(fprintf(err, "symlink MRLN: %s to %s = %s\n", srcfile->d_name, dupelist[x]->d_name, rel_path));
+      if (i < 0) {
+        fprintf(err, "warning: make_relative_link_name() failed (%d)\n", i);
+      } else if (i == 1) {
+        fprintf(err, "warning: files to be linked have the same canonical path; not linking\n");
+      } else if (symlink(rel_path, dupelist[x]->d_name) == 0) success = 1;
+    }
 #endif /* NO_SYMLINKS */
-        if (success) {
-          if (!ISFLAG(flags, F_HIDEPROGRESS)) {
-            switch (linktype) {
-              case 0: /* symlink */
-                printf("-@@-> ");
-                break;
-              default:
-              case 1: /* hardlink */
-                printf("----> ");
-                break;
-#ifdef ENABLE_CLONEFILE_LINK
-              case 2: /* clonefile */
-                printf("-##-> ");
-                break;
+    if (success) {
+      if (!ISFLAG(flags, F_HIDEPROGRESS)) {
+        switch (linktype) {
+          case 0: /* symlink */
+            fprintf(out, "-@@-> ");
+            break;
+          default:
+          case 1: /* hardlink */
+            fprintf(out, "----> ");
+            break;
+#if defined ENABLE_CLONEFILE_LINK || defined ENABLE_FICLONE_LINK
+          case 2: /* clonefile */
+            fprintf(out, "-##-> ");
+            break;
 #endif
-            }
-            jc_fwprint(stdout, dupelist[x]->d_name, 1);
-          }
+        }
+        jc_fwprint(out, dupelist[x]->d_name, 1);
+      }
 #ifndef NO_HASHDB
-          /* Delete the hashdb entry for new hard/symbolic links */
-          if (linktype != 2 && ISFLAG(flags, F_HASHDB)) {
-            dupelist[x]->mtime = 0;
-            add_hashdb_entry(NULL, 0, dupelist[x]);
-          }
+      /* Delete the hashdb entry for new hard/symbolic links; a clone has
+       * the same data in a new inode, so its entry follows that inode */
+      if (ISFLAG(flags, F_HASHDB)) {
+#if defined ENABLE_CLONEFILE_LINK || defined ENABLE_FICLONE_LINK
+        if (linktype == 2 && jc_stat(dupelist[x]->d_name, &s) == 0) {
+          dupelist[x]->inode = s.st_ino;
+          dupelist[x]->device = s.st_dev;
+          dupelist[x]->mtime = s.st_mtime;
+        } else
 #endif
-        } else {
-          /* The link failed. Warn the user and put the link target back */
-          exit_status = EXIT_FAILURE;
-          if (!ISFLAG(flags, F_HIDEPROGRESS)) {
-            printf("-//-> "); jc_fwprint(stdout, dupelist[x]->d_name, 1);
-          }
-          fprintf(stderr, "warning: unable to link '"); jc_fwprint(stderr, dupelist[x]->d_name, 0);
-          fprintf(stderr, "' -> '"); jc_fwprint(stderr, srcfile->d_name, 0);
-          fprintf(stderr, "': %s\n", strerror(errno));
-          i = jc_rename(tempname, dupelist[x]->d_name);
-          if (i != 0) revert_failed(dupelist[x]->d_name, tempname);
-          continue;
-        }
+        dupelist[x]->mtime = 0;
+        action_lock();
+        add_hashdb_entry(NULL, 0, dupelist[x]);
+        action_unlock();
+      }
+#endif
+    } else {
+      /* The link failed. Warn the user and put the link target back */
+      action_failed();
+      if (!ISFLAG(flags, F_HIDEPROGRESS)) {
+        fprintf(out, "-//-> "); jc_fwprint(out, dupelist[x]->d_name, 1);
+      }
+      fprintf(err, "warning: unable to link '"); jc_fwprint(err, dupelist[x]->d_name, 0);
+      fprintf(err, "' -> '"); jc_fwprint(err, srcfile->d_name, 0);
+      fprintf(err, "': %s\n", strerror(errno));
+      i = jc_rename(tmpname, dupelist[x]->d_name);
+      if (i != 0) revert_failed(err, dupelist[x]->d_name, tmpname);
+      continue;
+    }
 
-        /* Remove temporary file to clean up; if we can't, reverse the linking */
-        i = jc_remove(tempname);
-        if (i != 0) {
-          /* If the temp file can't be deleted, there may be a permissions problem
-           * so reverse the process and warn the user */
-          fprintf(stderr, "\nwarning: can't delete temp file, reverting: ");
-          jc_fwprint(stderr, tempname, 1);
-          exit_status = EXIT_FAILURE;
-          i = jc_remove(dupelist[x]->d_name);
-          /* This last error really should not happen, but we can't assume it won't */
-          if (i != 0) fprintf(stderr, "\nwarning: couldn't remove link to restore original file\n");
-          else {
-            i = jc_rename(tempname, dupelist[x]->d_name);
-            if (i != 0) revert_failed(dupelist[x]->d_name, tempname);
-          }
-        }
+    /* Remove temporary file to clean up; if we can't, reverse the linking */
+    i = jc_remove(tmpname);
+    if (i != 0) {
+      /* If the temp file can't be deleted, there may be a permissions problem
+       * so reverse the process and warn the user */
+      fprintf(err, "\nwarning: can't delete temp file, reverting: ");
+      jc_fwprint(err, tmpname, 1);
+      action_failed();
+      i = jc_remove(dupelist[x]->d_name);
+      /* This last error really should not happen, but we can't assume it won't */
+      if (i != 0) fprintf(err, "\nwarning: couldn't remove link to restore original file\n");
+      else {
+        i = jc_rename(tmpname, dupelist[x]->d_name);
+        if (i != 0) revert_failed(err, dupelist[x]->d_name, tmpname);
       }
-      if (!ISFLAG(flags, F_HIDEPROGRESS)) printf("\n");
     }
+  }
+  if (!ISFLAG(flags, F_HIDEPROGRESS)) fprintf(out, "\n");
+
 #if !defined NO_SYMLINKS || defined ENABLE_CLONEFILE_LINK
-linkfile_loop:
+linkfile_done:
 #endif
-    if (only_current == 1) break;
-    files = files->next;
-  }
+#ifdef ENABLE_LINKAT
+  if (srcdir.fd != -1) close(srcdir.fd);
+  if (destdir.fd != -1) close(destdir.fd);
+#endif
+  free(dupelist);
+  return;
+}
 
-  if (counter == 0) printf("%s", s_no_dupes);
 
-  free(dupelist);
+/* linktype: 0=symlink, 1=hardlink, 2=clonefile() (macOS) or FICLONE (Linux) */
+void linkfiles(file_t *files, const int linktype, const int only_current)
+{
+  int type = linktype;
+
+  LOUD(fprintf(stderr, "linkfiles(%d): %p\n", linktype, files);)
+
+  if (only_current == 1) {
+    if (ISFLAG(files->flags, FF_HAS_DUPES)) link_set(files, stdout, stderr, &type);
+    return;
+  }
+  if (run_set_actions(files, link_set, &type) == 0) printf("%s", s_no_dupes);
   return;
 }
 #endif /* NO_HARDLINKS + NO_SYMLINKS + !ENABLE_DEDUPE */
@@ -24,6 +24,11 @@
 #define PATH_MAX 1024
 #endif
 
+/* --ndjson output is collected here and written with one call per batch */
+#define NDJSON_BUFSIZE (1024 * 1024)
+static char *ndbuf = NULL;
+static size_t ndlen = 0;
+
 /** Decodes a single UTF-8 codepoint, consuming bytes. */
 static inline uint32_t decode_utf8(const char * restrict * const string) {
   uint32_t ret = 0;
@@ -166,4 +171,157 @@ void printjson(file_t * restrict files, const int argc, char **argv)
   return;
 }
 
+
+/* Write out everything buffered so far */
+static void nd_flush(void)
+{
+  if (ndlen == 0) return;
+  if (fwrite(ndbuf, 1, ndlen, stdout) != ndlen) exit_status = EXIT_FAILURE;
+  fflush(stdout);
+  ndlen = 0;
+  return;
+}
+
+
+/* Make room for 'need' more bytes; 'need' must fit in an empty buffer */
+static inline void nd_reserve(const size_t need)
+{
+  if (unlikely(ndbuf == NULL)) {
+    ndbuf = (char *)malloc(NDJSON_BUFSIZE);
+    if (ndbuf == NULL) jc_oom("nd_reserve()");
+  }
+  if (ndlen + need > NDJSON_BUFSIZE) nd_flush();
+  return;
+}
+
+
+static inline void nd_puts(const char * const restrict s, const size_t len)
+{
+  nd_reserve(len);
+  memcpy(ndbuf + ndlen, s, len);
+  ndlen += len;
+  return;
+}
+#define ND_PUTS(a) nd_puts(a, sizeof(a) - 1)
+
+
+static void nd_number(const uintmax_t n)
+{
+  nd_reserve(24);
+  ndlen += (size_t)sprintf(ndbuf + ndlen, "%" PRIuMAX, n);
+  return;
+}
+
+
+/* Hashes are strings; JSON numbers can't carry 64 bits everywhere */
+static void nd_hash(const char * const restrict name, const size_t namelen,
+		const uint64_t hash, const int valid)
+{
+  nd_puts(name, namelen);
+  nd_reserve(24);
+  if (valid) ndlen += (size_t)sprintf(ndbuf + ndlen, "\"%016" PRIx64 "\"", hash);
+  else {
+    memcpy(ndbuf + ndlen, "null", 4);
+    ndlen += 4;
+  }
+  return;
+}
+
+
+/* Escape a path straight into the output buffer. Runs of printable ASCII
+ * are copied as they are; anything else goes through the UTF-8 decoder.
+ * A byte that isn't part of well-formed UTF-8 is written as the lone low
+ * surrogate U+DC80 + (byte - 0x80), which -F/--replay turns back into the
+ * same byte, so any path survives the round trip */
+static void nd_escape(const char * restrict string)
+{
+  const size_t len = strlen(string);
+  const char *run;
+  char *out;
+  uint32_t curr;
+
+  /* Worst case is six output bytes for each input byte */
+  nd_reserve(len * 6);
+  out = ndbuf + ndlen;
+  while (*string != '\0') {
+    run = string;
+    while ((unsigned char)*string >= 0x20 && (unsigned char)*string < 0x80 && *string != '\"' && *string != '\\') string++;
+    if (string != run) {
+      memcpy(out, run, (size_t)(string - run));
+      out += string - run;
+      continue;
+    }
+    if (*string == '\0') break;
+    if (*string == '\"' || *string == '\\') {
+      *out++ = '\\';
+      *out++ = *string++;
+      continue;
+    }
+    if (!(*string & 0x80)) {
+      escape_uni16((uint16_t)*string++, &out);
+      continue;
+    }
+    {
+      const unsigned char lead = (unsigned char)*string;
+      const unsigned char next = (unsigned char)string[1];
+      int n = (lead >= 0xc2 && lead <= 0xdf) ? 2 : (lead & 0xf0) == 0xe0 ? 3 : (lead >= 0xf0 && lead <= 0xf4) ? 4 : 0;
+
+      for (int i = 1; i < n; i++) if (!IS_CONT(string[i])) n = 0;
+      /* Overlong forms, surrogates and code points past U+10FFFF would
+       * not come back as the same bytes */
+      if ((lead == 0xe0 && next < 0xa0) || (lead == 0xed && next > 0x9f)
+          || (lead == 0xf0 && next < 0x90) || (lead == 0xf4 && next > 0x8f)) n = 0;
+      if (n == 0) {
+        escape_uni16((uint16_t)(0xdc00 | lead), &out);
+        string++;
+        continue;
+      }
+    }
+    curr = decode_utf8(&string);
+    if (curr < 0x10000) escape_uni16((uint16_t)curr, &out);
+    else {
+      curr -= 0x10000;
+      escape_uni16((uint16_t)(0xD800 + ((curr >> 10) & 0x03ff)), &out);
+      escape_uni16((uint16_t)(0xDC00 + (curr & 0x03ff)), &out);
+    }
+  }
+  ndlen = (size_t)(out - ndbuf);
+  return;
+}
+
+
+/* Write each duplicate set as one line of JSON (--ndjson); called for
+ * every group of sets as soon as it is complete (see stream.c) */
+void printndjson(file_t * restrict files)
+{
+  LOUD(fprintf(stderr, "printndjson: %p\n", files));
+
+  for (; files != NULL; files = files->next) {
+    if (!ISFLAG(files->flags, FF_HAS_DUPES)) continue;
+    ND_PUTS("{\"fileSize\":");
+    nd_number((uintmax_t)files->size);
+    nd_hash(",\"partialHash\":", 15, files->filehash_partial, ISFLAG(files->flags, FF_HASH_PARTIAL));
+    nd_hash(",\"fullHash\":", 12, files->filehash, ISFLAG(files->flags, FF_HASH_FULL));
+    ND_PUTS(",\"fileList\":[");
+    for (const file_t *f = files; f != NULL; f = f->duplicates) {
+      ND_PUTS("{\"filePath\":\"");
+      nd_escape(f->d_name);
+      ND_PUTS("\",\"inode\":");
+      nd_number((uintmax_t)f->inode);
+      ND_PUTS(",\"device\":");
+      nd_number((uintmax_t)f->device);
+#ifndef NO_MTIME
+      /* Lets --replay tell whether the file changed since */
+      nd_reserve(32);
+      ndlen += (size_t)sprintf(ndbuf + ndlen, ",\"mtime\":%" PRIdMAX, (intmax_t)f->mtime);
+#endif
+      if (f->duplicates != NULL) ND_PUTS("},");
+      else ND_PUTS("}");
+    }
+    ND_PUTS("]}\n");
+  }
+  nd_flush();
+  return;
+}
+
 #endif /* NO_JSON */
@@ -12,6 +12,7 @@ extern "C" {
 
 #include "jdupes.h"
 void printjson(file_t * restrict files, const int argc, char ** const restrict argv);
+void printndjson(file_t * restrict files);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,234 @@
+/* jdupes parallel action executor
+ * Deleting, linking and deduplicating cost a few metadata syscalls or a
+ * long ioctl per duplicate set, so on high-latency filesystems the action
+ * phase is mostly spent waiting. With -x athreads:N, sets are handed to N
+ * worker threads. A set never starts while an earlier set touching one of
+ * the same directories is still running, so each directory sees changes
+ * in the same order as a single-threaded run, and the output of each set
+ * is buffered and written out in set order.
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <libjodycode.h>
+#include "likely_unlikely.h"
+#include "jdupes.h"
+#include "actexec.h"
+
+#if !defined ON_WINDOWS && !defined NO_THREADS
+ #include <pthread.h>
+ #define ENABLE_THREADS 1
+#endif
+
+/* Worker threads for actions; 1 = act on sets one at a time */
+int action_threads = 1;
+
+#ifdef ENABLE_THREADS
+#define JOB_WAITING	0
+#define JOB_RUNNING	1
+#define JOB_DONE	2
+
+struct action_job {
+  file_t *set;
+  uint64_t *dirs;   /* Hashes of the directories holding set members */
+  unsigned int ndirs;
+  int state;
+  char *out, *err;  /* Buffered output of the action */
+  size_t outlen, errlen;
+};
+
+static pthread_mutex_t exec_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t exec_cond = PTHREAD_COND_INITIALIZER;
+/* Serializes access to shared state (hash database, counters) */
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+static int parallel = 0;
+static struct action_job *jobs = NULL;
+static unsigned int jobcount = 0, nextjob = 0, emitted = 0;
+static set_action_t job_action;
+static void *job_ctx;
+
+
+/* Hash the directory part of a path; collisions only cost parallelism */
+static uint64_t dir_hash(const char * const restrict path)
+{
+  const char *end = strrchr(path, '/');
+  uint64_t hash = 0xcbf29ce484222325ULL;
+
+  if (end == NULL) return hash;
+  for (const char *p = path; p < end; p++) {
+    hash ^= (unsigned char)*p;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+
+/* Does a set share a directory with any set that is running now? */
+static int job_conflicts(const struct action_job * const restrict job)
+{
+  for (unsigned int i = emitted; i < nextjob; i++) {
+    if (jobs[i].state != JOB_RUNNING) continue;
+    for (unsigned int a = 0; a < job->ndirs; a++)
+      for (unsigned int b = 0; b < jobs[i].ndirs; b++)
+        if (job->dirs[a] == jobs[i].dirs[b]) return 1;
+  }
+  return 0;
+}
+
+
+static void *action_worker(void *arg)
+{
+  (void)arg;
+  pthread_mutex_lock(&exec_lock);
+  for (;;) {
+    struct action_job *job;
+    FILE *out, *err;
+
+    /* Sets start strictly in order; a conflicting set holds up the rest */
+    while (nextjob < jobcount && job_conflicts(&jobs[nextjob]) != 0)
+      pthread_cond_wait(&exec_cond, &exec_lock);
+    if (nextjob >= jobcount) break;
+    job = &jobs[nextjob++];
+    job->state = JOB_RUNNING;
+    pthread_mutex_unlock(&exec_lock);
+
+    out = open_memstream(&job->out, &job->outlen);
+    err = open_memstream(&job->err, &job->errlen);
+    if (out == NULL || err == NULL) jc_oom("action_worker() output");
+    job_action(job->set, out, err, job_ctx);
+    fclose(out);
+    fclose(err);
+
+    pthread_mutex_lock(&exec_lock);
+    job->state = JOB_DONE;
+    pthread_cond_broadcast(&exec_cond);
+  }
+  pthread_mutex_unlock(&exec_lock);
+  return NULL;
+}
+
+
+/* Set up one job per duplicate set; returns the number of sets */
+static unsigned int make_jobs(file_t *files, const unsigned int count)
+{
+  unsigned int n = 0;
+
+  jobs = (struct action_job *)calloc(count, sizeof(struct action_job));
+  if (jobs == NULL) jc_oom("make_jobs()");
+  for (; files != NULL; files = files->next) {
+    struct action_job *job;
+    unsigned int members = 0;
+
+    if (!ISFLAG(files->flags, FF_HAS_DUPES)) continue;
+    job = &jobs[n++];
+    job->set = files;
+    for (file_t *f = files; f != NULL; f = f->duplicates) members++;
+    job->dirs = (uint64_t *)malloc(members * sizeof(uint64_t));
+    if (job->dirs == NULL) jc_oom("make_jobs() dirs");
+    for (file_t *f = files; f != NULL; f = f->duplicates) {
+      uint64_t hash = dir_hash(f->d_name);
+      unsigned int i;
+      for (i = 0; i < job->ndirs && job->dirs[i] != hash; i++);
+      if (i == job->ndirs) job->dirs[job->ndirs++] = hash;
+    }
+  }
+  return n;
+}
+#endif /* ENABLE_THREADS */
+
+
+/* Run an action on every duplicate set, in parallel if -x athreads:N was
+ * given; returns the number of duplicate sets */
+unsigned int run_set_actions(file_t *files, set_action_t action, void *ctx)
+{
+  unsigned int count = 0;
+#ifdef ENABLE_THREADS
+  pthread_t *threads;
+  int started = 0;
+#endif
+
+  if (unlikely(action == NULL)) jc_nullptr("run_set_actions()");
+  for (file_t *f = files; f != NULL; f = f->next) if (ISFLAG(f->flags, FF_HAS_DUPES)) count++;
+
+#ifdef ENABLE_THREADS
+  if (action_threads > 1 && count > 1) {
+    int nthreads = (unsigned int)action_threads < count ? action_threads : (int)count;
+
+    LOUD(fprintf(stderr, "run_set_actions: %u sets, %d threads\n", count, nthreads);)
+    jobcount = make_jobs(files, count);
+    nextjob = emitted = 0;
+    job_action = action;
+    job_ctx = ctx;
+    parallel = 1;
+    fflush(stdout);
+    threads = (pthread_t *)malloc(sizeof(pthread_t) * (size_t)nthreads);
+    if (threads == NULL) jc_oom("run_set_actions() threads");
+    for (int i = 0; i < nthreads; i++) {
+      if (pthread_create(&threads[started], NULL, action_worker, NULL) != 0) break;
+      started++;
+    }
+    /* Without any worker the main thread does all the work */
+    if (started == 0) action_worker(NULL);
+
+    /* Write out each set's output as soon as it and all earlier sets are done */
+    pthread_mutex_lock(&exec_lock);
+    while (emitted < jobcount) {
+      struct action_job *job = &jobs[emitted];
+
+      while (job->state != JOB_DONE) pthread_cond_wait(&exec_cond, &exec_lock);
+      pthread_mutex_unlock(&exec_lock);
+      if (job->errlen > 0) fwrite(job->err, 1, job->errlen, stderr);
+      if (job->outlen > 0) fwrite(job->out, 1, job->outlen, stdout);
+      free(job->out);
+      free(job->err);
+      free(job->dirs);
+      pthread_mutex_lock(&exec_lock);
+      emitted++;
+    }
+    pthread_mutex_unlock(&exec_lock);
+
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    free(threads);
+    free(jobs);
+    jobs = NULL;
+    parallel = 0;
+    return count;
+  }
+#endif /* ENABLE_THREADS */
+
+  for (; files != NULL; files = files->next)
+    if (ISFLAG(files->flags, FF_HAS_DUPES)) action(files, stdout, stderr, ctx);
+  return count;
+}
+
+
+/* Actions take this lock around anything shared between sets */
+void action_lock(void)
+{
+#ifdef ENABLE_THREADS
+  if (parallel != 0) pthread_mutex_lock(&shared_lock);
+#endif
+  return;
+}
+
+
+void action_unlock(void)
+{
+#ifdef ENABLE_THREADS
+  if (parallel != 0) pthread_mutex_unlock(&shared_lock);
+#endif
+  return;
+}
+
+
+/* Actions running in parallel must not set exit_status unlocked */
+void action_failed(void)
+{
+  action_lock();
+  exit_status = EXIT_FAILURE;
+  action_unlock();
+  return;
+}
@@ -0,0 +1,32 @@
+/* jdupes parallel action executor
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifndef JDUPES_ACTEXEC_H
+#define JDUPES_ACTEXEC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include "jdupes.h"
+
+/* Most worker threads -x athreads:N may ask for */
+#define MAX_ACTION_THREADS 256
+
+/* Acts on one duplicate set; all output must go to 'out' and 'err' */
+typedef void (*set_action_t)(file_t * const restrict set, FILE * const restrict out,
+		FILE * const restrict err, void * const restrict ctx);
+
+extern int action_threads;
+
+unsigned int run_set_actions(file_t *files, set_action_t action, void *ctx);
+void action_lock(void);
+void action_unlock(void);
+void action_failed(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* JDUPES_ACTEXEC_H */
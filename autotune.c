@@ -0,0 +1,398 @@
+/* jdupes per-device I/O autotuning
+ * The chunk size picked from the CPU cache size suits SSDs but is far too
+ * small for spinning disk arrays. -x autotune benchmarks each device that
+ * holds files being scanned and saves the best chunk size, read-ahead window
+ * and queue depth per filesystem for use by future runs. Device numbers can
+ * change across reboots and hotplug, so a filesystem is known by its ID from
+ * statfs() (derived from its UUID on most Linux filesystems), its type and
+ * where it is mounted.
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef __linux__
+ #include <sys/vfs.h>
+#endif
+
+#include <libjodycode.h>
+#include "likely_unlikely.h"
+#include "jdupes.h"
+#include "autotune.h"
+#include "tune.h"
+
+#ifndef NO_TUNE
+
+/* Files smaller than this are useless for benchmarking */
+#define BENCH_MIN_SIZE 8388608
+/* Amount of data read for each benchmark trial */
+#define BENCH_READ_SIZE 67108864
+/* A larger setting must be this much faster to be preferred (percent) */
+#define BENCH_MARGIN 5
+
+struct tune_profile {
+  uintmax_t fsid;
+  uintmax_t fstype;
+  char *mount;
+  size_t chunk;
+  size_t readahead;
+  int qd;
+};
+
+static struct tune_profile *profiles = NULL;
+static int profile_count = 0, profile_alloc = 0;
+static int profiles_changed = 0;
+
+static const size_t bench_chunks[] = { 65536, 262144, 1048576, 4194304, 0 };
+static const size_t bench_windows[] = { 0, 4, 16, 64, 0 };
+
+
+static char *profile_path(void)
+{
+  static char path[PATHBUF_SIZE];
+  const char *base = getenv("XDG_CACHE_HOME");
+
+  if (base != NULL && *base != '\0') {
+    snprintf(path, PATHBUF_SIZE, "%s/%s", base, AUTOTUNE_FILE);
+    return path;
+  }
+  base = getenv("HOME");
+  if (base == NULL || *base == '\0') return NULL;
+  snprintf(path, PATHBUF_SIZE, "%s/.cache", base);
+#ifndef ON_WINDOWS
+  mkdir(path, 0755);
+#endif
+  snprintf(path, PATHBUF_SIZE, "%s/.cache/%s", base, AUTOTUNE_FILE);
+  return path;
+}
+
+
+static struct tune_profile *find_profile(const uintmax_t fsid, const uintmax_t fstype, const char * const restrict mount)
+{
+  for (int i = 0; i < profile_count; i++)
+    if (profiles[i].fsid == fsid && profiles[i].fstype == fstype && strcmp(profiles[i].mount, mount) == 0) return &profiles[i];
+  return NULL;
+}
+
+
+static struct tune_profile *new_profile(const uintmax_t fsid, const uintmax_t fstype, const char * const restrict mount)
+{
+  struct tune_profile *p = find_profile(fsid, fstype, mount);
+
+  if (p != NULL) return p;
+  if (profile_count == profile_alloc) {
+    profile_alloc += 16;
+    profiles = (struct tune_profile *)realloc(profiles, sizeof(struct tune_profile) * (size_t)profile_alloc);
+    if (profiles == NULL) jc_oom("new_profile()");
+  }
+  p = &profiles[profile_count++];
+  memset(p, 0, sizeof(struct tune_profile));
+  p->fsid = fsid;
+  p->fstype = fstype;
+  p->mount = (char *)malloc(strlen(mount) + 1);
+  if (p->mount == NULL) jc_oom("new_profile()");
+  strcpy(p->mount, mount);
+  return p;
+}
+
+
+/* Profile file format: one line per filesystem
+ * <fsid> <fstype> <chunk_size> <readahead_bytes> <queue_depth> <mount point>
+ * Lines from older versions, which started with a device number and had no
+ * mount point, are skipped and their devices are benchmarked again */
+static void load_profiles(void)
+{
+  FILE *fp;
+  char *path = profile_path();
+  char line[PATHBUF_SIZE + 128];
+  char *mount;
+  uintmax_t fsid, fstype, chunk, readahead;
+  int qd, n = 0;
+
+  if (path == NULL) return;
+  fp = fopen(path, "rb");
+  if (fp == NULL) return;
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    struct tune_profile *p;
+    if (*line == '#') continue;
+    if (sscanf(line, "%jx %jx %ju %ju %d %n", &fsid, &fstype, &chunk, &readahead, &qd, &n) != 5 || n == 0) continue;
+    if (chunk < MIN_CHUNK_SIZE || chunk > MAX_CHUNK_SIZE || (chunk & 0xfff) != 0) continue;
+    mount = line + n;
+    mount[strcspn(mount, "\r\n")] = '\0';
+    if (*mount == '\0') continue;
+    p = new_profile(fsid, fstype, mount);
+    p->chunk = (size_t)chunk;
+    p->readahead = (size_t)readahead;
+    p->qd = qd;
+  }
+  fclose(fp);
+  return;
+}
+
+
+static void save_profiles(void)
+{
+  FILE *fp;
+  char *path = profile_path();
+  char tmp[PATHBUF_SIZE + 8];
+
+  if (path == NULL) return;
+  snprintf(tmp, sizeof(tmp), "%s.new", path);
+  fp = fopen(tmp, "wb");
+  if (fp == NULL) goto error_save;
+  fprintf(fp, "# jdupes device tuning: fsid fstype chunk_size readahead queue_depth mount_point\n");
+  for (int i = 0; i < profile_count; i++)
+    fprintf(fp, "%jx %jx %" PRIuMAX " %" PRIuMAX " %d %s\n", profiles[i].fsid, profiles[i].fstype,
+        (uintmax_t)profiles[i].chunk, (uintmax_t)profiles[i].readahead, profiles[i].qd, profiles[i].mount);
+  if (fclose(fp) != 0) goto error_save;
+  if (rename(tmp, path) != 0) goto error_save;
+  return;
+
+error_save:
+  fprintf(stderr, "warning: can't save device tuning to %s: %s\n", path, strerror(errno));
+  remove(tmp);
+  return;
+}
+
+
+/* Filesystem type and ID; either is 0 if it can't be found */
+static void get_fsinfo(const char * const restrict path, uintmax_t * const restrict fstype, uintmax_t * const restrict fsid)
+{
+#ifdef __linux__
+  struct statfs sfs;
+  uint64_t id = 0;
+
+  *fstype = *fsid = 0;
+  if (statfs(path, &sfs) != 0) return;
+  *fstype = (uintmax_t)sfs.f_type;
+  memcpy(&id, &sfs.f_fsid, sizeof(sfs.f_fsid) < sizeof(id) ? sizeof(sfs.f_fsid) : sizeof(id));
+  *fsid = (uintmax_t)id;
+#else
+  (void)path;
+  *fstype = *fsid = 0;
+#endif
+  return;
+}
+
+
+/* Where the filesystem holding a file is mounted: the highest directory
+ * above the file that is still on its device (empty if unknown) */
+static void get_mount_point(const char * const restrict path, const dev_t device, char * const restrict mount)
+{
+#ifndef ON_WINDOWS
+  struct stat st;
+  char *slash;
+  char save;
+
+  *mount = '\0';
+  if (realpath(path, mount) == NULL) {
+    *mount = '\0';
+    return;
+  }
+  while ((slash = strrchr(mount, '/')) != NULL) {
+    /* Cut off the last component, but keep "/" itself */
+    if (slash == mount) slash++;
+    save = *slash;
+    *slash = '\0';
+    if (stat(mount, &st) != 0 || st.st_dev != device) {
+      *slash = save;
+      return;
+    }
+    if (slash == mount + 1) return;
+  }
+#else
+  (void)path; (void)device;
+  *mount = '\0';
+#endif
+  return;
+}
+
+
+#ifndef ON_WINDOWS
+/* Read the first 'len' bytes of a file in 'chunk' sized pieces, keeping
+ * 'window' bytes of read-ahead requested; returns bytes per second */
+static double bench_read(const int fd, const off_t len, const size_t chunk, const size_t window, char * const restrict buf)
+{
+  struct timespec t0, t1;
+  off_t off = 0, ra_end = 0;
+  ssize_t got;
+  double secs;
+
+#ifdef __linux__
+  /* Start cold; this only drops clean pages, which is all we've read */
+  posix_fadvise(fd, 0, len, POSIX_FADV_DONTNEED);
+#endif
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  while (off < len) {
+#ifdef __linux__
+    if (window != 0 && off + (off_t)window > ra_end) {
+      posix_fadvise(fd, ra_end, off + (off_t)window - ra_end, POSIX_FADV_WILLNEED);
+      ra_end = off + (off_t)window;
+    }
+#endif
+    got = pread(fd, buf, chunk, off);
+    if (got <= 0) return -1;
+    off += got;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  secs = (double)(t1.tv_sec - t0.tv_sec) + (double)(t1.tv_nsec - t0.tv_nsec) / 1000000000.0;
+  if (secs <= 0) secs = 0.000001;
+  return (double)len / secs;
+}
+
+
+/* Benchmark one device using one of its files; returns 0 on success */
+static int bench_device(struct tune_profile * const restrict p, const file_t * const restrict file)
+{
+  char *buf;
+  int fd;
+  off_t len = file->size < BENCH_READ_SIZE ? file->size : BENCH_READ_SIZE;
+  double rate, best = 0;
+
+  if (!ISFLAG(flags, F_HIDEPROGRESS))
+    fprintf(stderr, "\rBenchmarking the device mounted at %s using '%s'\n", p->mount, file->d_name);
+  fd = open(file->d_name, O_RDONLY);
+  if (fd == -1) return -1;
+  buf = (char *)malloc(bench_chunks[3]);
+  if (buf == NULL) jc_oom("bench_device()");
+
+  /* Chunk size with the kernel's normal read-ahead */
+  p->chunk = 0;
+  for (int i = 0; bench_chunks[i] != 0; i++) {
+    rate = bench_read(fd, len, bench_chunks[i], 0, buf);
+    LOUD(fprintf(stderr, "bench_device: chunk %zu: %.0f B/s\n", bench_chunks[i], rate));
+    if (rate < 0) goto error_read;
+    if (rate > best * (100 + BENCH_MARGIN) / 100) {
+      best = rate;
+      p->chunk = bench_chunks[i];
+    }
+  }
+
+  /* Read-ahead window as a multiple of the chosen chunk size */
+  p->readahead = 0;
+  for (int i = 1; bench_windows[i] != 0; i++) {
+    size_t window = bench_windows[i] * p->chunk;
+    rate = bench_read(fd, len, p->chunk, window, buf);
+    LOUD(fprintf(stderr, "bench_device: window %zu: %.0f B/s\n", window, rate));
+    if (rate < 0) goto error_read;
+    if (rate > best * (100 + BENCH_MARGIN) / 100) {
+      best = rate;
+      p->readahead = window;
+    }
+  }
+  /* Reads in flight needed to cover the read-ahead window */
+  p->qd = p->readahead == 0 ? DEFAULT_QUEUE_DEPTH : (int)(p->readahead / p->chunk);
+  if (p->qd > MAX_QUEUE_DEPTH) p->qd = MAX_QUEUE_DEPTH;
+
+  free(buf);
+  close(fd);
+  profiles_changed = 1;
+  return 0;
+
+error_read:
+  free(buf);
+  close(fd);
+  return -1;
+}
+#else
+static int bench_device(struct tune_profile * const restrict p, const file_t * const restrict file)
+{
+  (void)p; (void)file;
+  return -1;
+}
+#endif /* ON_WINDOWS */
+
+
+/* Find (and if asked, create) a tuning profile for each device holding the
+ * files to be scanned, then apply the profile of the device holding the most
+ * data. Returns 1 if the chunk size was changed. */
+int autotune_apply(const file_t *files, const int keep_chunk_size)
+{
+  struct devinfo {
+    uintmax_t device, fstype, fsid;
+    uintmax_t bytes;
+    const file_t *largest;
+    char mount[PATHBUF_SIZE];
+  } *devs = NULL;
+  int devcount = 0, devalloc = 0, best = -1;
+  struct tune_profile *p;
+
+  if (autotune_mode == AUTOTUNE_OFF) return 0;
+  load_profiles();
+  if (profile_count == 0 && autotune_mode == AUTOTUNE_LOAD) return 0;
+
+  /* Tally data per device */
+  for (const file_t *f = files; f != NULL; f = f->next) {
+    int i;
+    for (i = 0; i < devcount; i++) if (devs[i].device == (uintmax_t)f->device) break;
+    if (i == devcount) {
+      if (devcount == devalloc) {
+        devalloc += 8;
+        devs = (struct devinfo *)realloc(devs, sizeof(struct devinfo) * (size_t)devalloc);
+        if (devs == NULL) jc_oom("autotune_apply()");
+      }
+      devs[i].device = (uintmax_t)f->device;
+      get_fsinfo(f->d_name, &devs[i].fstype, &devs[i].fsid);
+      get_mount_point(f->d_name, f->device, devs[i].mount);
+      devs[i].bytes = 0;
+      devs[i].largest = f;
+      devcount++;
+    }
+    devs[i].bytes += (uintmax_t)f->size;
+    if (f->size > devs[i].largest->size) devs[i].largest = f;
+  }
+
+  for (int i = 0; i < devcount; i++) {
+    p = find_profile(devs[i].fsid, devs[i].fstype, devs[i].mount);
+    if (autotune_mode == AUTOTUNE_FORCE || (p == NULL && autotune_mode == AUTOTUNE_BENCH)) {
+      if (devs[i].largest->size < BENCH_MIN_SIZE) {
+        LOUD(fprintf(stderr, "autotune: no file large enough to benchmark device %jx\n", devs[i].device));
+      } else {
+        p = new_profile(devs[i].fsid, devs[i].fstype, devs[i].mount);
+        if (bench_device(p, devs[i].largest) != 0) {
+          fprintf(stderr, "warning: benchmark of the device mounted at %s failed\n", devs[i].mount);
+          /* Drop the half-filled profile */
+          free(p->mount);
+          *p = profiles[--profile_count];
+        }
+      }
+    }
+    if (find_profile(devs[i].fsid, devs[i].fstype, devs[i].mount) != NULL && (best == -1 || devs[i].bytes > devs[best].bytes)) best = i;
+  }
+  if (profiles_changed != 0) save_profiles();
+
+  if (best == -1) {
+    free(devs);
+    return 0;
+  }
+  p = find_profile(devs[best].fsid, devs[best].fstype, devs[best].mount);
+  free(devs);
+  LOUD(fprintf(stderr, "autotune: %s: chunk %zu, readahead %zu, qd %d\n", p->mount, p->chunk, p->readahead, p->qd));
+
+  read_ahead = p->readahead;
+  if (!(tune_explicit & TUNE_SET_QD)) io_queue_depth = p->qd;
+  if (!(tune_explicit & TUNE_SET_RING) && p->readahead != 0) {
+    read_ring_count = (int)(p->readahead / p->chunk);
+    if (read_ring_count < 2) read_ring_count = 2;
+    if (read_ring_count > MAX_RING_COUNT) read_ring_count = MAX_RING_COUNT;
+  }
+#ifndef NO_CHUNKSIZE
+  if (keep_chunk_size == 0) {
+    auto_chunk_size = p->chunk;
+    return 1;
+  }
+#else
+  (void)keep_chunk_size;
+#endif
+  return 0;
+}
+
+#endif /* NO_TUNE */
@@ -0,0 +1,30 @@
+/* jdupes per-device I/O autotuning
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifndef JDUPES_AUTOTUNE_H
+#define JDUPES_AUTOTUNE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "jdupes.h"
+
+/* Values for autotune_mode */
+#define AUTOTUNE_OFF		0  /* Ignore saved device profiles */
+#define AUTOTUNE_LOAD		1  /* Use saved profiles if present (default) */
+#define AUTOTUNE_BENCH		2  /* Benchmark devices that have no profile */
+#define AUTOTUNE_FORCE		3  /* Benchmark all devices again */
+
+/* Name of the profile cache file under $XDG_CACHE_HOME or ~/.cache */
+#define AUTOTUNE_FILE		"jdupes_tune.txt"
+
+#ifndef NO_TUNE
+int autotune_apply(const file_t *files, const int keep_chunk_size);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* JDUPES_AUTOTUNE_H */
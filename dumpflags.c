@@ -48,6 +48,8 @@ void dump_all_flags(void)
   if (ISFLAG(a_flags, FA_PRINTNULL)) fprintf(stderr, " FA_PRINTNULL");
   if (ISFLAG(a_flags, FA_PRINTJSON)) fprintf(stderr, " FA_PRINTJSON");
   if (ISFLAG(a_flags, FA_ERRORONDUPE)) fprintf(stderr, " FA_ERRORONDUPE");
+  if (ISFLAG(a_flags, FA_REFLINKFILES)) fprintf(stderr, " FA_REFLINKFILES");
+  if (ISFLAG(a_flags, FA_PRINTNDJSON)) fprintf(stderr, " FA_PRINTNDJSON");
 
   /* Extra print flags */
   if (ISFLAG(p_flags, PF_PARTIAL)) fprintf(stderr, " PF_PARTIAL");
@@ -0,0 +1,227 @@
+/* jdupes open file cache
+ * Candidate files are read up to three times (partial hash, full hash,
+ * confirmation). Keeping them open between those stages saves an open()
+ * per stage, which is a server round trip on network filesystems.
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef ON_WINDOWS
+ #include <sys/resource.h>
+#endif
+
+#include <libjodycode.h>
+#include "likely_unlikely.h"
+#include "jdupes.h"
+#include "fdcache.h"
+#include "tune.h"
+
+#if !defined ON_WINDOWS && !defined NO_THREADS
+ #include <pthread.h>
+/* Parallel actions check and drop cached files from worker threads */
+static pthread_mutex_t fdc_lock = PTHREAD_MUTEX_INITIALIZER;
+ #define FDC_LOCK() pthread_mutex_lock(&fdc_lock)
+ #define FDC_UNLOCK() pthread_mutex_unlock(&fdc_lock)
+#else
+ #define FDC_LOCK()
+ #define FDC_UNLOCK()
+#endif
+
+struct fdc_entry {
+  const file_t *file;  /* NULL if the entry is free */
+  FILE *fp;
+  int newer, older;    /* LRU list links */
+  int hnext;           /* Hash bucket chain */
+  int busy;            /* Handed out to a reader right now */
+};
+
+static struct fdc_entry *fdc = NULL;
+static int *fdc_bucket = NULL;
+static int fdc_capacity = -1;  /* -1 = not set up yet */
+static unsigned int fdc_mask = 0;
+static int fdc_newest = -1, fdc_oldest = -1, fdc_free = -1;
+
+
+static unsigned int fdc_hash(const file_t * const restrict file)
+{
+  uintptr_t p = (uintptr_t)file;
+  p ^= p >> 17;
+  p *= (uintptr_t)0x9e3779b97f4a7c15ULL;
+  return (unsigned int)(p >> 7) & fdc_mask;
+}
+
+
+static void fdc_setup(void)
+{
+  int capacity = fdcache_size;
+
+  if (capacity < 0) {
+    capacity = 256;
+#ifndef ON_WINDOWS
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+      if (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > FDCACHE_MAX + FDCACHE_RESERVE) capacity = FDCACHE_MAX;
+      else capacity = (int)rl.rlim_cur - FDCACHE_RESERVE;
+    }
+#endif
+  }
+  /* Anything smaller than the open reader count can't keep a file open */
+  if (capacity < 4) capacity = 0;
+  fdc_capacity = capacity;
+  if (capacity == 0) return;
+
+  fdc_mask = 1;
+  while (fdc_mask < (unsigned int)capacity * 2) fdc_mask <<= 1;
+  fdc = (struct fdc_entry *)calloc((size_t)capacity, sizeof(struct fdc_entry));
+  fdc_bucket = (int *)malloc(sizeof(int) * fdc_mask);
+  if (fdc == NULL || fdc_bucket == NULL) jc_oom("fdc_setup()");
+  for (unsigned int i = 0; i < fdc_mask; i++) fdc_bucket[i] = -1;
+  fdc_mask--;
+  for (int i = 0; i < capacity; i++) fdc[i].hnext = i + 1 < capacity ? i + 1 : -1;
+  fdc_free = 0;
+  LOUD(fprintf(stderr, "fdc_setup: caching up to %d open files\n", capacity));
+  return;
+}
+
+
+static int fdc_find(const file_t * const restrict file)
+{
+  int i;
+
+  if (fdc_capacity <= 0) return -1;
+  for (i = fdc_bucket[fdc_hash(file)]; i != -1; i = fdc[i].hnext)
+    if (fdc[i].file == file) return i;
+  return -1;
+}
+
+
+static void fdc_unlink_lru(const int i)
+{
+  if (fdc[i].newer != -1) fdc[fdc[i].newer].older = fdc[i].older;
+  else fdc_newest = fdc[i].older;
+  if (fdc[i].older != -1) fdc[fdc[i].older].newer = fdc[i].newer;
+  else fdc_oldest = fdc[i].newer;
+  return;
+}
+
+
+static void fdc_link_newest(const int i)
+{
+  fdc[i].newer = -1;
+  fdc[i].older = fdc_newest;
+  if (fdc_newest != -1) fdc[fdc_newest].newer = i;
+  fdc_newest = i;
+  if (fdc_oldest == -1) fdc_oldest = i;
+  return;
+}
+
+
+/* Close and forget a cached file */
+static void fdc_remove(const int i)
+{
+  int *link = &fdc_bucket[fdc_hash(fdc[i].file)];
+
+  while (*link != i) link = &fdc[*link].hnext;
+  *link = fdc[i].hnext;
+  fdc_unlink_lru(i);
+  fclose(fdc[i].fp);
+  fdc[i].file = NULL;
+  fdc[i].fp = NULL;
+  fdc[i].hnext = fdc_free;
+  fdc_free = i;
+  return;
+}
+
+
+/* Get an open stream for a file; pair every call with fdcache_release() */
+FILE *fdcache_open(const file_t * const restrict file)
+{
+  FILE *fp;
+  int i;
+  unsigned int h;
+
+  if (unlikely(file == NULL || file->d_name == NULL)) jc_nullptr("fdcache_open()");
+  FDC_LOCK();
+  if (fdc_capacity < 0) fdc_setup();
+
+  i = fdc_find(file);
+  if (i != -1) {
+    fdc_unlink_lru(i);
+    fdc_link_newest(i);
+    fdc[i].busy = 1;
+    fp = fdc[i].fp;
+    goto finish;
+  }
+
+  fp = jc_fopen(file->d_name, JC_FILE_MODE_RDONLY_SEQ);
+  if (fp == NULL || fdc_capacity == 0) goto finish;
+
+  /* Make room by closing the least recently used idle file */
+  if (fdc_free == -1) {
+    for (i = fdc_oldest; i != -1 && fdc[i].busy != 0; i = fdc[i].newer);
+    if (i == -1) goto finish;
+    fdc_remove(i);
+  }
+  i = fdc_free;
+  fdc_free = fdc[i].hnext;
+  h = fdc_hash(file);
+  fdc[i].file = file;
+  fdc[i].fp = fp;
+  fdc[i].busy = 1;
+  fdc[i].hnext = fdc_bucket[h];
+  fdc_bucket[h] = i;
+  fdc_link_newest(i);
+
+finish:
+  FDC_UNLOCK();
+  return fp;
+}
+
+
+/* Done reading for now; uncached streams are closed */
+void fdcache_release(const file_t * const restrict file, FILE * const restrict fp)
+{
+  int i;
+
+  if (unlikely(file == NULL || fp == NULL)) jc_nullptr("fdcache_release()");
+  FDC_LOCK();
+  i = fdc_find(file);
+  if (i != -1 && fdc[i].fp == fp) fdc[i].busy = 0;
+  else fclose(fp);
+  FDC_UNLOCK();
+  return;
+}
+
+
+/* fstat() a cached file; returns 0 on success, -1 if it isn't open */
+int fdcache_fstat(const file_t * const restrict file, struct JC_STAT * const restrict s)
+{
+#ifdef ON_WINDOWS
+  (void)file; (void)s;
+  return -1;
+#else
+  int i, retval = -1;
+
+  FDC_LOCK();
+  i = fdc_find(file);
+  if (i != -1 && fstat(fileno(fdc[i].fp), s) == 0) retval = 0;
+  FDC_UNLOCK();
+  return retval;
+#endif
+}
+
+
+/* Close a cached file, i.e. before it gets deleted or replaced */
+void fdcache_drop(const file_t * const restrict file)
+{
+  int i;
+
+  FDC_LOCK();
+  i = fdc_find(file);
+  if (i != -1 && fdc[i].busy == 0) fdc_remove(i);
+  FDC_UNLOCK();
+  return;
+}
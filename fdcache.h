@@ -0,0 +1,29 @@
+/* jdupes open file cache
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifndef JDUPES_FDCACHE_H
+#define JDUPES_FDCACHE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <libjodycode.h>
+#include "jdupes.h"
+
+/* Upper limit for automatic cache sizing */
+#define FDCACHE_MAX 4096
+/* Descriptors left for directory scanning, the hash database, output, etc. */
+#define FDCACHE_RESERVE 64
+
+FILE *fdcache_open(const file_t * const restrict file);
+void fdcache_release(const file_t * const restrict file, FILE * const restrict fp);
+int fdcache_fstat(const file_t * const restrict file, struct JC_STAT * const restrict s);
+void fdcache_drop(const file_t * const restrict file);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* JDUPES_FDCACHE_H */
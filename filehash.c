@@ -17,6 +17,7 @@
 #include <libjodycode.h>
 
 #include "likely_unlikely.h"
+#include "fileio.h"
 #include "filehash.h"
 #include "interrupt.h"
 #include "progress.h"
@@ -39,29 +40,22 @@ const char *hash_algo_list[2] = {
  * swapping hash functions. If you want to do it for fun then that's fine. */
 uint64_t *get_filehash(const file_t * const restrict checkfile, const size_t max_read, int algo)
 {
-  off_t fsize;
+  off_t fsize, start = 0;
   /* This is an array because we return a pointer to it */
   static uint64_t hash[1];
-  static uint64_t *chunk = NULL;
-  FILE *file = NULL;
+  filereader_t reader;
+  const void *data;
+  ssize_t bytes;
   int hashing = 0;
 #ifndef NO_XXHASH2
   XXH64_state_t *xxhstate = NULL;
 #endif
-#ifdef __linux__
-  int filenum;
-#endif
 
+  reader.fp = NULL;
   if (unlikely(checkfile == NULL || checkfile->d_name == NULL)) jc_nullptr("get_filehash()");
   if (unlikely((algo > HASH_ALGO_COUNT - 1) || (algo < 0))) goto error_bad_hash_algo;
   LOUD(fprintf(stderr, "get_filehash('%s', %" PRIdMAX ")\n", checkfile->d_name, (intmax_t)max_read);)
 
-  /* Allocate on first use */
-  if (unlikely(chunk == NULL)) {
-    chunk = (uint64_t *)malloc(auto_chunk_size);
-    if (unlikely(!chunk)) jc_oom("get_filehash() chunk");
-  }
-
   /* Get the file size. If we can't read it, bail out early */
   if (unlikely(checkfile->size == -1)) {
     LOUD(fprintf(stderr, "get_filehash: not hashing because stat() info is bad\n"));
@@ -82,40 +76,21 @@ uint64_t *get_filehash(const file_t * const restrict checkfile, const size_t max
 
   *hash = 0;
   if (ISFLAG(checkfile->flags, FF_HASH_PARTIAL)) {
+    const off_t window = partial_window(checkfile->size);
     *hash = checkfile->filehash_partial;
     /* Don't bother going further if max_read is already fulfilled */
-    if (max_read != 0 && max_read <= PARTIAL_HASH_SIZE) {
-      LOUD(fprintf(stderr, "Partial hash size (%d) >= max_read (%" PRIuMAX "), not hashing anymore\n", PARTIAL_HASH_SIZE, (uintmax_t)max_read);)
+    if (max_read != 0 && (off_t)max_read <= window) {
+      LOUD(fprintf(stderr, "Partial hash size (%" PRIdMAX ") >= max_read (%" PRIuMAX "), not hashing anymore\n", (intmax_t)window, (uintmax_t)max_read);)
       return hash;
     }
+    /* This is part of the filehash_partial skip optimization */
+    start = window;
+    fsize -= window;
   }
-  errno = 0;
-  file = jc_fopen(checkfile->d_name, JC_FILE_MODE_RDONLY_SEQ);
-  if (file == NULL) {
+  if (reader_open(&reader, checkfile, start, fsize, 0) != 0) {
     fprintf(stderr, "\n%s error opening file ", strerror(errno)); jc_fwprint(stderr, checkfile->d_name, 1);
     return NULL;
   }
-  /* Actually seek past the first chunk if applicable
-   * This is part of the filehash_partial skip optimization */
-  if (ISFLAG(checkfile->flags, FF_HASH_PARTIAL)) {
-    if (fseeko(file, PARTIAL_HASH_SIZE, SEEK_SET) == -1) {
-      fclose(file);
-      fprintf(stderr, "\nerror seeking in file "); jc_fwprint(stderr, checkfile->d_name, 1);
-      return NULL;
-    }
-    fsize -= PARTIAL_HASH_SIZE;
-#ifdef __linux__
-    filenum = fileno(file);
-    posix_fadvise(filenum, PARTIAL_HASH_SIZE, fsize, POSIX_FADV_SEQUENTIAL);
-    posix_fadvise(filenum, PARTIAL_HASH_SIZE, fsize, POSIX_FADV_WILLNEED);
-#endif /* __linux__ */
-  } else {
-#ifdef __linux__
-    filenum = fileno(file);
-    posix_fadvise(filenum, 0, fsize, POSIX_FADV_SEQUENTIAL);
-    posix_fadvise(filenum, 0, fsize, POSIX_FADV_WILLNEED);
-#endif /* __linux__ */
-  }
 
 /* WARNING: READ NOTICE ABOVE get_filehash() BEFORE CHANGING HASH FUNCTIONS! */
 #ifndef NO_XXHASH2
@@ -127,28 +102,23 @@ uint64_t *get_filehash(const file_t * const restrict checkfile, const size_t max
 #endif /* NO_XXHASH2 */
 
   /* Read the file in chunks until we've read it all. */
-  while (fsize > 0) {
-    size_t bytes_to_read;
-
-    if (interrupt) return 0;
-    bytes_to_read = (fsize >= (off_t)auto_chunk_size) ? auto_chunk_size : (size_t)fsize;
-    if (unlikely(fread((void *)chunk, bytes_to_read, 1, file) != 1)) goto error_reading_file;
+  while ((bytes = reader_next(&reader, &data)) > 0) {
+    if (interrupt) goto error_interrupted;
 
   switch (algo) {
 #ifndef NO_XXHASH2
     case HASH_ALGO_XXHASH2_64:
-      if (unlikely(XXH64_update(xxhstate, chunk, bytes_to_read) != XXH_OK)) goto error_reading_file;
+      if (unlikely(XXH64_update(xxhstate, data, (size_t)bytes) != XXH_OK)) goto error_reading_file;
       break;
 #endif
     case HASH_ALGO_JODYHASH64:
-      if (unlikely(jc_block_hash(chunk, hash, bytes_to_read) != 0)) goto error_reading_file;
+      if (unlikely(jc_block_hash((const uint64_t *)data, hash, (size_t)bytes) != 0)) goto error_reading_file;
       break;
     default:
       goto error_bad_hash_algo;
   }
 
-    if ((off_t)bytes_to_read > fsize) break;
-    else fsize -= (off_t)bytes_to_read;
+    fsize -= (off_t)bytes;
 
     check_sigusr1();
     if (jc_alarm_ring != 0) {
@@ -163,8 +133,9 @@ uint64_t *get_filehash(const file_t * const restrict checkfile, const size_t max
     }
     continue;
   }
+  if (unlikely(bytes < 0)) goto error_reading_file;
 
-  fclose(file);
+  if (unlikely(reader_close(&reader) != 0)) goto error_file_changed;
 
 #ifndef NO_XXHASH2
   if (algo == HASH_ALGO_XXHASH2_64) {
@@ -175,15 +146,25 @@ uint64_t *get_filehash(const file_t * const restrict checkfile, const size_t max
 
   LOUD(fprintf(stderr, "get_filehash: returning hash: 0x%016jx\n", (uintmax_t)*hash));
   return hash;
+error_interrupted:
+  reader_close(&reader);
+  goto free_state;
 error_reading_file:
   fprintf(stderr, "\nerror reading from file "); jc_fwprint(stderr, checkfile->d_name, 1);
-  fclose(file);
-  return NULL;
+  reader_close(&reader);
+  goto free_state;
+error_file_changed:
+  fprintf(stderr, "\nfile changed while reading "); jc_fwprint(stderr, checkfile->d_name, 1);
+  goto free_state;
 error_bad_hash_algo:
   if ((hash_algo > HASH_ALGO_COUNT) || (hash_algo < 0))
     fprintf(stderr, "\nerror: requested hash algorithm %d is not available", hash_algo);
   else
     fprintf(stderr, "\nerror: requested hash algorithm %s [%d] is not available", hash_algo_list[hash_algo], hash_algo);
-  fclose(file);
+  if (reader.fp != NULL) reader_close(&reader);
+free_state:
+#ifndef NO_XXHASH2
+  if (xxhstate != NULL) XXH64_freeState(xxhstate);
+#endif /* NO_XXHASH2 */
   return NULL;
 }
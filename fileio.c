@@ -0,0 +1,930 @@
+/* jdupes file data reading backends
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifdef __linux__
+ #define _GNU_SOURCE  /* O_DIRECT */
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <libjodycode.h>
+#include "likely_unlikely.h"
+#include "jdupes.h"
+#include "fdcache.h"
+#include "fileio.h"
+#include "tune.h"
+
+#if !defined ON_WINDOWS && !defined NO_MMAP
+ #include <sys/mman.h>
+ #define ENABLE_MMAP 1
+ /* Map at most this much of a file at once; keep 32-bit address space free */
+ #define MMAP_WINDOW ((size_t)(sizeof(size_t) > 4 ? 1073741824 : 33554432))
+ /* Hand mapped data to consumers in steps of at least this size */
+ #define MMAP_STEP 1048576
+#endif
+
+#if defined __linux__ && !defined NO_DIRECTIO
+ #define ENABLE_DIRECTIO 1
+ /* O_DIRECT offsets, lengths and buffers must be aligned to the logical
+  * block size; 4 KiB covers both 512-byte and 4K-native devices */
+ #define DIRECT_ALIGN 4096
+ /* Minimum size of a single O_DIRECT read */
+ #define DIRECT_IO_MIN 1048576
+#endif
+
+/* Read buffers for the stdio backend, one per reader slot */
+static char *slotbuf[READER_SLOTS] = { NULL };
+
+static ssize_t read_piece(filereader_t * const restrict reader, const void ** const restrict data);
+
+#if !defined ON_WINDOWS && defined SEEK_DATA && defined SEEK_HOLE && !defined NO_SPARSE
+ #define ENABLE_SPARSE 1
+/* Handed out in place of file data for holes; never written to */
+static char *zerobuf = NULL;
+#endif
+
+#if defined __linux__ && !defined NO_IO_URING && defined __has_include
+ #if __has_include(<linux/io_uring.h>)
+  #include <sys/mman.h>
+  #include <sys/syscall.h>
+  #include <sys/uio.h>
+  #include <linux/io_uring.h>
+  #define ENABLE_IO_URING 1
+ #endif
+#endif
+
+#if !defined ON_WINDOWS && !defined NO_THREADS
+ #include <pthread.h>
+ #define ENABLE_THREADS 1
+#endif
+
+#ifdef ENABLE_DIRECTIO
+/* Aligned read buffers for the O_DIRECT backend, one per reader slot */
+static char *directbuf[READER_SLOTS] = { NULL };
+static size_t directbuf_size = 0;
+#endif
+
+#ifdef ENABLE_MMAP
+static size_t pagesize = 0;
+static int sigbus_installed = 0;
+/* Active mapped windows and faults recorded against them */
+static filereader_t *volatile mapped[READER_SLOTS] = { NULL };
+static volatile sig_atomic_t map_fault[READER_SLOTS] = { 0 };
+
+
+/* A mapped file shrank under us; the kernel raises SIGBUS on access past the
+ * new end of the file. Replace the faulting page with zeroes so the consumer
+ * can finish, and record the fault so the reader reports a read error. */
+static void catch_sigbus(int signum, siginfo_t *info, void *context)
+{
+  uintptr_t addr = (uintptr_t)info->si_addr;
+
+  (void)context;
+  for (int i = 0; i < READER_SLOTS; i++) {
+    filereader_t *r = mapped[i];
+    if (r == NULL || addr < (uintptr_t)r->map || addr >= (uintptr_t)r->map + r->maplen) continue;
+    addr &= ~((uintptr_t)pagesize - 1);
+    if (mmap((void *)addr, pagesize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) break;
+    map_fault[i] = 1;
+    return;
+  }
+  /* Not one of ours: let the default action happen */
+  signal(signum, SIG_DFL);
+  return;
+}
+
+
+static void unmap_window(filereader_t * const restrict reader)
+{
+  if (reader->map == NULL) return;
+  mapped[reader->slot] = NULL;
+  munmap(reader->map, reader->maplen);
+  reader->map = NULL;
+  reader->maplen = 0;
+  return;
+}
+
+
+/* Map the next window of the file starting at reader->pos
+ * Returns 0 on success, -1 if the file can't be mapped */
+static int map_window(filereader_t * const restrict reader)
+{
+  off_t mapoff;
+  size_t maplen;
+  void *map;
+
+  unmap_window(reader);
+  /* mmap() offsets must be page-aligned */
+  mapoff = reader->pos & ~((off_t)pagesize - 1);
+  maplen = (size_t)(reader->end - mapoff);
+  if ((off_t)maplen != reader->end - mapoff || maplen > MMAP_WINDOW) maplen = MMAP_WINDOW;
+
+  map = mmap(NULL, maplen, PROT_READ, MAP_SHARED, fileno(reader->fp), mapoff);
+  if (map == MAP_FAILED) {
+    LOUD(fprintf(stderr, "map_window: mmap() failed: %s\n", strerror(errno)));
+    return -1;
+  }
+#ifdef MADV_SEQUENTIAL
+  madvise(map, maplen, MADV_SEQUENTIAL);
+#endif
+#ifdef MADV_WILLNEED
+  madvise(map, maplen, MADV_WILLNEED);
+#endif
+  reader->map = (char *)map;
+  reader->maplen = maplen;
+  reader->mapoff = mapoff;
+  mapped[reader->slot] = reader;
+  return 0;
+}
+
+
+static int init_mmap(void)
+{
+  struct sigaction sa;
+  long ps;
+
+  if (pagesize == 0) {
+    ps = sysconf(_SC_PAGESIZE);
+    if (ps <= 0) return -1;
+    pagesize = (size_t)ps;
+  }
+  if (sigbus_installed == 0) {
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = catch_sigbus;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGBUS, &sa, NULL) != 0) return -1;
+    sigbus_installed = 1;
+  }
+  return 0;
+}
+#endif /* ENABLE_MMAP */
+
+
+#ifdef ENABLE_IO_URING
+/* A single io_uring is shared by all reader slots. Each slot owns a ring of
+ * io_queue_depth read buffers; reads for the upcoming pieces of a file are
+ * kept in flight while the consumer hashes or compares the current piece. */
+static struct {
+  int fd;          /* 0 = not set up yet, -1 = unavailable */
+  unsigned *sq_tail, sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  int fixed_bufs, fixed_files;
+} uring = { 0 };
+
+static char *uring_buf[READER_SLOTS] = { NULL };
+static int32_t *uring_res[READER_SLOTS] = { NULL };
+static unsigned char *uring_done[READER_SLOTS] = { NULL };
+/* SQEs published in the ring that the kernel hasn't taken yet */
+static unsigned uring_unsubmitted = 0;
+
+
+static int uring_setup(void)
+{
+  struct io_uring_params p;
+  struct iovec *iov;
+  int fds[READER_SLOTS];
+  size_t sq_sz, cq_sz;
+  char *sq_ptr, *cq_ptr;
+  unsigned entries = (unsigned)(io_queue_depth * READER_SLOTS);
+
+  if (uring.fd != 0) return uring.fd < 0 ? -1 : 0;
+  uring.fd = -1;
+
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = entries * 2;
+  uring.fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+  if (uring.fd < 0) goto error_setup;
+
+  sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if ((p.features & IORING_FEAT_SINGLE_MMAP) && cq_sz > sq_sz) sq_sz = cq_sz;
+  sq_ptr = mmap(NULL, sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+  if (sq_ptr == MAP_FAILED) goto error_close;
+  if (p.features & IORING_FEAT_SINGLE_MMAP) cq_ptr = sq_ptr;
+  else {
+    cq_ptr = mmap(NULL, cq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_CQ_RING);
+    if (cq_ptr == MAP_FAILED) goto error_close;
+  }
+  uring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQES);
+  if (uring.sqes == MAP_FAILED) goto error_close;
+
+  uring.sq_tail = (unsigned *)(sq_ptr + p.sq_off.tail);
+  uring.sq_mask = *(unsigned *)(sq_ptr + p.sq_off.ring_mask);
+  uring.sq_array = (unsigned *)(sq_ptr + p.sq_off.array);
+  uring.cq_head = (unsigned *)(cq_ptr + p.cq_off.head);
+  uring.cq_tail = (unsigned *)(cq_ptr + p.cq_off.tail);
+  uring.cq_mask = *(unsigned *)(cq_ptr + p.cq_off.ring_mask);
+  uring.cqes = (struct io_uring_cqe *)(cq_ptr + p.cq_off.cqes);
+
+  iov = (struct iovec *)malloc(sizeof(struct iovec) * entries);
+  if (iov == NULL) jc_oom("uring_setup() iovec");
+  for (int slot = 0; slot < READER_SLOTS; slot++) {
+    uring_buf[slot] = (char *)malloc(auto_chunk_size * (size_t)io_queue_depth);
+    uring_res[slot] = (int32_t *)malloc(sizeof(int32_t) * (size_t)io_queue_depth);
+    uring_done[slot] = (unsigned char *)malloc((size_t)io_queue_depth);
+    if (uring_buf[slot] == NULL || uring_res[slot] == NULL || uring_done[slot] == NULL) jc_oom("uring_setup() buffers");
+    for (int i = 0; i < io_queue_depth; i++) {
+      iov[slot * io_queue_depth + i].iov_base = uring_buf[slot] + auto_chunk_size * (size_t)i;
+      iov[slot * io_queue_depth + i].iov_len = auto_chunk_size;
+    }
+    fds[slot] = -1;
+  }
+  /* Registration can fail on old kernels or with a low RLIMIT_MEMLOCK;
+   * plain reads still work in that case */
+  uring.fixed_bufs = syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_BUFFERS, iov, entries) == 0;
+  uring.fixed_files = syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_FILES, fds, READER_SLOTS) == 0;
+  free(iov);
+  LOUD(fprintf(stderr, "uring_setup: depth %d, fixed buffers %d, fixed files %d\n", io_queue_depth, uring.fixed_bufs, uring.fixed_files));
+  return 0;
+
+error_close:
+  close(uring.fd);
+error_setup:
+  uring.fd = -1;
+  fprintf(stderr, "warning: io_uring is not available (%s), using stdio reads\n", strerror(errno));
+  return -1;
+}
+
+
+/* Give up on io_uring after a submit or completion error. Reads may still
+ * be in flight into the slot buffers, so they are never used (or freed)
+ * again; readers still open and all later ones use stdio instead */
+static void uring_fail(void)
+{
+  const int err = errno;
+
+  if (uring.fd < 0) return;
+  close(uring.fd);
+  uring.fd = -1;
+  read_mode = READ_MODE_STDIO;
+  fprintf(stderr, "warning: io_uring failed (%s), using stdio reads\n", strerror(err));
+  return;
+}
+
+
+/* Hand all published SQEs to the kernel; it may take fewer than offered */
+static int uring_submit(void)
+{
+  while (uring_unsubmitted > 0) {
+    const long ret = syscall(__NR_io_uring_enter, uring.fd, uring_unsubmitted, 0, 0, NULL, 0);
+
+    if (ret < 0 && errno == EINTR) continue;
+    if (ret <= 0) return -1;
+    uring_unsubmitted -= (unsigned)ret;
+  }
+  return 0;
+}
+
+
+/* Queue reads for upcoming pieces of a file into every free slot buffer */
+static int uring_queue_reads(filereader_t * const restrict reader)
+{
+  const int slot = reader->slot;
+  unsigned tail, queued = 0;
+
+  tail = *uring.sq_tail;
+  while (reader->subpos < reader->end && reader->submitted < reader->consumed + (unsigned)io_queue_depth) {
+    const unsigned i = reader->submitted % (unsigned)io_queue_depth;
+    const unsigned idx = tail & uring.sq_mask;
+    struct io_uring_sqe *sqe = &uring.sqes[idx];
+    size_t len = auto_chunk_size;
+
+    if ((off_t)len > reader->end - reader->subpos) len = (size_t)(reader->end - reader->subpos);
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    if (uring.fixed_bufs) {
+      sqe->opcode = IORING_OP_READ_FIXED;
+      sqe->buf_index = (uint16_t)(slot * io_queue_depth + (int)i);
+    } else sqe->opcode = IORING_OP_READ;
+    if (uring.fixed_files) {
+      sqe->fd = slot;
+      sqe->flags = IOSQE_FIXED_FILE;
+    } else sqe->fd = reader->fd;
+    sqe->addr = (uint64_t)(uintptr_t)(uring_buf[slot] + auto_chunk_size * i);
+    sqe->len = (uint32_t)len;
+    sqe->off = (uint64_t)reader->subpos;
+    sqe->user_data = (uint64_t)(slot * io_queue_depth + (int)i);
+    uring.sq_array[idx] = idx;
+    uring_done[slot][i] = 0;
+    tail++; queued++;
+    reader->subpos += (off_t)len;
+    reader->submitted++;
+  }
+  if (queued == 0) return 0;
+  __atomic_store_n(uring.sq_tail, tail, __ATOMIC_RELEASE);
+  uring_unsubmitted += queued;
+  return uring_submit();
+}
+
+
+/* Collect completions until the read of buffer 'i' in 'slot' is done */
+static int uring_wait(const int slot, const unsigned i)
+{
+  while (uring_done[slot][i] == 0) {
+    unsigned head = *uring.cq_head;
+    const unsigned tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+
+    if (head == tail) {
+      /* Anything a partial submit left behind goes in with the wait */
+      const long ret = syscall(__NR_io_uring_enter, uring.fd, uring_unsubmitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+
+      if (ret < 0 && errno != EINTR) return -1;
+      if (ret > 0) uring_unsubmitted -= (unsigned)ret;
+      continue;
+    }
+    for (; head != tail; head++) {
+      const struct io_uring_cqe *cqe = &uring.cqes[head & uring.cq_mask];
+      const int s = (int)(cqe->user_data / (uint64_t)io_queue_depth);
+      const int b = (int)(cqe->user_data % (uint64_t)io_queue_depth);
+      uring_res[s][b] = cqe->res;
+      uring_done[s][b] = 1;
+    }
+    __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+  }
+  return 0;
+}
+
+
+static int open_uring(filereader_t * const restrict reader)
+{
+  struct io_uring_files_update fu;
+
+  if (uring.fixed_files) {
+    memset(&fu, 0, sizeof(fu));
+    fu.offset = (uint32_t)reader->slot;
+    fu.fds = (uint64_t)(uintptr_t)&reader->fd;
+    if (syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_FILES_UPDATE, &fu, 1) != 1) uring.fixed_files = 0;
+  }
+#ifdef __linux__
+  posix_fadvise(reader->fd, reader->pos, reader->end - reader->pos, POSIX_FADV_SEQUENTIAL);
+#endif
+  reader->subpos = reader->pos;
+  return 0;
+}
+
+
+/* Finish a file with stdio reads once io_uring has failed */
+static ssize_t uring_to_stdio(filereader_t * const restrict reader, const void ** const restrict data)
+{
+  uring_fail();
+  reader->mode = READ_MODE_STDIO;
+  if (slotbuf[reader->slot] == NULL) {
+    slotbuf[reader->slot] = (char *)malloc(auto_chunk_size);
+    if (unlikely(slotbuf[reader->slot] == NULL)) jc_oom("uring_to_stdio() buffer");
+  }
+  reader->reseek = 1;
+  return read_piece(reader, data);
+}
+
+
+static ssize_t read_uring(filereader_t * const restrict reader, const void ** const restrict data)
+{
+  const int slot = reader->slot;
+  const unsigned i = reader->consumed % (unsigned)io_queue_depth;
+  char *buf = uring_buf[slot] + auto_chunk_size * i;
+  size_t want = auto_chunk_size;
+  ssize_t got;
+
+  /* The piece handed out last time is no longer in use; reuse its buffer */
+  if (uring.fd < 0 || uring_queue_reads(reader) != 0 || uring_wait(slot, i) != 0)
+    return uring_to_stdio(reader, data);
+  if ((off_t)want > reader->end - reader->pos) want = (size_t)(reader->end - reader->pos);
+  got = uring_res[slot][i];
+  if (got < 0) return -1;
+  /* Finish short reads synchronously; hitting EOF means the file shrank */
+  while ((size_t)got < want) {
+    ssize_t more = pread(reader->fd, buf + got, want - (size_t)got, reader->pos + got);
+    if (more <= 0) return -1;
+    got += more;
+  }
+  reader->consumed++;
+  reader->pos += got;
+  *data = buf;
+  return got;
+}
+
+
+/* Wait out reads still in flight so their buffers can be reused; if that
+ * fails, the ring is torn down and its buffers are never used again */
+static void close_uring(filereader_t * const restrict reader)
+{
+  struct io_uring_files_update fu;
+  int fd = -1;
+
+  if (uring.fd < 0) return;
+  while (reader->consumed < reader->submitted) {
+    if (uring_wait(reader->slot, reader->consumed % (unsigned)io_queue_depth) != 0) {
+      uring_fail();
+      return;
+    }
+    reader->consumed++;
+  }
+  if (uring.fixed_files) {
+    memset(&fu, 0, sizeof(fu));
+    fu.offset = (uint32_t)reader->slot;
+    fu.fds = (uint64_t)(uintptr_t)&fd;
+    syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_FILES_UPDATE, &fu, 1);
+  }
+  return;
+}
+#endif /* ENABLE_IO_URING */
+
+
+#ifdef ENABLE_THREADS
+/* Each reader slot gets a helper thread that fills a ring of read_ring_count
+ * chunk buffers ahead of the consumer, so reading the next piece of a file
+ * overlaps with hashing or comparing the current one. */
+struct ring_state {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int fd;             /* File being read or -1 if idle */
+  off_t pos, end;     /* Range still to be read by the helper */
+  unsigned head;      /* Next buffer the consumer will take */
+  unsigned tail;      /* Next buffer the helper will fill */
+  int held;           /* Consumer holds buffer head - 1 */
+  int stop;           /* Consumer wants the helper to drop the file */
+  int busy;           /* Helper is working on a file */
+  char *buf;
+  ssize_t *len;
+};
+
+static struct ring_state ring[READER_SLOTS];
+static int ring_started[READER_SLOTS] = { 0 };
+
+
+static void *ring_thread(void *arg)
+{
+  struct ring_state * const r = (struct ring_state *)arg;
+
+  pthread_mutex_lock(&r->lock);
+  while (1) {
+    unsigned i;
+    size_t want;
+    ssize_t got = 0, more;
+
+    while (r->fd == -1 || r->stop != 0 || r->pos >= r->end || r->tail - r->head >= (unsigned)read_ring_count) {
+      if (r->busy != 0 && (r->stop != 0 || r->pos >= r->end)) {
+        r->busy = 0;
+        pthread_cond_broadcast(&r->cond);
+      }
+      pthread_cond_wait(&r->cond, &r->lock);
+    }
+    i = r->tail % (unsigned)read_ring_count;
+    want = auto_chunk_size;
+    if ((off_t)want > r->end - r->pos) want = (size_t)(r->end - r->pos);
+    pthread_mutex_unlock(&r->lock);
+
+    /* A regular file only comes up short at EOF, i.e. it shrank */
+    while ((size_t)got < want) {
+      more = pread(r->fd, r->buf + auto_chunk_size * i + got, want - (size_t)got, r->pos + got);
+      if (more <= 0) break;
+      got += more;
+    }
+
+    pthread_mutex_lock(&r->lock);
+    if ((size_t)got < want) {
+      r->len[i] = -1;
+      r->pos = r->end;
+    } else {
+      r->len[i] = got;
+      r->pos += got;
+    }
+    r->tail++;
+    pthread_cond_broadcast(&r->cond);
+  }
+  return NULL;
+}
+
+
+static int open_ring(filereader_t * const restrict reader)
+{
+  struct ring_state * const r = &ring[reader->slot];
+
+  if (ring_started[reader->slot] == 0) {
+    r->buf = (char *)malloc(auto_chunk_size * (size_t)read_ring_count);
+    r->len = (ssize_t *)malloc(sizeof(ssize_t) * (size_t)read_ring_count);
+    if (r->buf == NULL || r->len == NULL) jc_oom("open_ring() buffers");
+    r->fd = -1;
+    if (pthread_mutex_init(&r->lock, NULL) != 0 || pthread_cond_init(&r->cond, NULL) != 0
+        || pthread_create(&r->thread, NULL, ring_thread, r) != 0) {
+      fprintf(stderr, "warning: can't start reader thread, using stdio reads\n");
+      read_mode = READ_MODE_STDIO;
+      return 1;
+    }
+    ring_started[reader->slot] = 1;
+  }
+
+#ifdef __linux__
+  posix_fadvise(reader->fd, reader->pos, reader->end - reader->pos, POSIX_FADV_SEQUENTIAL);
+#endif
+  pthread_mutex_lock(&r->lock);
+  r->pos = reader->pos;
+  r->end = reader->end;
+  r->head = r->tail = 0;
+  r->held = 0;
+  r->stop = 0;
+  r->busy = 1;
+  r->fd = reader->fd;
+  pthread_cond_broadcast(&r->cond);
+  pthread_mutex_unlock(&r->lock);
+  return 0;
+}
+
+
+static ssize_t read_ring(filereader_t * const restrict reader, const void ** const restrict data)
+{
+  struct ring_state * const r = &ring[reader->slot];
+  unsigned i;
+  ssize_t got;
+
+  pthread_mutex_lock(&r->lock);
+  /* Give the previously handed out buffer back to the helper */
+  if (r->held != 0) {
+    r->head++;
+    r->held = 0;
+    pthread_cond_broadcast(&r->cond);
+  }
+  while (r->tail == r->head) pthread_cond_wait(&r->cond, &r->lock);
+  i = r->head % (unsigned)read_ring_count;
+  got = r->len[i];
+  r->held = 1;
+  pthread_mutex_unlock(&r->lock);
+
+  if (got < 0) return -1;
+  *data = r->buf + auto_chunk_size * i;
+  reader->pos += got;
+  return got;
+}
+
+
+/* Stop the helper and wait until it no longer touches the file */
+static void close_ring(filereader_t * const restrict reader)
+{
+  struct ring_state * const r = &ring[reader->slot];
+
+  pthread_mutex_lock(&r->lock);
+  r->stop = 1;
+  pthread_cond_broadcast(&r->cond);
+  while (r->busy != 0) pthread_cond_wait(&r->cond, &r->lock);
+  r->fd = -1;
+  pthread_mutex_unlock(&r->lock);
+  return;
+}
+#endif /* ENABLE_THREADS */
+
+
+#ifdef ENABLE_DIRECTIO
+/* Open a file for uncached reading. Filesystems that refuse O_DIRECT get a
+ * normal descriptor and have their pages dropped after each read instead.
+ * Returns 0 on success, -1 if the file can't be opened */
+static int open_direct(filereader_t * const restrict reader)
+{
+  if (directbuf_size == 0) {
+    directbuf_size = auto_chunk_size > DIRECT_IO_MIN ? auto_chunk_size : DIRECT_IO_MIN;
+    directbuf_size = (directbuf_size + DIRECT_ALIGN - 1) & ~((size_t)DIRECT_ALIGN - 1);
+  }
+  if (unlikely(directbuf[reader->slot] == NULL)) {
+    if (posix_memalign((void **)&directbuf[reader->slot], DIRECT_ALIGN, directbuf_size) != 0)
+      jc_oom("open_direct() buffer");
+  }
+
+  reader->fd = open(reader->file->d_name, O_RDONLY | O_DIRECT);
+  if (reader->fd == -1 && errno == EINVAL) {
+    LOUD(fprintf(stderr, "open_direct: O_DIRECT rejected for '%s', using buffered reads\n", reader->file->d_name));
+    reader->uncached = 1;
+    reader->fd = open(reader->file->d_name, O_RDONLY);
+  }
+  if (reader->fd == -1) return -1;
+  return 0;
+}
+
+
+/* Read the next block-aligned piece of the file into the slot buffer */
+static ssize_t read_direct(filereader_t * const restrict reader, const void ** const restrict data)
+{
+  off_t aligned = reader->pos & ~((off_t)DIRECT_ALIGN - 1);
+  size_t skip = (size_t)(reader->pos - aligned);
+  size_t iosize = directbuf_size;
+  ssize_t got;
+
+  /* Don't read far past the end of the wanted range (i.e. partial hashes) */
+  if ((off_t)iosize > reader->end - aligned)
+    iosize = ((size_t)(reader->end - aligned) + DIRECT_ALIGN - 1) & ~((size_t)DIRECT_ALIGN - 1);
+
+  got = pread(reader->fd, directbuf[reader->slot], iosize, aligned);
+  if (got == -1 && errno == EINVAL && reader->uncached == 0) {
+    /* Some filesystems accept O_DIRECT at open time but fail the reads */
+    LOUD(fprintf(stderr, "read_direct: O_DIRECT read failed for '%s', using buffered reads\n", reader->file->d_name));
+    if (fcntl(reader->fd, F_SETFL, fcntl(reader->fd, F_GETFL) & ~O_DIRECT) == -1) return -1;
+    reader->uncached = 1;
+    got = pread(reader->fd, directbuf[reader->slot], iosize, aligned);
+  }
+  if (got == -1) return -1;
+  if (reader->uncached != 0) posix_fadvise(reader->fd, aligned, got, POSIX_FADV_DONTNEED);
+  /* A short read that doesn't reach the wanted data means the file shrank */
+  if ((size_t)got <= skip) return -1;
+
+  got -= (ssize_t)skip;
+  if (got > reader->end - reader->pos) got = (ssize_t)(reader->end - reader->pos);
+  *data = directbuf[reader->slot] + skip;
+  reader->pos += got;
+  return got;
+}
+#endif /* ENABLE_DIRECTIO */
+
+
+#ifdef ENABLE_SPARSE
+/* Find the data extent at or after reader->pos with SEEK_DATA/SEEK_HOLE
+ * Returns 0 on success, -1 if the file shrank */
+static int find_data(filereader_t * const restrict reader)
+{
+  int fd = reader->fp != NULL ? fileno(reader->fp) : reader->fd;
+  off_t data, hole;
+
+  data = lseek(fd, reader->pos, SEEK_DATA);
+  if (data == -1) {
+    struct stat s;
+
+    if (errno != ENXIO) {
+      /* Filesystem can't tell us; read the rest normally */
+      reader->sparse = 0;
+      reader->data_start = reader->pos;
+      reader->data_end = reader->end;
+      return 0;
+    }
+    /* No more data: either a trailing hole or the file was truncated */
+    if (fstat(fd, &s) != 0 || s.st_size < reader->end) return -1;
+    data = reader->end;
+  }
+  if (data > reader->end) data = reader->end;
+  hole = reader->end;
+  if (data < reader->end) {
+    hole = lseek(fd, data, SEEK_HOLE);
+    if (hole == -1 || hole > reader->end) hole = reader->end;
+  }
+  reader->data_start = data;
+  reader->data_end = hole;
+  reader->reseek = 1;
+  LOUD(fprintf(stderr, "find_data: '%s' data %" PRIdMAX "-%" PRIdMAX "\n", reader->file->d_name, (intmax_t)data, (intmax_t)hole));
+  return 0;
+}
+
+
+/* Decide whether holes in a file are worth looking for: only files with
+ * fewer blocks allocated than their size can have any */
+static void check_sparse(filereader_t * const restrict reader)
+{
+  struct stat s;
+  int fd = reader->fp != NULL ? fileno(reader->fp) : reader->fd;
+
+  if (sparse_reads == 0 || reader->pos >= reader->end) return;
+  if (fstat(fd, &s) != 0 || (off_t)s.st_blocks * 512 >= s.st_size) return;
+  if (unlikely(zerobuf == NULL)) {
+    zerobuf = (char *)calloc(1, auto_chunk_size);
+    if (unlikely(zerobuf == NULL)) jc_oom("check_sparse() buffer");
+  }
+  reader->sparse = 1;
+  reader->data_start = reader->data_end = reader->pos;
+  return;
+}
+#endif /* ENABLE_SPARSE */
+
+
+/* Prepare to read 'length' bytes of a file starting at offset 'start'
+ * slot selects the buffers used; at most one reader per slot may be open
+ * Returns 0 on success, -1 if the file can't be opened */
+int reader_open(filereader_t * const restrict reader, const file_t * const restrict file,
+		const off_t start, const off_t length, const int slot)
+{
+  if (unlikely(reader == NULL || file == NULL || file->d_name == NULL)) jc_nullptr("reader_open()");
+  if (unlikely(slot < 0 || slot >= READER_SLOTS)) jc_nullptr("reader_open() slot");
+  LOUD(fprintf(stderr, "reader_open('%s', %" PRIdMAX ", %" PRIdMAX ", %d)\n", file->d_name, (intmax_t)start, (intmax_t)length, slot));
+
+  memset(reader, 0, sizeof(filereader_t));
+  reader->file = file;
+  reader->slot = slot;
+  reader->pos = start;
+  reader->end = start + length;
+  reader->mode = read_mode;
+  reader->fd = -1;
+
+#ifdef ENABLE_DIRECTIO
+  if (reader->mode == READ_MODE_DIRECT) {
+    errno = 0;
+    if (open_direct(reader) != 0) return -1;
+ #ifdef ENABLE_SPARSE
+    check_sparse(reader);
+ #endif
+    return 0;
+  }
+#endif /* ENABLE_DIRECTIO */
+
+  /* Files usually stay open from the partial hash through confirmation */
+  errno = 0;
+  reader->fp = fdcache_open(file);
+  if (reader->fp == NULL) return -1;
+
+#ifdef ENABLE_THREADS
+  if (reader->mode == READ_MODE_THREAD) {
+    reader->fd = fileno(reader->fp);
+    if (open_ring(reader) == 0) return 0;
+    reader->mode = READ_MODE_STDIO;
+  }
+#endif /* ENABLE_THREADS */
+#ifdef ENABLE_IO_URING
+  if (reader->mode == READ_MODE_URING) {
+    if (uring_setup() == 0) {
+      reader->fd = fileno(reader->fp);
+      return open_uring(reader);
+    }
+    read_mode = reader->mode = READ_MODE_STDIO;
+  }
+#endif /* ENABLE_IO_URING */
+
+#ifdef ENABLE_MMAP
+  if (reader->mode == READ_MODE_MMAP) {
+    map_fault[slot] = 0;
+    if (length == 0 || init_mmap() != 0 || map_window(reader) != 0) {
+      LOUD(fprintf(stderr, "reader_open: falling back to stdio for '%s'\n", file->d_name));
+      reader->mode = READ_MODE_STDIO;
+    } else {
+ #ifdef ENABLE_SPARSE
+      check_sparse(reader);
+ #endif
+      return 0;
+    }
+  }
+#endif /* ENABLE_MMAP */
+
+  reader->mode = READ_MODE_STDIO;
+  if (unlikely(slotbuf[slot] == NULL)) {
+    slotbuf[slot] = (char *)malloc(auto_chunk_size);
+    if (unlikely(slotbuf[slot] == NULL)) jc_oom("reader_open() buffer");
+  }
+  /* A cached stream may be anywhere from an earlier read */
+  clearerr(reader->fp);
+  if (fseeko(reader->fp, start, SEEK_SET) == -1) {
+    fdcache_release(file, reader->fp);
+    reader->fp = NULL;
+    return -1;
+  }
+#ifdef __linux__
+  /* Tell Linux we will access sequentially and soon; a tuned read-ahead
+   * window is requested piece by piece in reader_next() instead */
+  posix_fadvise(fileno(reader->fp), start, length, POSIX_FADV_SEQUENTIAL);
+  if (read_ahead == 0) posix_fadvise(fileno(reader->fp), start, length, POSIX_FADV_WILLNEED);
+  reader->ra_end = start;
+#endif /* __linux__ */
+#ifdef ENABLE_SPARSE
+  check_sparse(reader);
+#endif
+  return 0;
+}
+
+
+/* Get the next piece of file data; *data points to it until the next call
+ * Returns number of bytes available, 0 at the end of the range, -1 on error */
+ssize_t reader_next(filereader_t * const restrict reader, const void ** const restrict data)
+{
+#ifdef ENABLE_SPARSE
+  off_t end;
+  ssize_t got;
+#endif
+
+  if (unlikely(reader == NULL || data == NULL)) jc_nullptr("reader_next()");
+  if (reader->pos >= reader->end) return 0;
+
+#ifdef ENABLE_SPARSE
+  /* Holes read back as zeroes, so hand out the shared zero buffer for them
+   * instead of reading. Pieces still split only on filesystem block
+   * boundaries, so hashes come out the same as for the equivalent dense
+   * file, and comparing two identical hole layouts reads nothing at all */
+  if (reader->sparse != 0) {
+    if (reader->pos >= reader->data_end && find_data(reader) != 0) return -1;
+    if (reader->pos < reader->data_start) {
+      size_t bytes = auto_chunk_size;
+      if ((off_t)bytes > reader->data_start - reader->pos) bytes = (size_t)(reader->data_start - reader->pos);
+      *data = zerobuf;
+      reader->pos += (off_t)bytes;
+      return (ssize_t)bytes;
+    }
+    if (reader->sparse != 0) {
+      end = reader->end;
+      reader->end = reader->data_end;
+      got = read_piece(reader, data);
+      reader->end = end;
+      return got;
+    }
+  }
+#endif /* ENABLE_SPARSE */
+  return read_piece(reader, data);
+}
+
+
+/* Read the next piece of the range with the reader's backend */
+static ssize_t read_piece(filereader_t * const restrict reader, const void ** const restrict data)
+{
+  size_t bytes;
+
+#ifdef ENABLE_DIRECTIO
+  if (reader->mode == READ_MODE_DIRECT) return read_direct(reader, data);
+#endif
+#ifdef ENABLE_IO_URING
+  if (reader->mode == READ_MODE_URING) return read_uring(reader, data);
+#endif
+#ifdef ENABLE_THREADS
+  if (reader->mode == READ_MODE_THREAD) return read_ring(reader, data);
+#endif
+
+#ifdef ENABLE_MMAP
+  if (reader->mode == READ_MODE_MMAP) {
+    size_t step = auto_chunk_size > MMAP_STEP ? auto_chunk_size : MMAP_STEP;
+    off_t winpos;
+
+    if (unlikely(map_fault[reader->slot] != 0)) return -1;
+    if (reader->pos >= reader->mapoff + (off_t)reader->maplen)
+      if (map_window(reader) != 0) return -1;
+    winpos = reader->pos - reader->mapoff;
+    bytes = reader->maplen - (size_t)winpos;
+    if (bytes > step) bytes = step;
+    if ((off_t)bytes > reader->end - reader->pos) bytes = (size_t)(reader->end - reader->pos);
+    *data = reader->map + winpos;
+    reader->pos += (off_t)bytes;
+    return (ssize_t)bytes;
+  }
+#endif /* ENABLE_MMAP */
+
+  bytes = auto_chunk_size;
+  if ((off_t)bytes > reader->end - reader->pos) bytes = (size_t)(reader->end - reader->pos);
+#ifdef __linux__
+  if (read_ahead != 0 && reader->ra_end < reader->end && reader->pos + (off_t)read_ahead > reader->ra_end) {
+    off_t ra = reader->pos + (off_t)read_ahead;
+    if (ra > reader->end) ra = reader->end;
+    posix_fadvise(fileno(reader->fp), reader->ra_end, ra - reader->ra_end, POSIX_FADV_WILLNEED);
+    reader->ra_end = ra;
+  }
+#endif /* __linux__ */
+  if (reader->reseek != 0) {
+    if (fseeko(reader->fp, reader->pos, SEEK_SET) == -1) return -1;
+    reader->reseek = 0;
+  }
+  if (unlikely(fread(slotbuf[reader->slot], bytes, 1, reader->fp) != 1)) return -1;
+  *data = slotbuf[reader->slot];
+  reader->pos += (off_t)bytes;
+  return (ssize_t)bytes;
+}
+
+
+/* Current length of the file being read (-1 if it can't be found) */
+off_t reader_file_size(const filereader_t * const restrict reader)
+{
+  struct stat s;
+  int fd;
+
+  if (unlikely(reader == NULL)) jc_nullptr("reader_file_size()");
+  fd = (reader->fp != NULL) ? fileno(reader->fp) : reader->fd;
+  if (fd < 0 || fstat(fd, &s) != 0) return -1;
+  return s.st_size;
+}
+
+
+/* Release a reader; returns nonzero if data handed out may have been bad */
+int reader_close(filereader_t * const restrict reader)
+{
+  int retval = 0;
+
+  if (unlikely(reader == NULL)) jc_nullptr("reader_close()");
+#ifdef ENABLE_MMAP
+  if (reader->mode == READ_MODE_MMAP) {
+    unmap_window(reader);
+    if (map_fault[reader->slot] != 0) {
+      LOUD(fprintf(stderr, "reader_close: '%s' shrank while mapped\n", reader->file->d_name));
+      retval = 1;
+    }
+  }
+#endif /* ENABLE_MMAP */
+#ifdef ENABLE_IO_URING
+  if (reader->mode == READ_MODE_URING) close_uring(reader);
+#endif
+#ifdef ENABLE_THREADS
+  if (reader->mode == READ_MODE_THREAD) close_ring(reader);
+#endif
+  if (reader->fp != NULL) fdcache_release(reader->file, reader->fp);
+  else if (reader->fd != -1) close(reader->fd);
+  reader->fp = NULL;
+  reader->fd = -1;
+  return retval;
+}
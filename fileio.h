@@ -0,0 +1,50 @@
+/* jdupes file data reading backends
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifndef JDUPES_FILEIO_H
+#define JDUPES_FILEIO_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <sys/types.h>
+#include "jdupes.h"
+
+/* Number of readers that may be open at the same time */
+#define READER_SLOTS 2
+
+/* Sequential reader for a range of one file's data */
+typedef struct _filereader {
+  const file_t *file;
+  FILE *fp;
+  int fd;          /* Descriptor for backends that bypass stdio (not owned
+                      by the reader unless fp is NULL) */
+  int slot;
+  int mode;        /* READ_MODE_* actually in use for this file */
+  off_t pos;       /* Next offset to be returned */
+  off_t end;       /* Offset after the last byte to be returned */
+  char *map;       /* Current mmap() window (READ_MODE_MMAP) */
+  size_t maplen;
+  off_t mapoff;    /* File offset of the start of the window */
+  int uncached;    /* READ_MODE_DIRECT without O_DIRECT: drop pages after reads */
+  off_t subpos;    /* READ_MODE_URING: offset of the next read to queue */
+  unsigned submitted, consumed;  /* READ_MODE_URING: pieces queued/handed out */
+  off_t ra_end;    /* READ_MODE_STDIO: end of the read-ahead requested so far */
+  int sparse;      /* File has holes: skip reading them (see reader_next()) */
+  off_t data_start, data_end;  /* Current data extent; holes lie before data_start */
+  int reseek;      /* READ_MODE_STDIO: stream position is stale after a hole */
+} filereader_t;
+
+int reader_open(filereader_t * const restrict reader, const file_t * const restrict file,
+		const off_t start, const off_t length, const int slot);
+ssize_t reader_next(filereader_t * const restrict reader, const void ** const restrict data);
+off_t reader_file_size(const filereader_t * const restrict reader);
+int reader_close(filereader_t * const restrict reader);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* JDUPES_FILEIO_H */
@@ -22,6 +22,7 @@
 #include <stdio.h>
 #include <libjodycode.h>
 #include "jdupes.h"
+#include "fdcache.h"
 #include "likely_unlikely.h"
 
 /* Check file's stat() info to make sure nothing has changed
@@ -29,6 +30,7 @@
 int file_has_changed(file_t * const restrict file)
 {
   struct JC_STAT s;
+  int path_checked = 0;
 
   /* If -t/--no-change-check specified then completely bypass this code */
   if (ISFLAG(flags, F_NOCHANGECHECK)) return 0;
@@ -38,6 +40,19 @@ int file_has_changed(file_t * const restrict file)
 
   if (!ISFLAG(file->flags, FF_VALID_STAT)) return -66;
 
+#ifndef ON_WINDOWS
+  /* If the file is still open from hashing, check what was actually read
+   * and make sure the path still leads to it. The file is about to be acted
+   * upon, so stop holding it open. */
+  if (!ISFLAG(file->flags, FF_IS_SYMLINK) && fdcache_fstat(file, &s) == 0) {
+    struct JC_STAT ps;
+
+    fdcache_drop(file);
+    if (lstat(file->d_name, &ps) != 0) return -3;
+    if (ps.st_ino != s.st_ino || ps.st_dev != s.st_dev || S_ISLNK(ps.st_mode)) return 1;
+    path_checked = 1;
+  } else
+#endif /* ON_WINDOWS */
   if (jc_stat(file->d_name, &s) != 0) return -2;
   if (file->inode != s.st_ino) return 1;
   if (file->size != s.st_size) return 1;
@@ -51,10 +66,13 @@ int file_has_changed(file_t * const restrict file)
   if (file->gid != s.st_gid) return 1;
 #endif
 #ifndef NO_SYMLINKS
-  if (lstat(file->d_name, &s) != 0) return -3;
-  if ((S_ISLNK(s.st_mode) > 0) ^ ISFLAG(file->flags, FF_IS_SYMLINK)) return 1;
+  if (path_checked == 0) {
+    if (lstat(file->d_name, &s) != 0) return -3;
+    if ((S_ISLNK(s.st_mode) > 0) ^ ISFLAG(file->flags, FF_IS_SYMLINK)) return 1;
+  }
 #endif
 
+  (void)path_checked;
   return 0;
 }
 
@@ -3,338 +3,1836 @@
 
 #include <errno.h>
 #include <inttypes.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #include <time.h>
+#ifndef ON_WINDOWS
+ #include <fcntl.h>
+ #include <unistd.h>
+ #ifndef NO_MMAP
+  #include <sys/mman.h>
+ #endif
+ #define ENABLE_HASHDB_LOCK 1
+#endif
 #include "jdupes.h"
 #include "libjodycode.h"
 #include "likely_unlikely.h"
 #include "hashdb.h"
 
-#define HASHDB_VER 2
+#if !defined ON_WINDOWS && !defined NO_THREADS
+ #include <pthread.h>
+ #define ENABLE_THREADS 1
+#endif
+
+#define HASHDB_VER 3
 #define HASHDB_MIN_VER 1
-#define HASHDB_MAX_VER 2
+#define HASHDB_MAX_VER 4
+/* Text version used for journal lines (adds the device number) */
+#define HASHDB_JOURNAL_VER 4
 #ifndef PH_SHIFT
  #define PH_SHIFT 12
 #endif
 #define SECS_TO_TIME(a,b) strftime(a, 32, "%F %T", localtime(b));
 
-#ifndef HT_SIZE
- #define HT_SIZE 131072
+/* New and changed entries are kept in an open addressing table keyed by
+ * path hash (linear probing, doubled at 3/4 full). Entries are carved out
+ * of fixed-size slabs and paths out of arena blocks, so entries never move
+ * once added and nothing is freed until the database is destroyed */
+#ifndef HT_MIN_SIZE
+ #define HT_MIN_SIZE 4096
 #endif
-#define HT_MASK (HT_SIZE - 1)
-
-static hashdb_t *hashdb[HT_SIZE];
-static int hashdb_init = 0;
+#define HDB_SLAB_ENTRIES 4096
+#define HDB_ARENA_SIZE 1048576
+
+struct arena_block {
+  struct arena_block *next;
+  size_t used, size;
+  char data[];
+};
+
+static hashdb_t **hashdb = NULL;
+static uint64_t ht_size = 0, ht_used = 0;
+/* Secondary table of entries keyed by device and inode, used to find the
+ * hashes of files that were moved or renamed. Slots may go stale when an
+ * entry changes, so every hit is checked against the entry itself */
+static hashdb_t **ino_table = NULL;
+static uint64_t ino_size = 0, ino_used = 0;
+static hashdb_t **slabs = NULL;
+static uint64_t slab_count = 0, slab_alloc = 0, entry_count = 0;
+static struct arena_block *arena = NULL;
 static int hashdb_algo = 0;
 static int hashdb_dirty = 0;
 
-/* Pivot direction for rebalance */
-enum pivot { PIVOT_LEFT, PIVOT_RIGHT };
+/* Binary database layout (native byte order):
+ *   struct hdb_header
+ *   struct hdb_record[count], sorted by directory hash, then path_hash
+ *   string heap of NUL-terminated paths (hdb_record.path_off)
+ *   uint64_t[ino_count] record numbers sorted by device and inode (v5+)
+ *   struct hdb_part[part_count], one per directory, sorted by hash (v6+)
+ * The file is mapped and searched in place; the table above only holds
+ * entries added or changed during this run and overrides the file.
+ * The records of each directory are contiguous, so a scan only touches
+ * the parts of the file for the directories it enters. v4 and v5 files
+ * are sorted by path_hash alone and are rewritten as v6 when saved */
+#define HASHDB_MAGIC "JDHASHDB"
+#define HASHDB_BIN_VER 6
+#define HASHDB_BIN_MIN_VER 4
+#define HASHDB_ENDIAN 0x01020304U
+
+struct hdb_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t endian;
+  uint32_t hash_algo;
+  uint32_t record_size;
+  uint64_t count;
+  uint64_t heap_offset;
+  uint64_t heap_size;
+  uint64_t save_time;
+  /* v5+ */
+  uint64_t ino_offset;
+  uint64_t ino_count;
+  /* v6+ */
+  uint64_t part_offset;
+  uint64_t part_count;
+};
+/* Older headers end before the fields added later */
+#define HDB_HEADER_V4_SIZE offsetof(struct hdb_header, ino_offset)
+#define HDB_HEADER_V5_SIZE offsetof(struct hdb_header, part_offset)
+
+struct hdb_record {
+  uint64_t path_hash;
+  uint64_t partialhash;
+  uint64_t fullhash;
+  uint64_t inode;
+  uint64_t device;
+  int64_t size;
+  int64_t mtime;
+  uint64_t path_off;
+  uint32_t path_len;
+  uint32_t partialsize;
+  uint32_t hashcount;
+  uint32_t reserved;
+};
+
+/* Records first..first+count-1 are in directories with this hash */
+struct hdb_part {
+  uint64_t dir_hash;
+  uint64_t first;
+  uint64_t count;
+};
+#define NO_PART UINT64_MAX
+
+/* The loaded binary database */
+static void *db_map = NULL;
+static size_t db_maplen = 0;
+static const struct hdb_record *db_rec = NULL;
+static const char *db_heap = NULL;
+static uint64_t db_count = 0;
+static const uint64_t *db_ino = NULL;
+static uint64_t db_ino_count = 0;
+static uint64_t db_heap_size = 0;
+static const struct hdb_part *db_part = NULL;
+static uint64_t db_part_count = 0;
+
+/* Directory of the last path looked up and its partition */
+static uint64_t dir_buf[(PATH_MAX + 8) / sizeof(uint64_t)];
+static size_t dir_buf_len = SIZE_MAX;
+static uint64_t dir_buf_hash = 0;
+static uint64_t part_cache_hash = 0, part_cache = NO_PART;
+static int part_cache_valid = 0;
+
+/* Subtrees forgotten since the database was written. Mapped records under
+ * them are treated as gone and dropped by the next compaction; a journal
+ * line with this hashcount and the directory as its path records one.
+ * They are kept sorted by directory hash, and whether a directory lies
+ * under one is remembered for the last directory asked about */
+#define HASHDB_SUBTREE 3
+struct dead_dir {
+  uint64_t dir_hash;
+  const char *path;
+  size_t len;
+};
+static struct dead_dir *dead_dirs = NULL;
+static uint64_t dead_count = 0, dead_alloc = 0;
+static uint64_t dead_cache_hash = 0;
+static int dead_cache = 0, dead_cache_valid = 0;
+
+/* Changes made since the last compaction are appended to a journal as they
+ * happen; saving only flushes it. The journal is folded into a new binary
+ * database once it grows large relative to the database it belongs to.
+ * Several processes may share a database: appends and compaction hold an
+ * exclusive lock on <db>.lock, loading holds a shared one, and compaction
+ * first merges in whatever other processes wrote since this one loaded */
+#ifndef JOURNAL_COMPACT_MIN
+ #define JOURNAL_COMPACT_MIN 65536
+#endif
+#define JOURNAL_BUF_SIZE 65536
+#define JOURNAL_LINE_MAX (PATH_MAX + 128)
+static char *journal_name = NULL;
+static FILE *journal = NULL;
+static char *journal_buf = NULL;
+static size_t journal_buf_len = 0;
+static int64_t journal_offset = 0;  /* Journal bytes already applied */
+static uint64_t journal_count = 0;
+static uint64_t journal_added = 0;
+static int journal_failed = 0;
+static int base_binary = 0;
+
+/* load_database_file() modes */
+#define LOAD_JOURNAL	0x1
+#define LOAD_QUIET	0x2  /* Merging another process's changes */
+#define LOAD_MERGE	0x4  /* Another database; newest entries win */
+
+#ifdef ENABLE_HASHDB_LOCK
+static char *lock_name = NULL;
+static int lock_fd = -1;
+static int lock_failed = 0;
+/* Identity of the base file as loaded, to notice replacement */
+static struct stat base_st;
+static int base_st_valid = 0;
+#endif
+
+/* Database pruning: one item per entry, checked in path order */
+#define PRUNE_OK	0
+#define PRUNE_MISSING	1
+#define PRUNE_CHANGED	2
+#define PRUNE_ERROR	3
+#define PRUNE_CHUNK	256
+#define MAX_PRUNE_THREADS 256
+
+struct prune_item {
+  const char *path;
+  int64_t size;
+  int64_t mtime;
+  uint64_t inode;
+  int state;
+};
+
+/* Walks the mapped records and the table together in directory hash,
+ * then path hash order. Records of a v4/v5 file are put in that order
+ * through rv; dir is the directory hash of the last entry returned */
+struct merge_item {
+  uint64_t dir_hash;
+  uint64_t path_hash;
+  hashdb_t *entry;
+  uint64_t rec;
+};
+struct hdb_merge {
+  uint64_t ri;
+  struct merge_item *rv;
+  struct merge_item *ov;
+  uint64_t oi, on;
+  uint64_t dir;
+};
+
+static int get_path_hash(char *path, uint64_t *path_hash);
+static int64_t load_database_file(const char * const restrict dbname, const int mode, const int64_t offset);
+
+
+#if 0
+/* Hex dump 16 bytes of memory */
+void hd16(char *a) {
+  int i;
+
+  printf("DUMP Hex: ");
+  for (i = 0; i < 16; i++) printf("%x", a[i]);
+  printf("\nDUMP ASCII: ");
+  for (i = 0; i < 16; i++) printf("%c", a[i]);
+  printf("\n");
+  return;
+}
+#endif
+
+
+/* Copy a path into the arena */
+static char *arena_path(const char * const restrict path, const size_t len)
+{
+  struct arena_block *block;
+
+  if (arena == NULL || arena->size - arena->used < len + 1) {
+    const size_t size = len + 1 > HDB_ARENA_SIZE ? len + 1 : HDB_ARENA_SIZE;
+
+    block = (struct arena_block *)malloc(sizeof(struct arena_block) + size);
+    if (block == NULL) jc_oom("arena_path()");
+    block->used = 0;
+    block->size = size;
+    block->next = arena;
+    arena = block;
+  }
+  block = arena;
+  memcpy(block->data + block->used, path, len);
+  block->data[block->used + len] = '\0';
+  block->used += len + 1;
+  return block->data + block->used - len - 1;
+}
+
+
+static void ht_insert(hashdb_t * const restrict entry)
+{
+  uint64_t i = entry->path_hash & (ht_size - 1);
+
+  while (hashdb[i] != NULL) i = (i + 1) & (ht_size - 1);
+  hashdb[i] = entry;
+  ht_used++;
+  return;
+}
+
+
+static void ht_grow(void)
+{
+  hashdb_t **old = hashdb;
+  const uint64_t old_size = ht_size;
+
+  ht_size = ht_size ? ht_size * 2 : HT_MIN_SIZE;
+  hashdb = (hashdb_t **)calloc(ht_size, sizeof(hashdb_t *));
+  if (hashdb == NULL) jc_oom("ht_grow()");
+  ht_used = 0;
+  for (uint64_t i = 0; i < old_size; i++) if (old[i] != NULL) ht_insert(old[i]);
+  free(old);
+  return;
+}
+
+
+/* Get the entry at position i in the slabs */
+static inline hashdb_t *slab_entry(const uint64_t i)
+{
+  return &slabs[i / HDB_SLAB_ENTRIES][i % HDB_SLAB_ENTRIES];
+}
+
+
+/* Add a blank entry for a path that is not in the table yet */
+static hashdb_t *new_entry(const char * const restrict path, const int pathlen, const uint64_t path_hash)
+{
+  hashdb_t *entry;
+
+  if ((ht_used + 1) * 4 > ht_size * 3) ht_grow();
+  if (entry_count == slab_count * HDB_SLAB_ENTRIES) {
+    if (slab_count == slab_alloc) {
+      slab_alloc = slab_alloc ? slab_alloc * 2 : 64;
+      slabs = (hashdb_t **)realloc(slabs, sizeof(hashdb_t *) * slab_alloc);
+      if (slabs == NULL) jc_oom("new_entry()");
+    }
+    slabs[slab_count] = (hashdb_t *)malloc(sizeof(hashdb_t) * HDB_SLAB_ENTRIES);
+    if (slabs[slab_count] == NULL) jc_oom("new_entry()");
+    slab_count++;
+  }
+  entry = slab_entry(entry_count++);
+  memset(entry, 0, sizeof(hashdb_t));
+  entry->path_hash = path_hash;
+  entry->path = arena_path(path, (size_t)pathlen);
+  ht_insert(entry);
+  return entry;
+}
+
+
+/* Turn a mapped record into an entry; the path stays in the mapping */
+static void record_to_entry(const struct hdb_record * const restrict rec, hashdb_t * const restrict entry)
+{
+  memset(entry, 0, sizeof(hashdb_t));
+  entry->path_hash = rec->path_hash;
+  entry->path = (char *)(uintptr_t)(db_heap + rec->path_off);
+  entry->partialhash = rec->partialhash;
+  entry->fullhash = rec->fullhash;
+  entry->inode = (jdupes_ino_t)rec->inode;
+  entry->device = (dev_t)rec->device;
+  entry->size = (off_t)rec->size;
+  entry->mtime = (time_t)rec->mtime;
+  entry->partialsize = rec->partialsize;
+  entry->hashcount = (uint_fast8_t)rec->hashcount;
+  return;
+}
+
+
+static inline int is_dir_sep(const char c)
+{
+#ifdef ON_WINDOWS
+  if (c == '\\') return 1;
+#endif
+  return c == '/';
+}
+
+
+/* Length of the directory part of a path (0 for a bare name) */
+static size_t dir_len(const char * const restrict path)
+{
+  size_t len = strlen(path);
+
+  while (len > 0 && !is_dir_sep(path[len - 1])) len--;
+  return len > 0 ? len - 1 : 0;
+}
+
+
+/* Hash the first len bytes of a path as a directory name */
+static uint64_t get_dir_hash(const char * const restrict path, const size_t len)
+{
+  if (len == dir_buf_len && memcmp(dir_buf, path, len) == 0) return dir_buf_hash;
+  if (len > PATH_MAX) return 0;
+  memcpy(dir_buf, path, len);
+  ((char *)dir_buf)[len] = '\0';
+  dir_buf_len = len;
+  dir_buf_hash = 0;
+  if (len != 0 && jc_block_hash(dir_buf, &dir_buf_hash, len) != 0) dir_buf_hash = 0;
+  return dir_buf_hash;
+}
+
+
+/* Binary search the partition table for a directory hash */
+static uint64_t find_part(const uint64_t dir_hash)
+{
+  uint64_t lo = 0, hi = db_part_count;
+
+  if (part_cache_valid != 0 && part_cache_hash == dir_hash) return part_cache;
+  while (lo < hi) {
+    const uint64_t mid = lo + ((hi - lo) >> 1);
+    if (db_part[mid].dir_hash < dir_hash) lo = mid + 1;
+    else hi = mid;
+  }
+  part_cache_hash = dir_hash;
+  part_cache = NO_PART;
+  part_cache_valid = 1;
+  /* Don't follow a damaged partition out of the records */
+  if (lo < db_part_count && db_part[lo].dir_hash == dir_hash
+      && db_part[lo].first <= db_count && db_part[lo].count <= db_count - db_part[lo].first)
+    part_cache = lo;
+  return part_cache;
+}
+
+
+/* Is a path the directory (of len bytes) or anything under it? A prefix
+ * must end at a path component, so "/a/b" does not take in "/a/bc" */
+static int path_under(const char * const restrict path, const char * const restrict dir, const size_t len)
+{
+  if (strncmp(path, dir, len) != 0) return 0;
+  return (path[len] == '\0' || is_dir_sep(path[len]) || (len > 0 && is_dir_sep(dir[len - 1])));
+}
+
+
+/* Hash a directory name like get_dir_hash() without disturbing its cache */
+static uint64_t hash_dir_name(const char * const restrict path, const size_t len)
+{
+  uint64_t name[(PATH_MAX + 8) / sizeof(uint64_t)];
+  uint64_t hash = 0;
+
+  if (len == 0 || len > PATH_MAX) return 0;
+  memcpy(name, path, len);
+  ((char *)name)[len] = '\0';
+  if (jc_block_hash(name, &hash, len) != 0) hash = 0;
+  return hash;
+}
+
+
+/* Index of the forgotten subtree named by the first len bytes of path */
+static uint64_t find_dead(const char * const restrict path, const size_t len, const uint64_t dir_hash)
+{
+  uint64_t lo = 0, hi = dead_count;
+
+  while (lo < hi) {
+    const uint64_t mid = lo + ((hi - lo) >> 1);
+    if (dead_dirs[mid].dir_hash < dir_hash) lo = mid + 1;
+    else hi = mid;
+  }
+  for (; lo < dead_count && dead_dirs[lo].dir_hash == dir_hash; lo++)
+    if (dead_dirs[lo].len == len && memcmp(dead_dirs[lo].path, path, len) == 0) return lo;
+  return UINT64_MAX;
+}
+
+
+/* Is a path under a forgotten subtree? Each ancestor directory is looked
+ * up by its hash; the answer for the path's own directory is cached, as
+ * lookups and merges go through a directory's files together */
+static int path_dead(const char * const restrict path)
+{
+  const size_t dlen = dir_len(path);
+  const uint64_t dir_hash = get_dir_hash(path, dlen);
+
+  /* "/name" and "name" both have an empty directory part */
+  if (dlen == 0 || dead_cache_valid == 0 || dead_cache_hash != dir_hash) {
+    dead_cache = 0;
+    for (size_t i = 0; i <= dlen && dead_cache == 0; i++) {
+      if (!is_dir_sep(path[i])) continue;
+      if (find_dead(path, i, i == dlen ? dir_hash : hash_dir_name(path, i)) != UINT64_MAX) dead_cache = 1;
+    }
+    dead_cache_hash = dir_hash;
+    dead_cache_valid = (dlen != 0);
+  }
+  if (dead_cache != 0) return 1;
+  /* A forgotten path may also name a single file */
+  return find_dead(path, strlen(path), hash_dir_name(path, strlen(path))) != UINT64_MAX;
+}
+
+
+/* Binary search the mapped records for a path */
+static const struct hdb_record *find_record(const char * const restrict path, const uint64_t path_hash)
+{
+  uint64_t lo = 0, hi = db_count, end = db_count;
+
+  /* Only the path's own directory needs to be searched */
+  if (db_part != NULL) {
+    const uint64_t part = find_part(get_dir_hash(path, dir_len(path)));
+    if (part == NO_PART) return NULL;
+    lo = db_part[part].first;
+    hi = end = lo + db_part[part].count;
+  }
+  while (lo < hi) {
+    const uint64_t mid = lo + ((hi - lo) >> 1);
+    if (db_rec[mid].path_hash < path_hash) lo = mid + 1;
+    else hi = mid;
+  }
+  for (; lo < end && db_rec[lo].path_hash == path_hash; lo++) {
+    const struct hdb_record * const rec = &db_rec[lo];
+    /* Don't follow a damaged record out of the heap */
+    if (rec->path_off + rec->path_len >= db_heap_size) continue;
+    if (strcmp(db_heap + rec->path_off, path) == 0) {
+      if (dead_count != 0 && path_dead(path)) return NULL;
+      return rec;
+    }
+  }
+  return NULL;
+}
+
+
+/* Find a path in the table of new and changed entries */
+static hashdb_t *find_overlay(const char * const restrict path, const uint64_t path_hash)
+{
+  uint64_t i;
+
+  if (ht_size == 0) return NULL;
+  i = path_hash & (ht_size - 1);
+  while (hashdb[i] != NULL) {
+    if (hashdb[i]->path_hash == path_hash && strcmp(hashdb[i]->path, path) == 0) return hashdb[i];
+    i = (i + 1) & (ht_size - 1);
+  }
+  return NULL;
+}
+
+
+static inline uint64_t ino_slot(const uint64_t device, const uint64_t inode)
+{
+  return ((inode * 0x9e3779b97f4a7c15ULL) ^ device) & (ino_size - 1);
+}
+
+
+/* Add an entry to the device/inode table */
+static void ino_index(hashdb_t * const restrict entry)
+{
+  uint64_t i;
+
+  if (entry->inode == 0 || entry->device == 0 || entry->hashcount == 0) return;
+  if ((ino_used + 1) * 4 > ino_size * 3) {
+    /* Rebuilding from the entries also drops the stale slots */
+    free(ino_table);
+    ino_size = ino_size ? ino_size * 2 : HT_MIN_SIZE;
+    while (entry_count * 2 > ino_size) ino_size *= 2;
+    ino_table = (hashdb_t **)calloc(ino_size, sizeof(hashdb_t *));
+    if (ino_table == NULL) jc_oom("ino_index()");
+    ino_used = 0;
+    for (uint64_t e = 0; e < entry_count; e++) {
+      hashdb_t * const cur = slab_entry(e);
+      if (cur == entry || cur->inode == 0 || cur->device == 0 || cur->hashcount == 0) continue;
+      for (i = ino_slot((uint64_t)cur->device, (uint64_t)cur->inode); ino_table[i] != NULL; i = (i + 1) & (ino_size - 1));
+      ino_table[i] = cur;
+      ino_used++;
+    }
+  }
+  for (i = ino_slot((uint64_t)entry->device, (uint64_t)entry->inode); ino_table[i] != NULL; i = (i + 1) & (ino_size - 1))
+    if (ino_table[i] == entry) return;
+  ino_table[i] = entry;
+  ino_used++;
+  return;
+}
+
+
+static int ino_compare(const struct hdb_record * const restrict rec, const uint64_t device, const uint64_t inode)
+{
+  if (rec->device != device) return rec->device < device ? -1 : 1;
+  if (rec->inode != inode) return rec->inode < inode ? -1 : 1;
+  return 0;
+}
+
+
+/* Find a valid entry for the same device, inode, size and mtime as a file
+ * whose path isn't in the database; mapped records are copied into view */
+static hashdb_t *find_moved(const file_t * const restrict file, hashdb_t * const restrict view)
+{
+  const uint64_t device = (uint64_t)file->device, inode = (uint64_t)file->inode;
+  uint64_t i, lo, hi;
+
+  if (inode == 0 || device == 0) return NULL;
+  if (ino_size != 0) {
+    for (i = ino_slot(device, inode); ino_table[i] != NULL; i = (i + 1) & (ino_size - 1)) {
+      hashdb_t * const cur = ino_table[i];
+      if ((uint64_t)cur->device == device && (uint64_t)cur->inode == inode && cur->hashcount != 0
+          && cur->size == file->size && cur->mtime == file->mtime) return cur;
+    }
+  }
+
+  /* Don't follow a damaged index out of the records */
+  lo = 0; hi = db_ino_count;
+  while (lo < hi) {
+    const uint64_t mid = lo + ((hi - lo) >> 1);
+    if (db_ino[mid] >= db_count) return NULL;
+    if (ino_compare(&db_rec[db_ino[mid]], device, inode) < 0) lo = mid + 1;
+    else hi = mid;
+  }
+  for (; lo < db_ino_count && db_ino[lo] < db_count && ino_compare(&db_rec[db_ino[lo]], device, inode) == 0; lo++) {
+    const struct hdb_record * const rec = &db_rec[db_ino[lo]];
+
+    if (rec->hashcount == 0 || rec->size != (int64_t)file->size || rec->mtime != (int64_t)file->mtime) continue;
+    if (rec->path_off + rec->path_len >= db_heap_size) continue;
+    /* A record replaced by a table entry was already checked above */
+    if (find_overlay(db_heap + rec->path_off, rec->path_hash) != NULL) continue;
+    if (dead_count != 0 && path_dead(db_heap + rec->path_off)) continue;
+    record_to_entry(rec, view);
+    return view;
+  }
+  return NULL;
+}
+
+
+static int sort_merge_items(const void *a, const void *b)
+{
+  const struct merge_item *m1 = (const struct merge_item *)a;
+  const struct merge_item *m2 = (const struct merge_item *)b;
+
+  if (m1->dir_hash != m2->dir_hash) return m1->dir_hash < m2->dir_hash ? -1 : 1;
+  if (m1->path_hash != m2->path_hash) return m1->path_hash < m2->path_hash ? -1 : 1;
+  return 0;
+}
+
+
+/* Directory hash of a mapped record (0 if the record is damaged) */
+static uint64_t record_dir_hash(const struct hdb_record * const restrict rec)
+{
+  if (rec->path_off + rec->path_len >= db_heap_size) return 0;
+  return get_dir_hash(db_heap + rec->path_off, dir_len(db_heap + rec->path_off));
+}
+
+
+static void merge_start(struct hdb_merge * const restrict m)
+{
+  memset(m, 0, sizeof(struct hdb_merge));
+  /* Records of older files are sorted by path hash only */
+  if (db_part == NULL && db_count > 0) {
+    m->rv = (struct merge_item *)malloc(sizeof(struct merge_item) * db_count);
+    if (m->rv == NULL) jc_oom("merge_start()");
+    for (uint64_t i = 0; i < db_count; i++) {
+      m->rv[i].dir_hash = record_dir_hash(&db_rec[i]);
+      m->rv[i].path_hash = db_rec[i].path_hash;
+      m->rv[i].entry = NULL;
+      m->rv[i].rec = i;
+    }
+    if (db_count > 1) qsort(m->rv, db_count, sizeof(struct merge_item), sort_merge_items);
+  }
+  if (entry_count == 0) return;
+  m->ov = (struct merge_item *)malloc(sizeof(struct merge_item) * entry_count);
+  if (m->ov == NULL) jc_oom("merge_start()");
+  for (m->on = 0; m->on < entry_count; m->on++) {
+    hashdb_t * const cur = slab_entry(m->on);
+    m->ov[m->on].dir_hash = get_dir_hash(cur->path, dir_len(cur->path));
+    m->ov[m->on].path_hash = cur->path_hash;
+    m->ov[m->on].entry = cur;
+    m->ov[m->on].rec = 0;
+  }
+  if (m->on > 1) qsort(m->ov, m->on, sizeof(struct merge_item), sort_merge_items);
+  return;
+}
+
+
+static void merge_end(struct hdb_merge * const restrict m)
+{
+  free(m->rv);
+  free(m->ov);
+  m->rv = m->ov = NULL;
+  return;
+}
+
+
+/* Get the next valid entry in directory and path hash order; returns 0 at
+ * the end. Table entries (including invalidated ones) replace mapped records */
+static int merge_next(struct hdb_merge * const restrict m, hashdb_t * const restrict entry)
+{
+  while (1) {
+    if (m->ri < db_count) {
+      const struct hdb_record *rec;
+      struct merge_item key;
+
+      if (m->rv != NULL) {
+        key = m->rv[m->ri];
+        rec = &db_rec[key.rec];
+      } else {
+        rec = &db_rec[m->ri];
+        key.dir_hash = record_dir_hash(rec);
+        key.path_hash = rec->path_hash;
+      }
+      if (m->oi >= m->on || sort_merge_items(&key, &m->ov[m->oi]) <= 0) {
+        m->ri++;
+        if (rec->hashcount == 0 || rec->path_off + rec->path_len >= db_heap_size) continue;
+        if (find_overlay(db_heap + rec->path_off, rec->path_hash) != NULL) continue;
+        if (dead_count != 0 && path_dead(db_heap + rec->path_off)) continue;
+        record_to_entry(rec, entry);
+        m->dir = key.dir_hash;
+        return 1;
+      }
+    }
+    if (m->oi >= m->on) return 0;
+    if (m->ov[m->oi].entry->hashcount == 0) {
+      m->oi++;
+      continue;
+    }
+    *entry = *m->ov[m->oi].entry;
+    m->dir = m->ov[m->oi++].dir_hash;
+    return 1;
+  }
+}
+
+
+static void free_entries(void)
+{
+  for (uint64_t i = 0; i < slab_count; i++) free(slabs[i]);
+  free(slabs);
+  free(hashdb);
+  free(ino_table);
+  while (arena != NULL) {
+    struct arena_block *next = arena->next;
+    free(arena);
+    arena = next;
+  }
+  slabs = NULL;
+  hashdb = NULL;
+  ino_table = NULL;
+  slab_count = slab_alloc = entry_count = 0;
+  ht_size = ht_used = 0;
+  ino_size = ino_used = 0;
+  /* Forgotten subtree names live in the arena */
+  free(dead_dirs);
+  dead_dirs = NULL;
+  dead_count = dead_alloc = 0;
+  dead_cache_valid = 0;
+  return;
+}
+
+
+static void unmap_database(void)
+{
+  if (db_map == NULL) return;
+#if !defined ON_WINDOWS && !defined NO_MMAP
+  munmap(db_map, db_maplen);
+#else
+  free(db_map);
+#endif
+  db_map = NULL;
+  db_rec = NULL;
+  db_heap = NULL;
+  db_count = 0;
+  db_ino = NULL;
+  db_ino_count = 0;
+  db_part = NULL;
+  db_part_count = 0;
+  part_cache_valid = 0;
+  return;
+}
+
+
+/* Take (F_RDLCK, F_WRLCK) or drop (F_UNLCK) the database lock. If the lock
+ * file can't be used (read-only directory, no lock support) the database
+ * is used without locking, which is only a problem for concurrent runs */
+static void hashdb_lock(const int type)
+{
+#ifdef ENABLE_HASHDB_LOCK
+  struct flock fl;
+
+  if (lock_name == NULL || lock_failed != 0) return;
+  if (lock_fd < 0) {
+    if (type == F_UNLCK) return;
+    lock_fd = open(lock_name, O_RDWR | O_CREAT, 0644);
+    if (lock_fd < 0) goto error_lock;
+  }
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = (short)type;
+  fl.l_whence = SEEK_SET;
+  while (fcntl(lock_fd, F_SETLKW, &fl) != 0) if (errno != EINTR) goto error_lock;
+  return;
+
+error_lock:
+  fprintf(stderr, "warning: cannot lock hashdb '%s': %s; concurrent runs may lose changes\n", lock_name, strerror(errno));
+  if (lock_fd >= 0) close(lock_fd);
+  lock_fd = -1;
+  lock_failed = 1;
+#else
+  (void)type;
+#endif /* ENABLE_HASHDB_LOCK */
+  return;
+}
+#ifndef ENABLE_HASHDB_LOCK
+ #define F_RDLCK 0
+ #define F_WRLCK 1
+ #define F_UNLCK 2
+#endif
+
+
+/* Has another process replaced or removed the open journal? */
+static int journal_replaced(void)
+{
+#ifdef ENABLE_HASHDB_LOCK
+  struct stat open_st, path_st;
+
+  if (journal == NULL) return 0;
+  if (fstat(fileno(journal), &open_st) != 0 || stat(journal_name, &path_st) != 0) return 1;
+  return open_st.st_dev != path_st.st_dev || open_st.st_ino != path_st.st_ino;
+#else
+  return 0;
+#endif
+}
+
+
+/* A process killed mid-write leaves a partial last line; cut it off so
+ * new lines don't get appended to it */
+static void journal_repair(void)
+{
+#ifdef ENABLE_HASHDB_LOCK
+  char tail[JOURNAL_LINE_MAX];
+  struct stat st;
+  off_t start;
+  ssize_t len;
+  int fd;
+
+  fd = open(journal_name, O_RDWR);
+  if (fd < 0) return;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) goto repair_done;
+  start = st.st_size > (off_t)sizeof(tail) ? st.st_size - (off_t)sizeof(tail) : 0;
+  len = pread(fd, tail, (size_t)(st.st_size - start), start);
+  if (len <= 0 || tail[len - 1] == '\n') goto repair_done;
+  while (len > 0 && tail[len - 1] != '\n') len--;
+  LOUD(fprintf(stderr, "journal_repair: cutting partial line at %" PRId64 "\n", (int64_t)(start + len));)
+  if (ftruncate(fd, start + len) != 0) fprintf(stderr, "warning: cannot repair hashdb journal '%s': %s\n", journal_name, strerror(errno));
+repair_done:
+  close(fd);
+#endif
+  return;
+}
+
+
+/* Write buffered journal lines out in one piece under the lock */
+static int journal_flush(void)
+{
+  struct timeval tm;
+  struct JC_STAT st;
+
+  if (journal_buf_len == 0) return 0;
+  if (journal_name == NULL || journal_failed != 0) goto journal_unavailable;
+  hashdb_lock(F_WRLCK);
+  if (journal_replaced() != 0) {
+    /* Compacted by another process; what was written is in its database */
+    fclose(journal);
+    journal = NULL;
+    journal_offset = 0;
+  }
+  errno = 0;
+  if (journal == NULL) {
+    journal_repair();
+    journal = jc_fopen(journal_name, JC_FILE_MODE_WRONLY_APPEND);
+    if (journal == NULL) goto error_journal;
+    /* Each flush must reach the file as one write */
+    setvbuf(journal, NULL, _IONBF, 0);
+    if (jc_stat(journal_name, &st) != 0) goto error_journal;
+    if (st.st_size == 0) {
+      gettimeofday(&tm, NULL);
+      if (fprintf(journal, "jdupes hashdb:%d,%d,%08lx\n", HASHDB_JOURNAL_VER, hash_algo, (unsigned long)tm.tv_sec) < 0) goto error_journal;
+    }
+  }
+  if (fwrite(journal_buf, journal_buf_len, 1, journal) != 1) goto error_journal;
+  hashdb_lock(F_UNLCK);
+  journal_buf_len = 0;
+  return 0;
+
+error_journal:
+  hashdb_lock(F_UNLCK);
+  fprintf(stderr, "warning: cannot write hashdb journal '%s': %s\n", journal_name, strerror(errno));
+  if (journal != NULL) fclose(journal);
+  journal = NULL;
+  journal_failed = 1;
+journal_unavailable:
+  /* Without a journal the whole database must be rewritten on save */
+  journal_buf_len = 0;
+  hashdb_dirty = 1;
+  return -1;
+}
+
+
+/* A run that exits early (CTRL-C) still keeps what it hashed */
+static void journal_atexit(void)
+{
+  journal_flush();
+  return;
+}
+
+
+/* Append a new, changed or invalidated entry to the journal */
+static void journal_entry(const hashdb_t * const restrict cur)
+{
+  int len;
+
+  if (journal_name == NULL || journal_failed != 0) {
+    hashdb_dirty = 1;
+    return;
+  }
+  if (journal_buf == NULL) {
+    journal_buf = (char *)malloc(JOURNAL_BUF_SIZE);
+    if (journal_buf == NULL) jc_oom("journal_entry()");
+    atexit(journal_atexit);
+  }
+  if (JOURNAL_BUF_SIZE - journal_buf_len < JOURNAL_LINE_MAX && journal_flush() != 0) return;
+  len = snprintf(journal_buf + journal_buf_len, JOURNAL_BUF_SIZE - journal_buf_len,
+      "%u,%016" PRIx64 ",%016" PRIx64 ",%016" PRIx64 ",%016" PRIx64 ",%016" PRIx64 ",%08" PRIx32 ",%016" PRIx64 ",%s\n",
+      cur->hashcount, cur->partialhash, cur->fullhash, (uint64_t)cur->mtime, (uint64_t)cur->size, (uint64_t)cur->inode,
+      cur->partialsize, (uint64_t)cur->device, cur->path);
+  if (len < 0 || (size_t)len >= JOURNAL_BUF_SIZE - journal_buf_len) {
+    hashdb_dirty = 1;
+    return;
+  }
+  journal_buf_len += (size_t)len;
+  journal_count++;
+  journal_added++;
+  return;
+}
+
+
+struct ino_key {
+  uint64_t device;
+  uint64_t inode;
+  uint64_t rec;
+};
+
+
+static int sort_by_ino(const void *a, const void *b)
+{
+  const struct ino_key *k1 = (const struct ino_key *)a;
+  const struct ino_key *k2 = (const struct ino_key *)b;
+
+  if (k1->device != k2->device) return k1->device < k2->device ? -1 : 1;
+  if (k1->inode != k2->inode) return k1->inode < k2->inode ? -1 : 1;
+  return 0;
+}
+
+
+/* Record a change to an entry in the inode table and the journal */
+static void entry_changed(hashdb_t * const restrict cur)
+{
+  ino_index(cur);
+  journal_entry(cur);
+  return;
+}
+
+
+/* Mark a subtree as forgotten and invalidate the table entries under it;
+ * mapped records under it are skipped on lookup instead of being touched */
+static const char *forget_subtree(const char * const restrict dir, const size_t len)
+{
+  const uint64_t dir_hash = hash_dir_name(dir, len);
+  const char *path;
+  uint64_t i;
+
+  i = find_dead(dir, len, dir_hash);
+  if (i != UINT64_MAX) {
+    path = dead_dirs[i].path;
+    goto forget_entries;
+  }
+  if (dead_count == dead_alloc) {
+    dead_alloc = dead_alloc ? dead_alloc * 2 : 16;
+    dead_dirs = (struct dead_dir *)realloc(dead_dirs, sizeof(struct dead_dir) * dead_alloc);
+    if (dead_dirs == NULL) jc_oom("forget_subtree()");
+  }
+  /* Keep the list in hash order */
+  for (i = dead_count; i > 0 && dead_dirs[i - 1].dir_hash > dir_hash; i--) dead_dirs[i] = dead_dirs[i - 1];
+  path = arena_path(dir, len);
+  dead_dirs[i].dir_hash = dir_hash;
+  dead_dirs[i].path = path;
+  dead_dirs[i].len = len;
+  dead_count++;
+  dead_cache_valid = 0;
+
+forget_entries:
+  for (i = 0; i < entry_count; i++) {
+    hashdb_t * const cur = slab_entry(i);
+    if (path_under(cur->path, dir, len)) cur->hashcount = 0;
+  }
+  return path;
+}
+
+
+/* Forget everything under a directory that was deleted or moved away */
+int forget_hashdb_subtree(const char * const restrict dir)
+{
+  hashdb_t marker;
+  size_t len;
+
+  if (dir == NULL) return -1;
+  len = strlen(dir);
+  while (len > 0 && is_dir_sep(dir[len - 1])) len--;
+  if (len > PATH_MAX) return -1;
+  memset(&marker, 0, sizeof(marker));
+  marker.path = (char *)(uintptr_t)forget_subtree(dir, len);
+  marker.hashcount = HASHDB_SUBTREE;
+  journal_entry(&marker);
+  return 0;
+}
+
+
+/* Called as loaddir() enters a directory: read its partition ahead of the
+ * lookups for its files instead of faulting it in a page at a time */
+void hashdb_enter_dir(const char * const restrict dir)
+{
+#if !defined ON_WINDOWS && !defined NO_MMAP && defined MADV_WILLNEED
+  static uintptr_t page_mask = 0;
+  const struct hdb_record *first, *last;
+  uintptr_t start, end;
+  uint64_t part;
+  size_t len;
+
+  if (db_part == NULL || dir == NULL) return;
+  len = strlen(dir);
+  while (len > 0 && is_dir_sep(dir[len - 1])) len--;
+  part = find_part(get_dir_hash(dir, len));
+  if (part == NO_PART || db_part[part].count == 0) return;
+  if (page_mask == 0) page_mask = (uintptr_t)sysconf(_SC_PAGESIZE) - 1;
+  first = &db_rec[db_part[part].first];
+  last = first + db_part[part].count - 1;
+  start = (uintptr_t)first & ~page_mask;
+  madvise((void *)start, (size_t)((uintptr_t)(last + 1) - start), MADV_WILLNEED);
+  /* Paths are in the heap in record order */
+  if (last->path_off + last->path_len >= db_heap_size || first->path_off > last->path_off) return;
+  start = (uintptr_t)(db_heap + first->path_off) & ~page_mask;
+  end = (uintptr_t)(db_heap + last->path_off + last->path_len + 1);
+  madvise((void *)start, (size_t)(end - start), MADV_WILLNEED);
+#else
+  (void)dir;
+#endif
+  return;
+}
+
+
+/* Remember which base file was loaded to notice another process's compaction */
+static void note_base(const char * const restrict dbname)
+{
+#ifdef ENABLE_HASHDB_LOCK
+  base_st_valid = (stat(dbname, &base_st) == 0);
+#else
+  (void)dbname;
+#endif
+  return;
+}
+
+
+/* Pick up changes other processes saved since this one loaded the database.
+ * If the base was replaced, it already holds everything journaled before,
+ * including this process's changes, so the table is rebuilt from it */
+static int merge_changes(const char * const restrict dbname)
+{
+#ifdef ENABLE_HASHDB_LOCK
+  struct stat st;
+  int replaced;
+
+  if (lock_fd < 0) return 0;
+  if (stat(dbname, &st) == 0) replaced = !base_st_valid || st.st_dev != base_st.st_dev
+      || st.st_ino != base_st.st_ino || st.st_mtime != base_st.st_mtime || st.st_size != base_st.st_size;
+  else replaced = base_st_valid;
+  if (replaced != 0) {
+    LOUD(fprintf(stderr, "merge_changes: '%s' was replaced, reloading\n", dbname);)
+    /* Changes that never went to the journal must not be thrown away */
+    if (journal_failed == 0 && hashdb_dirty == 0) free_entries();
+    unmap_database();
+    if (load_database_file(dbname, LOAD_QUIET, 0) < 0) return -1;
+    journal_offset = 0;
+  }
+  if (load_database_file(journal_name, LOAD_JOURNAL | LOAD_QUIET, journal_offset) < 0) return -1;
+#else
+  (void)dbname;
+#endif /* ENABLE_HASHDB_LOCK */
+  return 0;
+}
+
+
+#ifndef ON_WINDOWS
+/* A rename only survives a crash once the directory holding it is synced */
+static int sync_parent_dir(const char * const restrict path)
+{
+  char dir[PATH_MAX + 1];
+  const char *slash = strrchr(path, '/');
+  size_t len;
+  int fd, retval;
+
+  if (slash == NULL) strcpy(dir, ".");
+  else if (slash == path) strcpy(dir, "/");
+  else {
+    len = (size_t)(slash - path);
+    if (len > PATH_MAX) return -1;
+    memcpy(dir, path, len);
+    dir[len] = '\0';
+  }
+  fd = open(dir, O_RDONLY);
+  if (fd < 0) return -1;
+  retval = fsync(fd);
+  close(fd);
+  return retval;
+}
+#endif
+
+
+/* Write a new binary database from the mapped records and the table,
+ * then drop the journal since everything in it is now in the database */
+int compact_hash_database(const char * const restrict dbname)
+{
+  FILE *db = NULL;
+  uint64_t cnt = 0, heap = 0, ino_cnt = 0, ino_alloc = 0;
+  struct hdb_header hdr;
+  struct hdb_record rec;
+  struct hdb_merge m;
+  struct ino_key *keys = NULL;
+  struct hdb_part *parts = NULL;
+  uint64_t part_cnt = 0, part_alloc = 0;
+  hashdb_t entry;
+  struct timeval tm;
+  char *tmpname = NULL;
+
+  if (dbname == NULL) goto error_hashdb_null;
+  LOUD(fprintf(stderr, "compact_hash_database('%s')\n", dbname);)
+  journal_flush();
+  if (journal != NULL) {
+    fclose(journal);
+    journal = NULL;
+  }
+  hashdb_lock(F_WRLCK);
+  if (merge_changes(dbname) != 0) goto error_hashdb_merge;
+  /* Write a new file and move it into place so the old one stays
+   * intact (and mapped) until the new one is complete */
+  tmpname = (char *)malloc(strlen(dbname) + 5);
+  if (tmpname == NULL) jc_oom("compact_hash_database()");
+  strcpy(tmpname, dbname);
+  strcat(tmpname, ".tmp");
+  errno = 0;
+  db = jc_fopen(tmpname, JC_FILE_MODE_RW_SEQ);
+  if (db == NULL) goto error_hashdb_open;
+  memset(&hdr, 0, sizeof(hdr));
+  if (fwrite(&hdr, sizeof(hdr), 1, db) != 1) goto error_hashdb_write;
+
+  /* Records first; paths are placed in the heap in the same order */
+  merge_start(&m);
+  while (merge_next(&m, &entry)) {
+    const size_t len = strlen(entry.path);
+
+    memset(&rec, 0, sizeof(rec));
+    rec.path_hash = entry.path_hash;
+    rec.partialhash = entry.partialhash;
+    rec.fullhash = entry.hashcount == 2 ? entry.fullhash : 0;
+    rec.inode = (uint64_t)entry.inode;
+    rec.device = (uint64_t)entry.device;
+    rec.size = (int64_t)entry.size;
+    rec.mtime = (int64_t)entry.mtime;
+    rec.path_off = heap;
+    rec.path_len = (uint32_t)len;
+    rec.partialsize = entry.partialsize;
+    rec.hashcount = entry.hashcount;
+    heap += len + 1;
+    if (fwrite(&rec, sizeof(rec), 1, db) != 1) goto error_hashdb_write_merge;
+    if (rec.inode != 0 && rec.device != 0) {
+      if (ino_cnt == ino_alloc) {
+        ino_alloc = ino_alloc ? ino_alloc * 2 : 4096;
+        keys = (struct ino_key *)realloc(keys, sizeof(struct ino_key) * ino_alloc);
+        if (keys == NULL) jc_oom("compact_hash_database()");
+      }
+      keys[ino_cnt].device = rec.device;
+      keys[ino_cnt].inode = rec.inode;
+      keys[ino_cnt].rec = cnt;
+      ino_cnt++;
+    }
+    /* Entries come grouped by directory hash; each group is a partition */
+    if (part_cnt == 0 || parts[part_cnt - 1].dir_hash != m.dir) {
+      if (part_cnt == part_alloc) {
+        part_alloc = part_alloc ? part_alloc * 2 : 1024;
+        parts = (struct hdb_part *)realloc(parts, sizeof(struct hdb_part) * part_alloc);
+        if (parts == NULL) jc_oom("compact_hash_database()");
+      }
+      parts[part_cnt].dir_hash = m.dir;
+      parts[part_cnt].first = cnt;
+      parts[part_cnt].count = 0;
+      part_cnt++;
+    }
+    parts[part_cnt - 1].count++;
+    cnt++;
+  }
+  m.ri = 0; m.oi = 0;
+  while (merge_next(&m, &entry))
+    if (fwrite(entry.path, strlen(entry.path) + 1, 1, db) != 1) goto error_hashdb_write_merge;
+  merge_end(&m);
+
+  /* Record numbers sorted by device and inode, aligned after the heap */
+  hdr.heap_offset = sizeof(struct hdb_header) + cnt * sizeof(struct hdb_record);
+  hdr.ino_offset = EXTEND64((hdr.heap_offset + heap));
+  if (hdr.ino_offset != hdr.heap_offset + heap) {
+    const uint64_t pad = 0;
+    if (fwrite(&pad, (size_t)(hdr.ino_offset - hdr.heap_offset - heap), 1, db) != 1) goto error_hashdb_write_keys;
+  }
+  if (ino_cnt > 1) qsort(keys, ino_cnt, sizeof(struct ino_key), sort_by_ino);
+  for (uint64_t i = 0; i < ino_cnt; i++)
+    if (fwrite(&keys[i].rec, sizeof(uint64_t), 1, db) != 1) goto error_hashdb_write_keys;
+  free(keys);
+  keys = NULL;
+
+  /* Directory partitions, already in hash order */
+  hdr.part_offset = hdr.ino_offset + ino_cnt * sizeof(uint64_t);
+  if (part_cnt > 0 && fwrite(parts, sizeof(struct hdb_part), (size_t)part_cnt, db) != (size_t)part_cnt)
+    goto error_hashdb_write_keys;
+  free(parts);
+  parts = NULL;
+
+  gettimeofday(&tm, NULL);
+  memcpy(hdr.magic, HASHDB_MAGIC, sizeof(hdr.magic));
+  hdr.version = HASHDB_BIN_VER;
+  hdr.endian = HASHDB_ENDIAN;
+  hdr.hash_algo = (uint32_t)hash_algo;
+  hdr.record_size = sizeof(struct hdb_record);
+  hdr.count = cnt;
+  hdr.heap_size = heap;
+  hdr.save_time = (uint64_t)tm.tv_sec;
+  hdr.ino_count = ino_cnt;
+  hdr.part_count = part_cnt;
+  if (fseek(db, 0, SEEK_SET) != 0 || fwrite(&hdr, sizeof(hdr), 1, db) != 1) goto error_hashdb_write;
+  errno = 0;
+  if (fflush(db) != 0) goto error_hashdb_write;
+#ifndef ON_WINDOWS
+  /* The new data must be on disk before the rename can expose it */
+  if (fsync(fileno(db)) != 0) goto error_hashdb_write;
+#endif
+  if (fclose(db) != 0) {
+    db = NULL;
+    goto error_hashdb_write;
+  }
+#ifdef ON_WINDOWS
+  jc_remove(dbname);
+#endif
+  if (jc_rename(tmpname, dbname) != 0) goto error_hashdb_rename;
+  free(tmpname);
+  LOUD(fprintf(stderr, "Wrote %" PRIu64 " items to hash databse '%s'\n", cnt, dbname);)
+  hashdb_dirty = 0;
+
+  /* A journal left behind by a crash here only repeats what was written,
+   * but it must not go away before the rename is durable */
+  if (journal_name != NULL) {
+#ifndef ON_WINDOWS
+    if (sync_parent_dir(dbname) != 0)
+      fprintf(stderr, "warning: cannot sync directory of hashdb '%s', keeping journal: %s\n", dbname, strerror(errno));
+    else
+#endif
+    jc_remove(journal_name);
+  }
+  note_base(dbname);
+  hashdb_lock(F_UNLCK);
+  journal_count = 0;
+  journal_offset = 0;
+  base_binary = 1;
+  return cnt;
+
+error_hashdb_null:
+  fprintf(stderr, "error: internal failure: NULL pointer for hashdb\n");
+  return -1;
+error_hashdb_merge:
+  hashdb_lock(F_UNLCK);
+  fprintf(stderr, "error: cannot merge changes from other runs into hashdb '%s'\n", dbname);
+  return -4;
+error_hashdb_open:
+  hashdb_lock(F_UNLCK);
+  fprintf(stderr, "error: cannot open hashdb '%s' for writing: %s\n", tmpname, strerror(errno));
+  free(tmpname);
+  return -2;
+error_hashdb_write_merge:
+  merge_end(&m);
+error_hashdb_write_keys:
+  free(keys);
+  free(parts);
+error_hashdb_write:
+  fprintf(stderr, "error: writing failed to hashdb '%s': %s\n", tmpname, strerror(errno));
+  if (db != NULL) fclose(db);
+  jc_remove(tmpname);
+  hashdb_lock(F_UNLCK);
+  free(tmpname);
+  return -3;
+error_hashdb_rename:
+  hashdb_lock(F_UNLCK);
+  fprintf(stderr, "error: cannot replace hashdb '%s': %s\n", dbname, strerror(errno));
+  jc_remove(tmpname);
+  free(tmpname);
+  return -3;
+}
+
+
+/* Flush and close the journal, compacting the database if it is due
+ * destroy = 1 will free() everything after saving */
+int save_hash_database(const char * const restrict dbname, const int destroy)
+{
+  int retval;
+
+  if (dbname == NULL) goto error_hashdb_null;
+  LOUD(fprintf(stderr, "save_hash_database('%s') dirty = %d, journal %" PRIu64 "\n", dbname, hashdb_dirty, journal_count);)
+  journal_flush();
+  if (journal != NULL) {
+    fclose(journal);
+    journal = NULL;
+  }
+  retval = (int)journal_added;
+  if (hashdb_dirty != 0 || (journal_count > 0
+        && (base_binary == 0 || journal_count > (db_count >> 3) + JOURNAL_COMPACT_MIN)))
+    retval = compact_hash_database(dbname);
+  journal_added = 0;
+
+  if (destroy == 1) {
+    free_entries();
+    unmap_database();
+    free(journal_name);
+    journal_name = NULL;
+    free(journal_buf);
+    journal_buf = NULL;
+#ifdef ENABLE_HASHDB_LOCK
+    if (lock_fd >= 0) close(lock_fd);
+    lock_fd = -1;
+    free(lock_name);
+    lock_name = NULL;
+#endif
+  }
+  return retval;
+
+error_hashdb_null:
+  fprintf(stderr, "error: internal failure: NULL pointer for hashdb\n");
+  return -1;
+}
+
+
+/* Print one entry in the text database format */
+static int write_text_entry(FILE *db, const hashdb_t * const restrict cur)
+{
+  errno = 0;
+  fprintf(db, "%u,%016" PRIx64 ",%016" PRIx64 ",%016" PRIx64 ",%016" PRIx64 ",%016" PRIx64 ",%08" PRIx32 ",%s\n",
+      cur->hashcount, cur->partialhash, cur->fullhash, (uint64_t)cur->mtime, (uint64_t)cur->size, (uint64_t)cur->inode, cur->partialsize, cur->path);
+  return errno != 0;
+}
+
+
+/* Print the whole database in the text format, which can be loaded back */
+uint64_t dump_hashdb(void)
+{
+  struct hdb_merge m;
+  hashdb_t entry;
+  struct timeval tm;
+  uint64_t cnt = 0;
 
-static int write_hashdb_entry(FILE *db, hashdb_t *cur, uint64_t *cnt, const int destroy);
-static int get_path_hash(char *path, uint64_t *path_hash);
+  fprintf(stderr, "Dumping hash database\n");
+  gettimeofday(&tm, NULL);
+  printf("jdupes hashdb:%d,%d,%08lx\n", HASHDB_VER, hash_algo, (unsigned long)tm.tv_sec);
+  merge_start(&m);
+  while (merge_next(&m, &entry)) {
+    if (write_text_entry(stdout, &entry) != 0) break;
+    cnt++;
+  }
+  merge_end(&m);
+  return cnt;
+}
 
 
-#if 0
-/* Hex dump 16 bytes of memory */
-void hd16(char *a) {
-  int i;
+/* Bring an existing entry up to date with a scanned file */
+static hashdb_t *update_entry(hashdb_t * const restrict cur, const file_t * const restrict check)
+{
+  int exclude;
 
-  printf("DUMP Hex: ");
-  for (i = 0; i < 16; i++) printf("%x", a[i]);
-  printf("\nDUMP ASCII: ");
-  for (i = 0; i < 16; i++) printf("%c", a[i]);
-  printf("\n");
-  return;
+  /* Should we invalidate this entry? */
+  exclude = 0;
+  if (cur->mtime != check->mtime) exclude |= 1;
+  if (cur->inode != 0 && cur->inode != check->inode) exclude |= 2;
+  if (cur->size  != check->size)  exclude |= 4;
+  if (exclude == 0 && cur->partialsize != (uint32_t)partial_window(check->size)) {
+    /* Unchanged file hashed with a different partial window; refresh */
+    if (!ISFLAG(check->flags, FF_HASH_PARTIAL)) return cur;
+    cur->partialsize = (uint32_t)partial_window(check->size);
+    cur->partialhash = check->filehash_partial;
+    cur->fullhash = check->filehash;
+    cur->hashcount = ISFLAG(check->flags, FF_HASH_FULL) ? 2 : 1;
+    entry_changed(cur);
+    return cur;
+  }
+  if (exclude == 0 && cur->hashcount != 0) {
+    if (cur->hashcount == 1 && ISFLAG(check->flags, FF_HASH_FULL)) {
+      cur->hashcount = 2;
+      cur->fullhash = check->filehash;
+      entry_changed(cur);
+    }
+    return cur;
+  }
+  if (!ISFLAG(check->flags, FF_HASH_PARTIAL)) {
+    /* Something changed; invalidate this entry */
+    cur->hashcount = 0;
+    entry_changed(cur);
+    return NULL;
+  }
+  /* Replace a changed or invalidated entry with the new hashes */
+  cur->size = check->size;
+  cur->inode = check->inode;
+  cur->device = check->device;
+  cur->mtime = check->mtime;
+  cur->partialhash = check->filehash_partial;
+  cur->partialsize = (uint32_t)partial_window(check->size);
+  cur->fullhash = check->filehash;
+  cur->hashcount = ISFLAG(check->flags, FF_HASH_FULL) ? 2 : 1;
+  entry_changed(cur);
+  return cur;
 }
-#endif
 
 
-static hashdb_t *alloc_hashdb_node(const int pathlen)
+/* in_path allows use of a precomputed path length to avoid extra strlen() calls
+ * Without a check entry the existing entry for the path (or a blank new one)
+ * is returned for the caller to fill in */
+hashdb_t *add_hashdb_entry(char *in_path, int pathlen, const file_t *check)
 {
-  int allocsize;
+  hashdb_t *file;
+  const struct hdb_record *rec;
+  uint64_t path_hash;
+  char *path;
+
+  if (unlikely((in_path == NULL && check == NULL) || (check != NULL && check->d_name == NULL))) return NULL;
 
-  allocsize = sizeof(hashdb_t) + pathlen + 1;
-  return (hashdb_t *)calloc(1, EXTEND64(allocsize));
+  /* Get path hash and length from supplied path */
+  if (in_path == NULL) path = check->d_name;
+  else path = in_path;
+  if (pathlen == 0) pathlen = strlen(path);
+  if (get_path_hash(path, &path_hash) != 0) return NULL;
+
+  file = find_overlay(path, path_hash);
+  if (check == NULL) {
+    if (file == NULL) file = new_entry(path, pathlen, path_hash);
+    return file;
+  }
+  if (file != NULL) return update_entry(file, check);
+
+  /* A file that is only in the mapped database gets a table entry copied
+   * from its record, which is then updated like any other entry */
+  if (db_count > 0 && (rec = find_record(path, path_hash)) != NULL) {
+    file = new_entry(path, pathlen, path_hash);
+    path = file->path;
+    record_to_entry(rec, file);
+    file->path = path;
+    return update_entry(file, check);
+  }
+
+  /* Nothing to record until the file has been hashed */
+  if (!ISFLAG(check->flags, FF_HASH_PARTIAL)) return NULL;
+  file = new_entry(path, pathlen, path_hash);
+  file->size = check->size;
+  file->inode = check->inode;
+  file->device = check->device;
+  file->mtime = check->mtime;
+  file->partialhash = check->filehash_partial;
+  file->partialsize = (uint32_t)partial_window(check->size);
+  file->fullhash = check->filehash;
+  if (ISFLAG(check->flags, FF_HASH_FULL)) file->hashcount = 2;
+  else file->hashcount = 1;
+  entry_changed(file);
+  return file;
 }
 
 
-/* destroy = 1 will free() all nodes while saving */
-int save_hash_database(const char * const restrict dbname, const int destroy)
+/* Map a binary database (header already read) for in-place searching */
+static int64_t map_database(FILE *db, const char * const restrict dbname, const struct hdb_header * const restrict hdr)
 {
-  FILE *db = NULL;
-  uint64_t cnt = 0;
+  uint64_t len, hdr_size = sizeof(struct hdb_header), ino_offset = 0, ino_count = 0;
+  uint64_t part_offset = 0, part_count = 0;
+#if !defined ON_WINDOWS && !defined NO_MMAP
+  struct stat st;
+#endif
 
-  if (dbname == NULL) goto error_hashdb_null;
-  LOUD(fprintf(stderr, "save_hash_database('%s') dirty = %d\n", dbname, hashdb_dirty);)
-  /* Don't save the hash database if it wasn't changed */
-  if (hashdb_dirty == 0 && destroy == 0) return 0;
-  if (hashdb_dirty == 1) {
-    errno = 0;
-    db = jc_fopen(dbname, JC_FILE_MODE_RW_SEQ);
-    if (db == NULL) goto error_hashdb_open;
-    if (write_hashdb_entry(db, NULL, &cnt, destroy) != 0) goto error_hashdb_write;
+  if (hdr->endian != HASHDB_ENDIAN || hdr->record_size != sizeof(struct hdb_record)) goto error_hashdb_format;
+  if (hdr->version < HASHDB_BIN_MIN_VER || hdr->version > HASHDB_BIN_VER) goto error_hashdb_version;
+  if (hdr->hash_algo != (uint32_t)hash_algo) goto warn_hashdb_algo;
+  hashdb_algo = (int)hdr->hash_algo;
+  /* v4 has no inode index and v5 no partitions */
+  if (hdr->version == 4) hdr_size = HDB_HEADER_V4_SIZE;
+  else {
+    if (hdr->version == 5) hdr_size = HDB_HEADER_V5_SIZE;
+    ino_offset = hdr->ino_offset;
+    ino_count = hdr->ino_count;
+  }
+  if (hdr->version >= 6) {
+    part_offset = hdr->part_offset;
+    part_count = hdr->part_count;
+  }
+  if (hdr->count > (UINT64_MAX - hdr_size) / sizeof(struct hdb_record)) goto error_hashdb_format;
+  if (hdr->heap_offset != hdr_size + hdr->count * sizeof(struct hdb_record)) goto error_hashdb_format;
+  len = hdr->heap_offset + hdr->heap_size;
+  if (len < hdr->heap_offset || len > SIZE_MAX) goto error_hashdb_format;
+  if (ino_count != 0) {
+    if (ino_count > hdr->count || ino_offset < len || (ino_offset & 7) != 0) goto error_hashdb_format;
+    len = ino_offset + ino_count * sizeof(uint64_t);
+    if (len > SIZE_MAX) goto error_hashdb_format;
+  }
+  if (part_count != 0) {
+    if (part_count > hdr->count || part_offset < len || (part_offset & 7) != 0) goto error_hashdb_format;
+    len = part_offset + part_count * sizeof(struct hdb_part);
+    if (len > SIZE_MAX) goto error_hashdb_format;
+  }
+  if (hdr->count == 0) {
     fclose(db);
-    LOUD(if (hashdb_dirty == 1) fprintf(stderr, "Wrote %" PRIu64 " items to hash databse '%s'\n", cnt, dbname);)
-    hashdb_dirty = 0;
+    return 0;
   }
 
-  return cnt;
+#if !defined ON_WINDOWS && !defined NO_MMAP
+  if (fstat(fileno(db), &st) != 0) goto error_hashdb_read;
+  if ((uint64_t)st.st_size < len) goto error_hashdb_format;
+  db_map = mmap(NULL, (size_t)len, PROT_READ, MAP_SHARED, fileno(db), 0);
+  if (db_map == MAP_FAILED) {
+    db_map = NULL;
+    goto error_hashdb_read;
+  }
+ #ifdef MADV_RANDOM
+  madvise(db_map, (size_t)len, MADV_RANDOM);
+ #endif
+#else
+  db_map = malloc((size_t)len);
+  if (db_map == NULL) jc_oom("map_database()");
+  errno = 0;
+  if (fseek(db, 0, SEEK_SET) != 0 || fread(db_map, (size_t)len, 1, db) != 1) {
+    free(db_map);
+    db_map = NULL;
+    if (errno == 0) goto error_hashdb_format;
+    goto error_hashdb_read;
+  }
+#endif
+  fclose(db);
+  db_maplen = (size_t)len;
+  db_rec = (const struct hdb_record *)((uintptr_t)db_map + (uintptr_t)hdr_size);
+  db_heap = (const char *)((uintptr_t)db_map + (uintptr_t)hdr->heap_offset);
+  db_heap_size = hdr->heap_size;
+  db_count = hdr->count;
+  if (ino_count != 0) {
+    db_ino = (const uint64_t *)((uintptr_t)db_map + (uintptr_t)ino_offset);
+    db_ino_count = ino_count;
+  }
+  if (part_count != 0) {
+    db_part = (const struct hdb_part *)((uintptr_t)db_map + (uintptr_t)part_offset);
+    db_part_count = part_count;
+  } else hashdb_dirty = 1;  /* Rewrite an older file with partitions */
+  part_cache_valid = 0;
+  return (int64_t)db_count;
 
-error_hashdb_null:
-  fprintf(stderr, "error: internal failure: NULL pointer for hashdb\n");
+error_hashdb_read:
+  fprintf(stderr, "error reading hash database '%s': %s\n", dbname, strerror(errno));
+  fclose(db);
   return -1;
-error_hashdb_open:
-  fprintf(stderr, "error: cannot open hashdb '%s' for writing: %s\n", dbname, strerror(errno));
+error_hashdb_format:
+  fprintf(stderr, "error: hash database '%s' is damaged or was written by an incompatible system\n", dbname);
+  fclose(db);
   return -2;
-error_hashdb_write:
-  fprintf(stderr, "error: writing failed to hashdb '%s': %s\n", dbname, strerror(errno));
+error_hashdb_version:
+  fprintf(stderr, "error: bad db version %u in hash database '%s'\n", hdr->version, dbname);
   fclose(db);
   return -3;
+warn_hashdb_algo:
+  fprintf(stderr, "warning: hashdb uses a different hash algorithm than selected; not loading\n");
+  fclose(db);
+  return -7;
 }
 
 
-static int write_hashdb_entry(FILE *db, hashdb_t *cur, uint64_t *cnt, const int destroy)
+/* Entries taken by merge_entry() */
+static uint64_t merge_taken = 0;
+
+/* The other database's journal is read before its base file: base records
+ * that the journal replaced, invalidated or forgot must not be merged.
+ * Lines are kept in order (seq) and sorted by path once all are read */
+struct merge_src {
+  char *path;
+  size_t len;
+  uint64_t seq;
+  hashdb_t entry;
+};
+static struct merge_src *msrc = NULL, *mdead = NULL;
+static uint64_t msrc_count = 0, msrc_alloc = 0;
+static uint64_t mdead_count = 0, mdead_alloc = 0;
+static uint64_t msrc_seq = 0;
+
+
+/* Keep a line of the other database's journal until its base is merged */
+static void stage_merge_line(const hashdb_t * const restrict src, const size_t len)
 {
-  struct timeval tm;
-  int err = 0;
-  static char out[PATH_MAX + 128];
-
-  LOUD(fprintf(stderr, "write_hashdb_entry(%p, %p, %p, %d)", db, cur, cnt, destroy);)
-  /* Write header and traverse array on first call */
-  if (unlikely(cur == NULL)) {
-    gettimeofday(&tm, NULL);
-    snprintf(out, PATH_MAX + 127, "jdupes hashdb:%d,%d,%08lx\n", HASHDB_VER, hash_algo, (unsigned long)tm.tv_sec);
-    LOUD(fprintf(stderr, "write hashdb: %s", out);)
-    errno = 0;
-    if (db == NULL) printf("%s", out); else fputs(out, db);
-    if (errno != 0) return 1;
-    /* Write out each hash bucket, skipping empty buckets */
-    for (int i = 0; i < HT_SIZE; i++) {
-      if (hashdb[i] == NULL) continue;
-      err = write_hashdb_entry(db, hashdb[i], cnt, destroy);
-      if (err != 0) return err;
-    }
-    if (destroy == 1) {
-      memset(hashdb, 0, sizeof(hashdb_t *) * HT_SIZE);
-      hashdb_init = 0;
-    }
-    return 0;
-  }
+  struct merge_src *s;
 
-  /* Write out this node if it wasn't invalidated */
-  if (cur->hashcount != 0) {
-    snprintf(out, PATH_MAX + 127, "%u,%016" PRIx64 ",%016" PRIx64 ",%016" PRIx64 ",%016" PRIx64 ",%016" PRIx64 ",%s\n",
-      cur->hashcount, cur->partialhash, cur->fullhash, (uint64_t)cur->mtime, (uint64_t)cur->size, (uint64_t)cur->inode, cur->path);
-    (*cnt)++;
-    LOUD(fprintf(stderr, "write hashdb: %s", out);)
-    errno = 0;
-    if (db == NULL) printf("%s", out); else fputs(out, db);
-    if (errno != 0) return 1;
+  if (src->hashcount == HASHDB_SUBTREE) {
+    if (mdead_count == mdead_alloc) {
+      mdead_alloc = mdead_alloc ? mdead_alloc * 2 : 16;
+      mdead = (struct merge_src *)realloc(mdead, sizeof(struct merge_src) * mdead_alloc);
+      if (mdead == NULL) jc_oom("stage_merge_line()");
+    }
+    s = &mdead[mdead_count++];
+  } else {
+    if (msrc_count == msrc_alloc) {
+      msrc_alloc = msrc_alloc ? msrc_alloc * 2 : 256;
+      msrc = (struct merge_src *)realloc(msrc, sizeof(struct merge_src) * msrc_alloc);
+      if (msrc == NULL) jc_oom("stage_merge_line()");
+    }
+    s = &msrc[msrc_count++];
   }
-
-  /* Traverse the tree, propagating errors */
-  if (err == 0 && cur->left != NULL) err = write_hashdb_entry(db, cur->left, cnt, destroy);
-  if (err == 0 && cur->right != NULL) err = write_hashdb_entry(db, cur->right, cnt, destroy);
-  if (destroy == 1) free(cur);
-  return err;
+  s->path = (char *)malloc(len + 1);
+  if (s->path == NULL) jc_oom("stage_merge_line()");
+  memcpy(s->path, src->path, len);
+  s->path[len] = '\0';
+  s->len = len;
+  s->seq = ++msrc_seq;
+  s->entry = *src;
+  s->entry.path = s->path;
+  return;
 }
 
 
-uint64_t dump_hashdb(void)
+/* Staged lines sort by path, then in journal order */
+static int merge_src_cmp(const void *a, const void *b)
 {
-  uint64_t cnt = 0;
+  const struct merge_src * const s1 = (const struct merge_src *)a;
+  const struct merge_src * const s2 = (const struct merge_src *)b;
+  const int c = memcmp(s1->path, s2->path, s1->len < s2->len ? s1->len : s2->len);
 
-  fprintf(stderr, "Dumping hash database\n");
-  write_hashdb_entry(NULL, NULL, &cnt, 0);
-  return cnt;
+  if (c != 0) return c;
+  if (s1->len != s2->len) return s1->len < s2->len ? -1 : 1;
+  if (s1->seq != s2->seq) return s1->seq < s2->seq ? -1 : 1;
+  return 0;
 }
 
 
-static void pivot_hashdb_tree(hashdb_t **parent, hashdb_t *cur, enum pivot direction)
+/* Last staged line for a path (of len bytes), or NULL */
+static const struct merge_src *find_merge_src(const struct merge_src * const restrict list,
+		const uint64_t count, const char * const restrict path, const size_t len)
 {
-  hashdb_t *temp;
-
-  if (direction == PIVOT_LEFT) {
-    temp = cur->right;
-    cur->right = cur->right->left;
-    temp->left = cur;
-    *parent = temp;
-  } else {  // PIVOT_RIGHT
-    temp = cur->left;
-    cur->left = cur->left->right;
-    temp->right = cur;
-    *parent = temp;
+  struct merge_src key;
+  uint64_t lo = 0, hi = count;
+
+  key.path = (char *)(uintptr_t)path;
+  key.len = len;
+  key.seq = UINT64_MAX;
+  while (lo < hi) {
+    const uint64_t mid = lo + ((hi - lo) >> 1);
+    if (merge_src_cmp(&list[mid], &key) <= 0) lo = mid + 1;
+    else hi = mid;
   }
+  if (lo == 0 || list[lo - 1].len != len || memcmp(list[lo - 1].path, path, len) != 0) return NULL;
+  return &list[lo - 1];
+}
 
-  return;
+
+/* Was a path forgotten by a line of the other journal after line seq?
+ * Each ancestor directory is looked up instead of scanning every marker */
+static int merge_src_dead(const char * const restrict path, const uint64_t seq)
+{
+  const struct merge_src *d;
+
+  if (mdead_count == 0) return 0;
+  for (size_t i = 0; ; i++) {
+    if (path[i] != '\0' && !is_dir_sep(path[i])) continue;
+    d = find_merge_src(mdead, mdead_count, path, i);
+    if (d != NULL && d->seq > seq) return 1;
+    if (path[i] == '\0') return 0;
+  }
 }
 
 
-static void rebalance_hashdb_tree(hashdb_t **parent)
+/* Is a record of the other base file superseded by its journal? */
+static int merge_base_stale(const char * const restrict path)
 {
-  const uint64_t center = 0x8000000000000000ULL;
-  hashdb_t *cur = *parent;
+  if (msrc_count != 0 && find_merge_src(msrc, msrc_count, path, strlen(path)) != NULL) return 1;
+  return merge_src_dead(path, 0);
+}
 
-  if (unlikely(cur == NULL || parent == NULL)) return;
-  if (cur->left == NULL && cur->right == NULL) return;
 
-  if (cur->left != NULL) rebalance_hashdb_tree(&(cur->left));
-  if (cur->right != NULL) rebalance_hashdb_tree(&(cur->right));
-  if (cur->path_hash > center) {
-    /* This node might be better off to the right */
-    if (cur->left != NULL && cur->left->path_hash > center) pivot_hashdb_tree(parent, cur, PIVOT_RIGHT);
-  } else if (cur->path_hash < center) {
-    /* This node might be better off to the left */
-    if (cur->right != NULL && cur->right->path_hash < center) pivot_hashdb_tree(parent, cur, PIVOT_LEFT);
-  }
+static void free_merge_src(void)
+{
+  for (uint64_t i = 0; i < msrc_count; i++) free(msrc[i].path);
+  for (uint64_t i = 0; i < mdead_count; i++) free(mdead[i].path);
+  free(msrc);
+  free(mdead);
+  msrc = mdead = NULL;
+  msrc_count = msrc_alloc = mdead_count = mdead_alloc = msrc_seq = 0;
   return;
 }
 
-
-/* in_path allows use of a precomputed path length to avoid extra strlen() calls */
-hashdb_t *add_hashdb_entry(char *in_path, int pathlen, const file_t *check)
+/* Add an entry from another database unless the existing one is newer
+ * (by file mtime, then by having more hashes). Device and inode numbers are
+ * dropped: they belong to the other database's host or paths, and kept they
+ * would fail every lookup here and could match unrelated local files as
+ * moved. The entry is trusted by size and mtime until its file is scanned */
+static int merge_entry(const hashdb_t * const restrict src)
 {
-  unsigned int bucket;
-  hashdb_t *file;
-  hashdb_t *cur;
+  hashdb_t *cur, view;
+  const struct hdb_record *rec;
   uint64_t path_hash;
-  int exclude;
-  int difference;
   char *path;
 
-  /* Allocate hashdb on first use */
-  if (unlikely(hashdb_init == 0)) {
-    memset(hashdb, 0, sizeof(hashdb_t *) * HT_SIZE);
-    hashdb_init = 1;
+  if (get_path_hash(src->path, &path_hash) != 0) return -1;
+  cur = find_overlay(src->path, path_hash);
+  if (cur == NULL && (rec = find_record(src->path, path_hash)) != NULL) {
+    record_to_entry(rec, &view);
+    cur = &view;
   }
-
-  if (unlikely((in_path == NULL && check == NULL) || (check != NULL && check->d_name == NULL))) return NULL;
-
-  /* Get path hash and length from supplied path; use hash to choose the bucket */
-  if (in_path == NULL) path = check->d_name;
-  else path = in_path;
-  if (pathlen == 0) pathlen = strlen(path);
-  if (get_path_hash(path, &path_hash) != 0) return NULL;
-  bucket = path_hash & HT_MASK;
+  if (cur != NULL && cur->hashcount != 0 && (cur->mtime > src->mtime
+        || (cur->mtime == src->mtime && cur->hashcount >= src->hashcount))) return 0;
+  cur = add_hashdb_entry(src->path, 0, NULL);
+  if (cur == NULL) return -1;
+  path = cur->path;
+  *cur = *src;
+  cur->path = path;
+  cur->path_hash = path_hash;
+  cur->inode = 0;
+  cur->device = 0;
+  /* Merges can be huge; they are written out by compaction, not journaled */
+  hashdb_dirty = 1;
+  merge_taken++;
+  return 1;
+}
 
 
-  if (hashdb[bucket] == NULL) {
-    file = alloc_hashdb_node(pathlen);
-    if (file == NULL) return NULL;
-    file->path_hash = path_hash;
-    hashdb[bucket] = file;
-  } else {
-    cur = hashdb[bucket];
-    difference = 0;
-    while (1) {
-      /* If path is set then this entry may already exist and we need to check */
-      if (check != NULL && cur->path != NULL) {
-        if (cur->path_hash == path_hash && strcmp(cur->path, check->d_name) == 0) {
-          /* Should we invalidate this entry? */
-          exclude = 0;
-          if (cur->mtime != check->mtime) exclude |= 1;
-          if (cur->inode != check->inode) exclude |= 2;
-          if (cur->size  != check->size)  exclude |= 4;
-          if (exclude == 0) {
-            if (cur->hashcount == 1 && ISFLAG(check->flags, FF_HASH_FULL)) {
-              cur->hashcount = 2;
-              cur->fullhash = check->filehash;
-              hashdb_dirty = 1;
-            }
-            return cur;
-          } else {
-            /* Something changed; invalidate this entry */
-            cur->hashcount = 0;
-            hashdb_dirty = 1;
-            return NULL;
-          }
-        }
-      }
-      if (cur->path_hash >= path_hash) {
-        if (cur->left == NULL) {
-          file = alloc_hashdb_node(pathlen);
-          if (file == NULL) return NULL;
-          cur->left = file;
-          break;
-        } else {
-          cur = cur->left;
-          difference--;
-          continue;
-        }
-      } else {
-        if (cur->right == NULL) {
-          file = alloc_hashdb_node(pathlen);
-          if (file == NULL) return NULL;
-          cur->right = file;
-          break;
-        } else {
-          cur = cur->right;
-          difference++;
-          continue;
-        }
-      }
-    }
-    if (difference < 0) difference = -difference;
-    if (difference > 64) {
-      rebalance_hashdb_tree(&(hashdb[bucket]));
+/* Read the records of another binary database into the table (the file
+ * is read in pieces, not mapped, so the loaded database stays in place) */
+static int64_t merge_binary(FILE *db, const char * const restrict dbname, const struct hdb_header * const restrict hdr)
+{
+  struct hdb_record recs[256];
+  hashdb_t src;
+  char *heap = NULL;
+  uint64_t hdr_size = sizeof(struct hdb_header), done = 0;
+  int64_t merged = 0;
+
+  if (hdr->endian != HASHDB_ENDIAN || hdr->record_size != sizeof(struct hdb_record)) goto error_hashdb_format;
+  if (hdr->version < HASHDB_BIN_MIN_VER || hdr->version > HASHDB_BIN_VER) goto error_hashdb_format;
+  if (hdr->hash_algo != (uint32_t)hash_algo) goto warn_hashdb_algo;
+  if (hdr->version == 4) hdr_size = HDB_HEADER_V4_SIZE;
+  else if (hdr->version == 5) hdr_size = HDB_HEADER_V5_SIZE;
+  if (hdr->count > (UINT64_MAX - hdr_size) / sizeof(struct hdb_record)) goto error_hashdb_format;
+  if (hdr->heap_offset != hdr_size + hdr->count * sizeof(struct hdb_record) || hdr->heap_size > SIZE_MAX) goto error_hashdb_format;
+  if (hdr->count == 0) goto merge_done;
+
+  heap = (char *)malloc((size_t)hdr->heap_size);
+  if (heap == NULL) jc_oom("merge_binary()");
+  errno = 0;
+  if (fseeko(db, (off_t)hdr->heap_offset, SEEK_SET) != 0 || fread(heap, (size_t)hdr->heap_size, 1, db) != 1) goto error_hashdb_read;
+  if (fseeko(db, (off_t)hdr_size, SEEK_SET) != 0) goto error_hashdb_read;
+  while (done < hdr->count) {
+    const size_t n = hdr->count - done > 256 ? 256 : (size_t)(hdr->count - done);
+
+    if (fread(recs, sizeof(struct hdb_record), n, db) != n) goto error_hashdb_read;
+    for (size_t i = 0; i < n; i++) {
+      if (recs[i].hashcount != 1 && recs[i].hashcount != 2) continue;
+      if (recs[i].path_len > PATH_MAX || recs[i].path_off + recs[i].path_len >= hdr->heap_size
+          || heap[recs[i].path_off + recs[i].path_len] != '\0') goto error_hashdb_format;
+      if (merge_base_stale(heap + recs[i].path_off)) continue;
+      /* record_to_entry() works on the loaded database's heap */
+      memset(&src, 0, sizeof(src));
+      src.path = heap + recs[i].path_off;
+      src.partialhash = recs[i].partialhash;
+      src.fullhash = recs[i].fullhash;
+      src.inode = (jdupes_ino_t)recs[i].inode;
+      src.device = (dev_t)recs[i].device;
+      src.size = (off_t)recs[i].size;
+      src.mtime = (time_t)recs[i].mtime;
+      src.partialsize = recs[i].partialsize;
+      src.hashcount = (uint_fast8_t)recs[i].hashcount;
+      if (merge_entry(&src) < 0) goto error_hashdb_add;
+      merged++;
     }
+    done += n;
   }
 
-  /* If a check entry was given then populate it */
-  if (check != NULL && check->d_name != NULL && ISFLAG(check->flags, FF_HASH_PARTIAL)) {
-    hashdb_dirty = 1;
-    file->path_hash = path_hash;
-    file->path = (char *)((uintptr_t)file + (uintptr_t)sizeof(hashdb_t));
-    memcpy(file->path, check->d_name, pathlen + 1);
-    *(file->path + pathlen) = '\0';
-    file->size = check->size;
-    file->inode = check->inode;
-    file->mtime = check->mtime;
-    file->partialhash = check->filehash_partial;
-    file->fullhash = check->filehash;
-    if (ISFLAG(check->flags, FF_HASH_FULL)) file->hashcount = 2;
-    else file->hashcount = 1;
-  } else {
-    /* No check entry? Populate from passed parameters */
-    file->path = (char *)((uintptr_t)file + (uintptr_t)sizeof(hashdb_t));
-    file->path_hash = path_hash;
-  }
-  return file;
+merge_done:
+  free(heap);
+  fclose(db);
+  return merged;
+
+error_hashdb_read:
+  fprintf(stderr, "error reading hash database '%s': %s\n", dbname, strerror(errno));
+  free(heap);
+  fclose(db);
+  return -1;
+error_hashdb_format:
+  fprintf(stderr, "error: hash database '%s' is damaged or was written by an incompatible system\n", dbname);
+  free(heap);
+  fclose(db);
+  return -2;
+error_hashdb_add:
+  fprintf(stderr, "error: internal failure allocating a hashdb entry\n");
+  free(heap);
+  fclose(db);
+  return -5;
+warn_hashdb_algo:
+  fprintf(stderr, "warning: hashdb '%s' uses a different hash algorithm than selected; not merging\n", dbname);
+  fclose(db);
+  return -7;
 }
 
 
-/* db header format: jdupes hashdb:dbversion,hashtype,update_mtime
- * db line format: hashcount,partial,full,mtime,size,inode,path */
-int64_t load_hash_database(const char * const restrict dbname)
+/* Binary databases are mapped; text databases from older versions use
+ * the formats below and are imported into the table, then saved as binary
+ * db header format: jdupes hashdb:dbversion,hashtype,update_mtime
+ * db line format: hashcount,partial,full,mtime,size,inode,partialsize,path
+ * (partialsize is only present in v3+; older entries used 4096 bytes)
+ * The journal is a v4 text database: device is added before the path, and
+ * hashcount 0 marks an invalidated entry. Later lines replace earlier ones.
+ * A journal may be read from an offset to pick up only lines added since */
+static int64_t load_database_file(const char * const restrict dbname, const int mode, const int64_t offset)
 {
   FILE *db;
   char line[PATH_MAX + 128];
   char buf[PATH_MAX + 128];
   char *field, *temp;
+  struct hdb_header hdr;
   int db_ver;
   unsigned int fixed_len;
   int64_t linenum = 1;
+  int64_t pos = 0;
+  const int is_journal = mode & LOAD_JOURNAL;
 #ifdef LOUD_DEBUG
   time_t db_mtime;
   char date[32];
 #endif /* LOUD_DEBUG */
 
-  if (dbname == NULL) goto error_hashdb_null;
-  LOUD(fprintf(stderr, "load_hash_database('%s')\n", dbname);)
+  LOUD(fprintf(stderr, "load_database_file('%s', %d, %" PRId64 ")\n", dbname, mode, offset);)
   errno = 0;
   db = jc_fopen(dbname, JC_FILE_MODE_RDONLY_SEQ);
   if (db == NULL) goto warn_hashdb_open;
 
+  if (offset > 0) {
+    /* The header was checked when the journal was first read */
+    if (fseeko(db, (off_t)offset, SEEK_SET) != 0) goto error_hashdb_read;
+    db_ver = HASHDB_JOURNAL_VER;
+    fixed_len = 113;
+    pos = offset;
+    goto read_entries;
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  if (fread(&hdr, 1, sizeof(hdr), db) >= HDB_HEADER_V4_SIZE && memcmp(hdr.magic, HASHDB_MAGIC, sizeof(hdr.magic)) == 0) {
+    if (is_journal != 0) goto error_hashdb_header;
+    if (mode & LOAD_MERGE) return merge_binary(db, dbname, &hdr);
+    if (!(mode & LOAD_QUIET) && !ISFLAG(flags, F_HIDEPROGRESS)) fprintf(stderr, "Loading hash database...");
+    linenum = map_database(db, dbname, &hdr);
+    if (linenum >= 0) base_binary = 1;
+    return linenum;
+  }
+  errno = 0;
+  if (fseek(db, 0, SEEK_SET) != 0) goto error_hashdb_read;
+
   /* Read header line */
   if ((fgets(buf, PATH_MAX + 127, db) == NULL) || (ferror(db) != 0)) {
     if (errno == 0) goto warn_hashdb_open;  // empty file = make new DB
     goto error_hashdb_read;
-  } else if (!ISFLAG(flags, F_HIDEPROGRESS)) fprintf(stderr, "Loading hash database...");
+  } else if (mode == 0 && !ISFLAG(flags, F_HIDEPROGRESS)) fprintf(stderr, "Loading hash database...");
+  pos = (int64_t)strlen(buf);
   field = strtok(buf, ":");
   if (strcmp(field, "jdupes hashdb") != 0) goto error_hashdb_header;
   field = strtok(NULL, ":");
@@ -350,11 +1848,16 @@ int64_t load_hash_database(const char * const restrict dbname)
   if (db_ver < HASHDB_MIN_VER || db_ver > HASHDB_MAX_VER) goto error_hashdb_version;
   if (hashdb_algo != hash_algo) goto warn_hashdb_algo;
 
-  /* v1 has 8-byte sizes; v2 has 16-byte (4GiB+) sizes */
-  fixed_len = 87;
+  if ((is_journal != 0) != (db_ver == HASHDB_JOURNAL_VER)) goto error_hashdb_version;
+
+  /* v1 has 8-byte sizes; v2 has 16-byte (4GiB+) sizes; v3 adds partialsize */
+  fixed_len = 96;
+  if (db_ver == 4) fixed_len = 113;
+  if (db_ver == 2) fixed_len = 87;
   if (db_ver == 1) fixed_len = 71;
 
   /* Read database entries */
+read_entries:
   while (1) {
     int pathlen;
     unsigned int linelen;
@@ -365,6 +1868,8 @@ int64_t load_hash_database(const char * const restrict dbname)
     hashdb_t *entry;
     off_t size;
     jdupes_ino_t inode;
+    dev_t device = 0;
+    uint32_t partialsize = 4096;
 
     errno = 0;
     if ((fgets(line, PATH_MAX + 128, db) == NULL)) {
@@ -375,13 +1880,19 @@ int64_t load_hash_database(const char * const restrict dbname)
     strncpy(buf, line, PATH_MAX + 128);
     linenum++;
     linelen = (int64_t)strlen(buf);
+    /* The last journal line is incomplete if a run was killed mid-write */
+    if (is_journal != 0 && (linelen == 0 || buf[linelen - 1] != '\n') && feof(db)) {
+      linenum--;
+      break;
+    }
+    pos += linelen;
     if (linelen < fixed_len + 1) goto error_hashdb_line;
 
     /* Split each entry into fields and
      * hashcount: 1 = partial only, 2 = partial and full */
     field = strtok(buf, ","); if (field == NULL) goto error_hashdb_line;
     hashcount = (int)strtol(field, NULL, 16);
-    if (hashcount < 1 || hashcount > 2) goto error_hashdb_line;
+    if (hashcount < (is_journal != 0 ? 0 : 1) || hashcount > (is_journal != 0 ? HASHDB_SUBTREE : 2)) goto error_hashdb_line;
     field = strtok(NULL, ","); if (field == NULL) goto error_hashdb_line;
     partialhash = strtoull(field, NULL, 16);
     field = strtok(NULL, ","); if (field == NULL) goto error_hashdb_line;
@@ -390,32 +1901,70 @@ int64_t load_hash_database(const char * const restrict dbname)
     mtime = (time_t)strtoul(field, NULL, 16);
     field = strtok(NULL, ","); if (field == NULL) goto error_hashdb_line;
     size = strtoll(field, NULL, 16);
-    if (size == 0) goto error_hashdb_line;
+    if (size == 0 && (hashcount == 1 || hashcount == 2)) goto error_hashdb_line;
     field = strtok(NULL, ","); if (field == NULL) goto error_hashdb_line;
     inode = strtoull(field, NULL, 16);
+    if (db_ver >= 3) {
+      field = strtok(NULL, ","); if (field == NULL) goto error_hashdb_line;
+      partialsize = (uint32_t)strtoul(field, NULL, 16);
+      if (partialsize == 0 && (hashcount == 1 || hashcount == 2)) goto error_hashdb_line;
+    }
+    if (db_ver >= 4) {
+      field = strtok(NULL, ","); if (field == NULL) goto error_hashdb_line;
+      device = (dev_t)strtoull(field, NULL, 16);
+    }
 
     path = buf + fixed_len;
     path = strtok(path, "\n"); if (path == NULL) goto error_hashdb_line;
-    pathlen = linelen - fixed_len + 1;
+    pathlen = (int)strlen(path);
     if (pathlen > PATH_MAX) goto error_hashdb_line;
-    *(path + pathlen) = '\0';
 
-    /* Allocate and populate a tree entry */
+    if (mode & LOAD_MERGE) {
+      hashdb_t src;
+
+      /* Journal lines wait for the base; see merge_hash_database() */
+      if (is_journal == 0 && merge_base_stale(path)) continue;
+      memset(&src, 0, sizeof(src));
+      src.path = path;
+      src.mtime = mtime;
+      src.inode = inode;
+      src.device = device;
+      src.size = size;
+      src.partialhash = partialhash;
+      src.partialsize = partialsize;
+      src.fullhash = fullhash;
+      src.hashcount = (uint_fast8_t)hashcount;
+      if (is_journal != 0) stage_merge_line(&src, (size_t)pathlen);
+      else if (merge_entry(&src) < 0) goto error_hashdb_add;
+      continue;
+    }
+    if (hashcount == HASHDB_SUBTREE) {
+      forget_subtree(path, (size_t)pathlen);
+      continue;
+    }
+
+    /* Populate a table entry; a later journal line replaces an earlier one */
     entry = add_hashdb_entry(path, pathlen, NULL);
     if (entry == NULL) goto error_hashdb_add;
-    memcpy(entry->path, path, pathlen + 1);
     entry->mtime = mtime;
     entry->inode = inode;
+    entry->device = device;
     entry->size = size;
     entry->partialhash = partialhash;
+    entry->partialsize = partialsize;
     entry->fullhash = fullhash;
     entry->hashcount = hashcount;
+    ino_index(entry);
   }
+  fclose(db);
 
+  /* Rewrite the imported text database in the binary format */
+  if (is_journal == 0 && linenum > 1) hashdb_dirty = 1;
+  if (is_journal != 0 && !(mode & LOAD_MERGE)) journal_offset = pos;
   return linenum - 1;
 
 warn_hashdb_open:
-  fprintf(stderr, "Creating a new hash database '%s'\n", dbname);
+  if (mode == 0) fprintf(stderr, "Creating a new hash database '%s'\n", dbname);
   return 0;
 error_hashdb_read:
   fprintf(stderr, "error reading hash database '%s': %s\n", dbname, strerror(errno));
@@ -432,15 +1981,210 @@ error_hashdb_line:
 error_hashdb_add:
   fprintf(stderr, "error: internal failure allocating a hashdb entry\n");
   return -5;
-error_hashdb_null:
-  fprintf(stderr, "error: internal failure: NULL pointer for hashdb\n");
-  return -6;
 warn_hashdb_algo:
   fprintf(stderr, "warning: hashdb uses a different hash algorithm than selected; not loading\n");
   return -7;
 }
 
 
+/* Load the database, then replay its journal over it */
+int64_t load_hash_database(const char * const restrict dbname)
+{
+  int64_t cnt, jcnt = 0;
+
+  if (dbname == NULL) goto error_hashdb_null;
+  LOUD(fprintf(stderr, "load_hash_database('%s')\n", dbname);)
+  free(journal_name);
+  journal_name = (char *)malloc(strlen(dbname) + 9);
+  if (journal_name == NULL) jc_oom("load_hash_database()");
+  strcpy(journal_name, dbname);
+  strcat(journal_name, ".journal");
+#ifdef ENABLE_HASHDB_LOCK
+  free(lock_name);
+  lock_name = (char *)malloc(strlen(dbname) + 6);
+  if (lock_name == NULL) jc_oom("load_hash_database()");
+  strcpy(lock_name, dbname);
+  strcat(lock_name, ".lock");
+#endif
+
+  /* Other runs may not compact or append while the pair is read */
+  hashdb_lock(F_RDLCK);
+  cnt = load_database_file(dbname, 0, 0);
+  if (cnt >= 0) {
+    note_base(dbname);
+    jcnt = load_database_file(journal_name, LOAD_JOURNAL, 0);
+  }
+  hashdb_lock(F_UNLCK);
+  if (cnt < 0) return cnt;
+  if (jcnt < 0) return jcnt;
+  journal_count = (uint64_t)jcnt;
+  if (jcnt > 0 && !ISFLAG(flags, F_HIDEPROGRESS))
+    fprintf(stderr, "%" PRId64 " changes replayed from journal...", jcnt);
+  return cnt + jcnt;
+
+error_hashdb_null:
+  fprintf(stderr, "error: internal failure: NULL pointer for hashdb\n");
+  return -6;
+}
+
+
+/* Add the entries of another database and its journal to the loaded one;
+ * where both have a path, the entry for the newer file wins. Returns the
+ * number of entries taken from the other database */
+int64_t merge_hash_database(const char * const restrict srcname)
+{
+  struct JC_STAT st;
+  char *src_journal;
+  int64_t cnt;
+
+  if (srcname == NULL) goto error_hashdb_null;
+  LOUD(fprintf(stderr, "merge_hash_database('%s')\n", srcname);)
+  errno = 0;
+  if (jc_stat(srcname, &st) != 0) goto error_hashdb_open;
+  merge_taken = 0;
+
+  /* The journal says which base records are out of date */
+  src_journal = (char *)malloc(strlen(srcname) + 9);
+  if (src_journal == NULL) jc_oom("merge_hash_database()");
+  strcpy(src_journal, srcname);
+  strcat(src_journal, ".journal");
+  cnt = load_database_file(src_journal, LOAD_MERGE | LOAD_JOURNAL, 0);
+  free(src_journal);
+  if (cnt < 0) goto merge_done;
+  if (msrc_count > 1) qsort(msrc, (size_t)msrc_count, sizeof(struct merge_src), merge_src_cmp);
+  if (mdead_count > 1) qsort(mdead, (size_t)mdead_count, sizeof(struct merge_src), merge_src_cmp);
+
+  cnt = load_database_file(srcname, LOAD_MERGE, 0);
+  if (cnt < 0) goto merge_done;
+
+  /* Then the last journal line for each path, unless a later marker forgot it;
+   * invalidations only mean something to the other database */
+  for (uint64_t i = 0; i < msrc_count; i++) {
+    const struct merge_src * const s = &msrc[i];
+
+    if (i + 1 < msrc_count && msrc[i + 1].len == s->len && memcmp(msrc[i + 1].path, s->path, s->len) == 0) continue;
+    if (s->entry.hashcount != 1 && s->entry.hashcount != 2) continue;
+    if (merge_src_dead(s->path, s->seq)) continue;
+    if (merge_entry(&s->entry) < 0) goto error_hashdb_add;
+  }
+  cnt = (int64_t)merge_taken;
+
+merge_done:
+  free_merge_src();
+  return cnt;
+
+error_hashdb_null:
+  fprintf(stderr, "error: internal failure: NULL pointer for hashdb\n");
+  return -6;
+error_hashdb_open:
+  fprintf(stderr, "error: cannot open hash database '%s': %s\n", srcname, strerror(errno));
+  return -1;
+error_hashdb_add:
+  fprintf(stderr, "error: internal failure allocating a hashdb entry\n");
+  free_merge_src();
+  return -5;
+}
+
+
+/* Move every entry at or under the path from to the same place under to.
+ * Device and inode numbers are cleared by merge_entry(); they belong to the files
+ * at the old paths; they are learned again when the new paths are scanned,
+ * so until then entries are checked by size and mtime alone */
+int64_t rewrite_hashdb_prefix(const char * const restrict from, const char * const restrict to)
+{
+  struct hdb_merge m;
+  hashdb_t entry, *moved = NULL;
+  uint64_t cnt = 0, alloc = 0;
+  int64_t retval = 0;
+  size_t from_len, to_len;
+  char path[PATH_MAX + 1];
+
+  if (from == NULL || to == NULL) return -1;
+  from_len = strlen(from);
+  to_len = strlen(to);
+  /* Collect first; the table can't change while it is being walked */
+  merge_start(&m);
+  while (merge_next(&m, &entry)) {
+    if (!path_under(entry.path, from, from_len)) continue;
+    if (cnt == alloc) {
+      alloc = alloc ? alloc * 2 : 4096;
+      moved = (hashdb_t *)realloc(moved, sizeof(hashdb_t) * alloc);
+      if (moved == NULL) jc_oom("rewrite_hashdb_prefix()");
+    }
+    moved[cnt++] = entry;
+  }
+  merge_end(&m);
+
+  /* Old paths go first so one renamed onto another isn't lost */
+  for (uint64_t i = 0; i < cnt; i++) {
+    hashdb_t * const cur = add_hashdb_entry(moved[i].path, 0, NULL);
+    if (cur == NULL) goto error_rewrite;
+    cur->hashcount = 0;
+    hashdb_dirty = 1;
+  }
+  for (uint64_t i = 0; i < cnt; i++) {
+    const size_t len = strlen(moved[i].path) - from_len;
+
+    if (to_len + len > PATH_MAX) {
+      fprintf(stderr, "warning: rewritten path too long, dropping '%s'\n", moved[i].path);
+      continue;
+    }
+    memcpy(path, to, to_len);
+    memcpy(path + to_len, moved[i].path + from_len, len + 1);
+    moved[i].path = path;
+    if (merge_entry(&moved[i]) < 0) goto error_rewrite;
+    retval++;
+  }
+  free(moved);
+  return retval;
+
+error_rewrite:
+  fprintf(stderr, "error: internal failure allocating a hashdb entry\n");
+  free(moved);
+  return -1;
+}
+
+
+/* Drop every entry that isn't at or under the path prefix; returns the
+ * number of entries dropped */
+int64_t filter_hashdb_prefix(const char * const restrict prefix)
+{
+  struct hdb_merge m;
+  hashdb_t entry;
+  char **drop = NULL;
+  uint64_t cnt = 0, alloc = 0;
+  size_t prefix_len;
+
+  if (prefix == NULL) return -1;
+  prefix_len = strlen(prefix);
+  /* Paths in the table and the mapping never move; collect pointers */
+  merge_start(&m);
+  while (merge_next(&m, &entry)) {
+    if (path_under(entry.path, prefix, prefix_len)) continue;
+    if (cnt == alloc) {
+      alloc = alloc ? alloc * 2 : 4096;
+      drop = (char **)realloc(drop, sizeof(char *) * alloc);
+      if (drop == NULL) jc_oom("filter_hashdb_prefix()");
+    }
+    drop[cnt++] = entry.path;
+  }
+  merge_end(&m);
+
+  for (uint64_t i = 0; i < cnt; i++) {
+    hashdb_t * const cur = add_hashdb_entry(drop[i], 0, NULL);
+    if (cur == NULL) {
+      fprintf(stderr, "error: internal failure allocating a hashdb entry\n");
+      free(drop);
+      return -1;
+    }
+    cur->hashcount = 0;
+    hashdb_dirty = 1;
+  }
+  free(drop);
+  return (int64_t)cnt;
+}
+
+
 static int get_path_hash(char *path, uint64_t *path_hash)
 {
   uint64_t aligned_path[(PATH_MAX + 8) / sizeof(uint64_t)];
@@ -455,53 +2199,103 @@ static int get_path_hash(char *path, uint64_t *path_hash)
 }
 
 
+/* Make a mapped record writable by copying it into the table */
+static hashdb_t *materialize(const char * const restrict path, const hashdb_t * const restrict view)
+{
+  hashdb_t *cur;
+  char *cur_path;
+
+  cur = add_hashdb_entry((char *)(uintptr_t)path, 0, NULL);
+  if (cur == NULL) return NULL;
+  cur_path = cur->path;
+  *cur = *view;
+  cur->path = cur_path;
+  return cur;
+}
+
+
 /* Scan database for a matching file entry; if found, load hashes into it */
 int read_hashdb_entry(file_t *file)
 {
-  unsigned int bucket;
   hashdb_t *cur;
+  hashdb_t view, moved;
+  const struct hdb_record *rec;
   uint64_t path_hash;
   int exclude;
+  int retval = 0;
 
   LOUD(fprintf(stderr, "read_hashdb_entry('%s')\n", file->d_name);)
   if (file == NULL || file->d_name == NULL) goto error_null;
   if (get_path_hash(file->d_name, &path_hash) != 0) goto error_path_hash;
-  bucket = path_hash & HT_MASK;
-  if (hashdb[bucket] == NULL) return 0;
-  cur = hashdb[bucket];
-  while (1) {
-    if (cur->path_hash != path_hash) {
-      if (path_hash < cur->path_hash) cur = cur->left;
-      else cur = cur->right;
-      if (cur == NULL) return 0;
-      continue;
+  /* New and changed entries take precedence over the mapped records */
+  cur = find_overlay(file->d_name, path_hash);
+  if (cur == NULL && (rec = find_record(file->d_name, path_hash)) != NULL) {
+    record_to_entry(rec, &view);
+    cur = &view;
+  }
+  if (cur == NULL || cur->hashcount == 0) goto try_moved;
+
+  /* Found a matching path but check mtime */
+  exclude = 0;
+  if (cur->mtime != file->mtime) exclude |= 1;
+  if (cur->inode != 0 && cur->inode != file->inode) exclude |= 2;
+  if (cur->size  != file->size)  exclude |= 4;
+  if (exclude != 0) {
+    /* Invalidate if something has changed; a mapped record is
+     * read-only so it is shadowed by an invalidated table entry */
+    if (cur == &view) {
+      cur = add_hashdb_entry(file->d_name, 0, NULL);
+      if (cur == NULL) return -1;
     }
-    /* Found a matching path hash */
-    if (strcmp(cur->path, file->d_name) != 0) {
-      cur = cur->left;
-      if (cur == NULL) return 0;
-      continue;
-    } else {
-      /* Found a matching path too but check mtime */
-      exclude = 0;
-      if (cur->mtime != file->mtime) exclude |= 1;
-      if (cur->inode != file->inode) exclude |= 2;
-      if (cur->size  != file->size)  exclude |= 4;
-      if (exclude != 0) {
-        /* Invalidate if something has changed */
-        cur->hashcount = 0;
-        hashdb_dirty = 1;
-        return -1;
-      }
-      file->filehash_partial = cur->partialhash;
-      if (cur->hashcount == 2) {
-        file->filehash = cur->fullhash;
-        SETFLAG(file->flags, (FF_HASH_PARTIAL | FF_HASH_FULL));
-      } else SETFLAG(file->flags, FF_HASH_PARTIAL);
-      return 1;
+    cur->hashcount = 0;
+    entry_changed(cur);
+    /* Another file may have been moved over this one */
+    retval = -1;
+    goto try_moved;
+  }
+  /* Learn the device of entries imported from a text database and the
+   * inode of entries that were rewritten from another host's database */
+  if ((cur->device == 0 && file->device != 0) || (cur->inode == 0 && file->inode != 0)) {
+    if (cur == &view) cur = materialize(file->d_name, &view);
+    if (cur != NULL) {
+      cur->device = file->device;
+      cur->inode = file->inode;
+      entry_changed(cur);
+    } else cur = &view;
+  }
+  goto found;
+
+try_moved:
+  /* A path miss may be a file that was renamed or moved; if an entry
+   * has the same device, inode, size and mtime then its hashes are good */
+  cur = find_moved(file, &view);
+  if (cur == NULL) return retval;
+  LOUD(fprintf(stderr, "read_hashdb_entry: '%s' was moved from '%s'\n", file->d_name, cur->path);)
+  moved = *cur;
+  /* Forget the old path unless it is still there (a hard link) */
+  if (jc_access(moved.path, JC_F_OK) != 0) {
+    if (cur == &view) cur = materialize(moved.path, &view);
+    if (cur != NULL) {
+      cur->hashcount = 0;
+      entry_changed(cur);
     }
   }
-  return 0;
+  cur = add_hashdb_entry(file->d_name, 0, NULL);
+  if (cur == NULL) return retval;
+  moved.path = cur->path;
+  moved.path_hash = path_hash;
+  *cur = moved;
+  entry_changed(cur);
+
+found:
+  /* Hashes made with a different partial window can't be compared */
+  if (cur->partialsize != (uint32_t)partial_window(file->size)) return 0;
+  file->filehash_partial = cur->partialhash;
+  if (cur->hashcount == 2) {
+    file->filehash = cur->fullhash;
+    SETFLAG(file->flags, (FF_HASH_PARTIAL | FF_HASH_FULL));
+  } else SETFLAG(file->flags, FF_HASH_PARTIAL);
+  return 1;
 
 error_null:
   fprintf(stderr, "error: internal error: NULL data passed to read_hashdb_entry()\n");
@@ -512,54 +2306,129 @@ error_path_hash:
 }
 
 
-int cleanup_hashdb(uint64_t *cnt, hashdb_t *cur)
+static int sort_prune_by_path(const void *a, const void *b)
 {
-  int err = 0;
-  static char **list;
-  static uint64_t listsize;
-  char *temp;
-  unsigned int i;
+  return strcmp(((const struct prune_item *)a)->path, ((const struct prune_item *)b)->path);
+}
 
-  /* First call: traverse array, sort results, do actual verification */
-  if (unlikely(cur == NULL)) {
-    list = NULL;
-    listsize = 0;
-    *cnt = 0;
 
-    for (i = 0; i < HT_SIZE; i++) {
-      if (hashdb[i] == NULL) continue;
-      err = cleanup_hashdb(cnt, hashdb[i]);
-      if (err != 0) return err;
-    }
+/* Check a range of entries against the files they describe */
+static void prune_check(struct prune_item * const restrict items, const uint64_t start, const uint64_t end)
+{
+  struct JC_STAT st;
 
-    /* TODO: sort list first */
+  for (uint64_t i = start; i < end; i++) {
+    struct prune_item * const item = &items[i];
 
-    /* Check each item for existence; remove if it can't be accessed */
-    for (i = 0; i < *cnt; i++) {
-      char *path = *(list + i);
-      if (jc_access(path, JC_F_OK) == 0) continue;
-      /* TODO: invalidate entry - maybe need pointer? */
+    errno = 0;
+    if (jc_stat(item->path, &st) != 0) {
+      /* Only drop entries for files that are known to be gone */
+      if (errno == ENOENT || errno == ENOTDIR) item->state = PRUNE_MISSING;
+      else item->state = PRUNE_ERROR;
+    } else if (!S_ISREG(st.st_mode) || (int64_t)st.st_size != item->size
+        || (int64_t)st.st_mtime != item->mtime || (item->inode != 0 && (uint64_t)st.st_ino != item->inode)) {
+      item->state = PRUNE_CHANGED;
     }
+  }
+  return;
+}
 
-    return 0;
+
+#ifdef ENABLE_THREADS
+static pthread_mutex_t prune_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct prune_item *prune_items;
+static uint64_t prune_next, prune_count;
+
+static void *prune_worker(void *arg)
+{
+  (void)arg;
+  for (;;) {
+    uint64_t start;
+
+    /* Neighbouring paths stay together so each thread walks a few directories */
+    pthread_mutex_lock(&prune_lock);
+    start = prune_next;
+    prune_next += PRUNE_CHUNK;
+    pthread_mutex_unlock(&prune_lock);
+    if (start >= prune_count) break;
+    prune_check(prune_items, start, start + PRUNE_CHUNK < prune_count ? start + PRUNE_CHUNK : prune_count);
   }
+  return NULL;
+}
+#endif /* ENABLE_THREADS */
 
-  /* If node is valid, add file to list to be checked, expanding array as needed */
-  if (cur->hashcount != 0) {
-    if (listsize == *cnt) {
-      listsize += 4096;
-      list = realloc(list, sizeof(char *) * listsize);
-      if (list == NULL) jc_oom("cleanup_hashdb realloc");
+
+/* Invalidate entries for files that were deleted or changed since they
+ * were hashed; a compaction afterwards drops them from the database.
+ * Files are checked by parallel threads in path order for locality */
+int cleanup_hashdb(struct hashdb_prune * const restrict stats, int threads)
+{
+  struct hdb_merge m;
+  struct prune_item *items = NULL;
+  hashdb_t entry;
+  uint64_t cnt = 0, alloc = 0;
+
+  memset(stats, 0, sizeof(struct hashdb_prune));
+  merge_start(&m);
+  while (merge_next(&m, &entry)) {
+    if (cnt == alloc) {
+      alloc = alloc ? alloc * 2 : 4096;
+      items = (struct prune_item *)realloc(items, sizeof(struct prune_item) * alloc);
+      if (items == NULL) jc_oom("cleanup_hashdb()");
     }
-    temp = (char *)malloc(strlen(cur->path) + 1);
-    if (temp == NULL) jc_oom("cleanup_hashdb path");
-    *(list + *cnt) = temp;
-    strcpy(temp, cur->path);
-    (void)*cnt++;
+    items[cnt].path = entry.path;
+    items[cnt].size = (int64_t)entry.size;
+    items[cnt].mtime = (int64_t)entry.mtime;
+    items[cnt].inode = (uint64_t)entry.inode;
+    items[cnt].state = PRUNE_OK;
+    cnt++;
   }
-
-  /* Traverse the tree, propagating errors */
-  if (err == 0 && cur->left != NULL) err = cleanup_hashdb(cnt, cur->left);
-  if (err == 0 && cur->right != NULL) err = cleanup_hashdb(cnt, cur->right);
-  return err;
+  merge_end(&m);
+  if (cnt > 1) qsort(items, cnt, sizeof(struct prune_item), sort_prune_by_path);
+
+#ifdef ENABLE_THREADS
+  if (threads > MAX_PRUNE_THREADS) threads = MAX_PRUNE_THREADS;
+  if (threads > 1 && cnt > PRUNE_CHUNK) {
+    pthread_t tid[MAX_PRUNE_THREADS];
+    int started = 0;
+
+    prune_items = items;
+    prune_count = cnt;
+    prune_next = 0;
+    for (int i = 0; i < threads; i++) {
+      if (pthread_create(&tid[started], NULL, prune_worker, NULL) != 0) break;
+      started++;
+    }
+    /* Without any worker the main thread does all the work */
+    if (started == 0) prune_worker(NULL);
+    for (int i = 0; i < started; i++) pthread_join(tid[i], NULL);
+  } else prune_check(items, 0, cnt);
+#else
+  (void)threads;
+  prune_check(items, 0, cnt);
+#endif /* ENABLE_THREADS */
+
+  for (uint64_t i = 0; i < cnt; i++) {
+    hashdb_t *cur;
+
+    stats->checked++;
+    if (items[i].state == PRUNE_OK) continue;
+    if (items[i].state == PRUNE_ERROR) {
+      stats->errors++;
+      continue;
+    }
+    if (items[i].state == PRUNE_MISSING) stats->missing++;
+    else stats->changed++;
+    cur = add_hashdb_entry((char *)(uintptr_t)items[i].path, 0, NULL);
+    if (cur == NULL) {
+      free(items);
+      return -1;
+    }
+    /* Journaled as well so a merge with other runs can't bring it back */
+    cur->hashcount = 0;
+    entry_changed(cur);
+    hashdb_dirty = 1;
+  }
+  free(items);
+  return 0;
 }
@@ -12,24 +12,38 @@ extern "C" {
 #include "jdupes.h"
 
 typedef struct _hashdb {
-  struct _hashdb *left;
-  struct _hashdb *right;
   uint64_t path_hash;
   char *path;
   uint64_t partialhash;
   uint64_t fullhash;
   jdupes_ino_t inode;
+  dev_t device;    /* 0 if unknown (imported from a text database) */
   off_t size;
   time_t mtime;
+  uint32_t partialsize;  /* Bytes covered by partialhash */
   uint_fast8_t hashcount;
 } hashdb_t;
 
+/* Results of cleanup_hashdb() */
+struct hashdb_prune {
+  uint64_t checked;
+  uint64_t missing;  /* File is gone */
+  uint64_t changed;  /* File was replaced or modified */
+  uint64_t errors;   /* File couldn't be checked; entry kept */
+};
+
 extern int save_hash_database(const char * const restrict dbname, const int destroy);
+extern int compact_hash_database(const char * const restrict dbname);
 extern hashdb_t *add_hashdb_entry(char *in_path, const int in_pathlen, const file_t *check);
 extern int64_t load_hash_database(const char * const restrict dbname);
 extern int read_hashdb_entry(file_t *file);
 extern uint64_t dump_hashdb(void);
-extern int cleanup_hashdb(uint64_t *cnt, hashdb_t *cur);
+extern int cleanup_hashdb(struct hashdb_prune * const restrict stats, int threads);
+extern int forget_hashdb_subtree(const char * const restrict dir);
+extern void hashdb_enter_dir(const char * const restrict dir);
+extern int64_t merge_hash_database(const char * const restrict srcname);
+extern int64_t rewrite_hashdb_prefix(const char * const restrict from, const char * const restrict to);
+extern int64_t filter_hashdb_prefix(const char * const restrict prefix);
 
 #ifdef __cplusplus
 }
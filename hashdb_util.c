@@ -8,6 +8,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
+#include <sys/stat.h>
 #include <time.h>
 #include "jdupes.h"
 #include "libjodycode.h"
@@ -15,8 +16,31 @@
 #include "hashdb.h"
 #include "version.h"
 
+/* Existence checks are mostly waiting on the filesystem */
+#define DEFAULT_PRUNE_THREADS 8
+
 int hash_algo = 0;
 uint64_t flags = 0;
+size_t partial_hash_size = PARTIAL_HASH_SIZE;
+int partial_hash_grow = 0;
+
+/* Size of a database and its journal on disk */
+static uint64_t db_size(const char * const restrict dbname)
+{
+  struct JC_STAT st;
+  char *journal;
+  uint64_t size = 0;
+
+  if (jc_stat(dbname, &st) == 0) size += (uint64_t)st.st_size;
+  journal = (char *)malloc(strlen(dbname) + 9);
+  if (journal == NULL) jc_oom("db_size()");
+  strcpy(journal, dbname);
+  strcat(journal, ".journal");
+  if (jc_stat(journal, &st) == 0) size += (uint64_t)st.st_size;
+  free(journal);
+  return size;
+}
+
 
 #ifdef UNICODE
 int wmain(int argc, wchar_t **wargv)
@@ -27,9 +51,12 @@ int main(int argc, char **argv)
   const char * const default_name = "jdupes_hashdb.txt";
   const char *dbname, *action;
   int64_t hdbsize;
-  uint64_t cnt;
+  struct hashdb_prune prune;
+  int threads = DEFAULT_PRUNE_THREADS;
+  int64_t written, changed;
+  uint64_t before_size;
 
-  if (argc != 3) goto util_usage;
+  if (argc < 3 || argc > 5) goto util_usage;
 
 #ifdef UNICODE
   /* Create a UTF-8 **argv from the wide version */
@@ -59,18 +86,77 @@ int main(int argc, char **argv)
   if (strcmp(action, "dump") == 0) {
     dump_hashdb();
     return 0;
-  } else if (strcmp(action, "clean") == 0) {
-    fprintf(stderr, "Cleaning entries\n");
-    if (cleanup_hashdb(&cnt, NULL) != 0) goto error_hashdb_cleanup;
+  } else if (strcmp(action, "compact") == 0) {
+    if (compact_hash_database(dbname) < 0) goto error_hashdb_compact;
+    return 0;
+  } else if (strcmp(action, "prune") == 0 || strcmp(action, "clean") == 0) {
+    if (argc == 5) goto util_usage;
+    if (argc == 4) threads = atoi(argv[3]);
+    if (threads < 1) goto util_usage;
+    before_size = db_size(dbname);
+    fprintf(stderr, "Pruning entries\n");
+    if (cleanup_hashdb(&prune, threads) != 0) goto error_hashdb_cleanup;
+    written = compact_hash_database(dbname);
+    if (written < 0) goto error_hashdb_compact;
+    printf("Checked %" PRIu64 " entries: %" PRIu64 " missing, %" PRIu64 " changed, %" PRIu64 " kept (unable to check)\n",
+        prune.checked, prune.missing, prune.changed, prune.errors);
+    printf("Before: %" PRIu64 " entries, %" PRIu64 " bytes\n", prune.checked, before_size);
+    printf("After:  %" PRId64 " entries, %" PRIu64 " bytes\n", written, db_size(dbname));
+    return 0;
+  } else if (strcmp(action, "forget") == 0) {
+    if (argc != 4) goto util_usage;
+    if (forget_hashdb_subtree(argv[3]) != 0 || save_hash_database(dbname, 1) < 0) goto error_hashdb_forget;
+    return 0;
+  } else if (strcmp(action, "merge") == 0) {
+    if (argc != 4) goto util_usage;
+    changed = merge_hash_database(argv[3]);
+    if (changed < 0) goto error_hashdb_merge;
+    written = compact_hash_database(dbname);
+    if (written < 0) goto error_hashdb_compact;
+    printf("Took %" PRId64 " entries from '%s'; %" PRId64 " entries now\n", changed, argv[3], written);
+    return 0;
+  } else if (strcmp(action, "rewrite") == 0) {
+    if (argc != 5) goto util_usage;
+    changed = rewrite_hashdb_prefix(argv[3], argv[4]);
+    if (changed < 0) goto error_hashdb_merge;
+    written = compact_hash_database(dbname);
+    if (written < 0) goto error_hashdb_compact;
+    printf("Rewrote %" PRId64 " entries; %" PRId64 " entries now\n", changed, written);
+    return 0;
+  } else if (strcmp(action, "filter") == 0) {
+    if (argc != 4) goto util_usage;
+    changed = filter_hashdb_prefix(argv[3]);
+    if (changed < 0) goto error_hashdb_merge;
+    written = compact_hash_database(dbname);
+    if (written < 0) goto error_hashdb_compact;
+    printf("Dropped %" PRId64 " entries; %" PRId64 " entries now\n", changed, written);
+    return 0;
   } else goto error_action;
 
   return 0;
 
 util_usage:
   printf("jdupes hashdb utility %s (%s)\n", VER, VERDATE);
-  printf("usage: %s hash_database_name action\n", argv[0]);
+  printf("usage: %s hash_database_name action [arguments]\n", argv[0]);
   printf("If the name is a period '.' then 'jdupes_hashdb.txt' will be used\n");
-  printf("Actions: none yet\n");
+  printf("Actions: dump             print the database in text form\n");
+  printf("         compact          fold the journal into the database\n");
+  printf("         prune [THREADS]  remove entries for deleted or changed files and compact;\n");
+  printf("                          files are checked by THREADS threads (default %d)\n", DEFAULT_PRUNE_THREADS);
+  printf("         forget DIR       drop all entries under DIR (deleted or moved away)\n");
+  printf("         merge OTHER      add entries from database OTHER; newer files win\n");
+  printf("                          (device and inode numbers are not carried over)\n");
+  printf("         rewrite FROM TO  change the path prefix FROM to TO (e.g. /mnt/a/ /srv/b/)\n");
+  printf("         filter PREFIX    drop entries whose paths aren't at or under PREFIX\n");
+  exit(EXIT_FAILURE);
+error_hashdb_compact:
+  fprintf(stderr, "error compacting hash database '%s'\n", dbname);
+  exit(EXIT_FAILURE);
+error_hashdb_merge:
+  fprintf(stderr, "error changing hash database '%s'\n", dbname);
+  exit(EXIT_FAILURE);
+error_hashdb_forget:
+  fprintf(stderr, "error forgetting entries in hash database '%s'\n", dbname);
   exit(EXIT_FAILURE);
 error_hashdb_cleanup:
   fprintf(stderr, "error cleaning up hash database '%s'\n", dbname);
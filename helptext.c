@@ -103,6 +103,8 @@ void help_text(void)
   printf(" -A --no-hidden    \texclude hidden files from consideration\n");
 #ifdef ENABLE_DEDUPE
   printf(" -B --dedupe      \tdo a copy-on-write (reflink/clone) deduplication\n");
+  printf(" -c --reflink     \treplace duplicates with reflink clones of the first\n");
+  printf("                  \tfile after jdupes' own byte-for-byte check\n");
 #endif
 #ifndef NO_CHUNKSIZE
   printf(" -C --chunk-size=#\toverride I/O chunk size in KiB (min %d, max %d)\n", MIN_CHUNK_SIZE / 1024, MAX_CHUNK_SIZE / 1024);
@@ -122,6 +124,12 @@ void help_text(void)
   printf(" -e --error-on-dupe\texit on any duplicate found with status code 255\n");
 #endif
   printf(" -f --omit-first  \tomit the first file in each set of matches\n");
+#ifndef NO_JSON
+  printf(" -F --replay=FILE \tact on the sets in a -j or -J report instead of\n");
+  printf("                  \tscanning; files that changed since are skipped\n");
+  printf(" -G --replay-confirm\twith -F, also compare each file's data to the first;\n");
+  printf("                  \trequired to act destructively on a -j report\n");
+#endif /* NO_JSON */
   printf(" -h --help        \tdisplay this help message\n");
 #ifndef NO_HARDLINKS
   printf(" -H --hard-links  \ttreat any linked files as duplicate files. Normally\n");
@@ -133,6 +141,8 @@ void help_text(void)
 #endif
 #ifndef NO_JSON
   printf(" -j --json        \tproduce JSON (machine-readable) output\n");
+  printf(" -J --ndjson      \tprint each duplicate set as one line of JSON as soon\n");
+  printf("                  \tas it is found (newline-delimited JSON)\n");
 #endif /* NO_JSON */
 /*  printf(" -K --skip-hash   \tskip full file hashing (may be faster; 100%% safe)\n");
     printf("                  \tWARNING: in development, not fully working yet!\n"); */
@@ -184,11 +194,15 @@ void help_text(void)
   printf(" -U --no-trav-check\tdisable double-traversal safety check (BE VERY CAREFUL)\n");
   printf("                  \tThis fixes a Google Drive File Stream recursion issue\n");
   printf(" -v --version     \tdisplay jdupes version and license information\n");
+#ifndef NO_TUNE
+  printf(" -x --tune=opt[:val]\ttune how file data is read (never changes results)\n");
+  printf("                  \tUse '-x help' for detailed tuning help\n");
+#endif /* NO_TUNE */
 #ifndef NO_EXTFILTER
   printf(" -X --ext-filter=x:y\tfilter files based on specified criteria\n");
   printf("                  \tUse '-X help' for detailed extfilter help\n");
 #endif /* NO_EXTFILTER */
-  printf(" -y --hash-db=file\tuse a hash database text file to speed up repeat runs\n");
+  printf(" -y --hash-db=file\tuse a hash database file to speed up repeat runs\n");
   printf("                  \tPassing '-y .' will expand to  '-y jdupes_hashdb.txt'\n");
   printf(" -z --zero-match  \tconsider zero-length files to be duplicates\n");
   printf(" -Z --soft-abort  \tIf the user aborts (i.e. CTRL-C) act on matches so far\n");
@@ -41,6 +41,9 @@
 #include "likely_unlikely.h"
 #include "jdupes.h"
 #include "args.h"
+#ifndef NO_TUNE
+ #include "autotune.h"
+#endif
 #include "checks.h"
 #ifdef DEBUG
  #include "dumpflags.h"
@@ -58,10 +61,15 @@
 #include "match.h"
 #include "progress.h"
 #include "interrupt.h"
+#ifndef NO_TUNE
+ #include "schedule.h"
+#endif
 #include "sort.h"
+#include "stream.h"
 #ifndef NO_TRAVCHECK
  #include "travcheck.h"
 #endif
+#include "tune.h"
 #include "version.h"
 
 #ifndef USE_JODY_HASH
@@ -82,6 +90,7 @@
 #include "act_printmatches.h"
 #ifndef NO_JSON
  #include "act_printjson.h"
+ #include "replay.h"
 #endif /* NO_JSON */
 #include "act_summarize.h"
 
@@ -102,9 +111,9 @@ uint_fast64_t flags = 0, a_flags = 0, p_flags = 0;
 
 static const char *program_name;
 
-#ifndef PARTIAL_HASH_SIZE
- #define PARTIAL_HASH_SIZE 4096
-#endif
+/* Partial hash window base size and whether it grows with file size */
+size_t partial_hash_size = PARTIAL_HASH_SIZE;
+int partial_hash_grow = 0;
 
 #ifndef NO_CHUNKSIZE
  size_t auto_chunk_size = CHUNK_SIZE;
@@ -177,6 +186,9 @@ int main(int argc, char **argv)
 #endif
 #ifndef NO_CHUNKSIZE
   static long manual_chunk_size = 0;
+ #ifdef DEBUG
+  static int chunk_autotuned = 0;
+ #endif
  #ifdef __linux__
   static struct jc_proc_cacheinfo pci;
  #endif /* __linux__ */
@@ -186,6 +198,7 @@ int main(int argc, char **argv)
   static struct utsname utsname;
  #endif /* __linux__ */
 #endif
+  const char *replay_name = NULL;
 #ifndef NO_HASHDB
   char *hashdb_name = NULL;
   int hdblen;
@@ -203,16 +216,20 @@ int main(int argc, char **argv)
     { "no-hidden", 0, 0, 'A' },
     { "dedupe", 0, 0, 'B' },
     { "chunk-size", 1, 0, 'C' },
+    { "reflink", 0, 0, 'c' },
     { "debug", 0, 0, 'D' },
     { "delete", 0, 0, 'd' },
     { "error-on-dupe", 0, 0, 'e' },
     { "ext-option", 0, 0, 'E' },
     { "omit-first", 0, 0, 'f' },
+    { "replay", 1, 0, 'F' },
+    { "replay-confirm", 0, 0, 'G' },
     { "hard-links", 0, 0, 'H' },
     { "help", 0, 0, 'h' },
     { "isolate", 0, 0, 'I' },
     { "reverse", 0, 0, 'i' },
     { "json", 0, 0, 'j' },
+    { "ndjson", 0, 0, 'J' },
 /*    { "skip-hash", 0, 0, 'K' }, */
     { "link-hard", 0, 0, 'L' },
     { "link-soft", 0, 0, 'l' },
@@ -234,6 +251,7 @@ int main(int argc, char **argv)
     { "no-trav-check", 0, 0, 'U' },
     { "print-unique", 0, 0, 'u' },
     { "version", 0, 0, 'v' },
+    { "tune", 1, 0, 'x' },
     { "ext-filter", 1, 0, 'X' },
     { "hash-db", 1, 0, 'y' },
     { "soft-abort", 0, 0, 'Z' },
@@ -245,7 +263,7 @@ int main(int argc, char **argv)
  #define GETOPT getopt
 #endif
 
-#define GETOPT_STRING "@019ABC:DdEefHhIijKLlMmNnOo:P:pQqRrSsTtUuVvX:y:Zz"
+#define GETOPT_STRING "@019ABC:cDdEeF:fGHhIiJjKLlMmNnOo:P:pQqRrSsTtUuVvx:X:y:Zz"
 
   /* Verify libjodycode compatibility before going further */
   if (libjodycode_version_check(1, 0) != 0) {
@@ -343,6 +361,13 @@ int main(int argc, char **argv)
       CLEARFLAG(flags, F_INCLUDEEMPTY);
       LOUD(fprintf(stderr, "opt: CoW/block-level deduplication enabled (--dedupe)\n");)
       break;
+    case 'c':
+      /* Our own byte-for-byte check makes the clone safe; nothing to
+       * gain from cloning empty files */
+      SETFLAG(a_flags, FA_REFLINKFILES);
+      CLEARFLAG(flags, F_INCLUDEEMPTY);
+      LOUD(fprintf(stderr, "opt: replace duplicates with reflink clones (--reflink)\n");)
+      break;
 #endif /* ENABLE_DEDUPE */
 #ifndef NO_CHUNKSIZE
     case 'C':
@@ -420,6 +445,18 @@ int main(int argc, char **argv)
       SETFLAG(a_flags, FA_PRINTJSON);
       LOUD(fprintf(stderr, "opt: print output in JSON format (--print-json)\n");)
       break;
+    case 'J':
+      SETFLAG(a_flags, FA_PRINTNDJSON);
+      LOUD(fprintf(stderr, "opt: print each set as a line of JSON during the scan (--ndjson)\n");)
+      break;
+    case 'F':
+      replay_name = optarg;
+      LOUD(fprintf(stderr, "opt: act on match sets saved in '%s' (--replay)\n", optarg);)
+      break;
+    case 'G':
+      replay_confirm = 1;
+      LOUD(fprintf(stderr, "opt: re-check file contents of replayed sets (--replay-confirm)\n");)
+      break;
 #endif /* NO_JSON */
     case 'K':
       SETFLAG(flags, F_SKIPHASH);
@@ -524,6 +561,11 @@ int main(int argc, char **argv)
       add_extfilter(optarg);
       break;
 #endif /* NO_EXTFILTER */
+#ifndef NO_TUNE
+    case 'x':
+      add_tune_option(optarg);
+      break;
+#endif /* NO_TUNE */
 #ifndef NO_HASHDB
     case 'y':
       SETFLAG(flags, F_HASHDB);
@@ -563,7 +605,7 @@ int main(int argc, char **argv)
     }
   }
 
-  if (optind >= argc) {
+  if (optind >= argc && replay_name == NULL) {
     fprintf(stderr, "no files or directories specified (use -h option for help)\n");
     exit(EXIT_FAILURE);
   }
@@ -619,16 +661,28 @@ skip_partialonly_noise:
       !!ISFLAG(a_flags, FA_HARDLINKFILES) +
       !!ISFLAG(a_flags, FA_MAKESYMLINKS) +
       !!ISFLAG(a_flags, FA_PRINTJSON) +
+      !!ISFLAG(a_flags, FA_PRINTNDJSON) +
       !!ISFLAG(a_flags, FA_PRINTUNIQUE) +
       !!ISFLAG(a_flags, FA_ERRORONDUPE) +
-      !!ISFLAG(a_flags, FA_DEDUPEFILES);
+      !!ISFLAG(a_flags, FA_DEDUPEFILES) +
+      !!ISFLAG(a_flags, FA_REFLINKFILES);
 
   if (pm > 1) {
-      fprintf(stderr, "Only one of --summarize, --print-summarize, --delete, --link-hard,\n--link-soft, --json, --error-on-dupe, or --dedupe may be used\n");
+      fprintf(stderr, "Only one of --summarize, --print-summarize, --delete, --link-hard,\n--link-soft, --json, --ndjson, --error-on-dupe, --dedupe, or --reflink may be used\n");
       exit(EXIT_FAILURE);
   }
   if (pm == 0) SETFLAG(a_flags, FA_PRINTMATCHES);
 
+  /* --ndjson prints each set as soon as it is complete */
+  if (ISFLAG(a_flags, FA_PRINTNDJSON)) stream_actions = 1;
+  /* -x stream needs an action that can run before the scan is done */
+  if (stream_actions != 0 && !ISFLAG(a_flags, FA_PRINTNDJSON) && !(ISFLAG(a_flags, FA_DELETEFILES) && ISFLAG(flags, F_NOPROMPT))
+      && !ISFLAG(a_flags, FA_HARDLINKFILES) && !ISFLAG(a_flags, FA_MAKESYMLINKS)
+      && !ISFLAG(a_flags, FA_DEDUPEFILES) && !ISFLAG(a_flags, FA_REFLINKFILES)) {
+    fprintf(stderr, "warning: -x stream only applies to -dN, -L, -l, -c and -B, ignoring\n");
+    stream_actions = 0;
+  }
+
 #ifndef ON_WINDOWS
   /* Catch SIGUSR1 and use it to enable -Z */
   signal(SIGUSR1, catch_sigusr1);
@@ -652,6 +706,19 @@ skip_partialonly_noise:
     jc_alarm_ring = 1;
   }
 
+#ifndef NO_JSON
+  /* Sets saved by an earlier run need no scanning or matching */
+  if (replay_name != NULL) {
+    files = load_replay(replay_name);
+    goto skip_file_scan;
+  }
+#endif /* NO_JSON */
+
+#ifndef NO_TUNE
+  /* The partial hash window must be settled before any hashdb lookups */
+  for (int x = optind; x < argc; x++) tune_partial_base(argv[x]);
+#endif
+
   if (ISFLAG(flags, F_RECURSEAFTER)) {
     firstrecurse = nonoptafter("--recurse:", argc, oldargv, argv);
 
@@ -709,6 +776,22 @@ skip_partialonly_noise:
   if (!ISFLAG(flags, F_HIDEPROGRESS)) fprintf(stderr, "\n");
   if (!files) goto skip_file_scan;
 
+#ifndef NO_TUNE
+  /* Pick up per-device I/O settings (-x autotune) before reading any data */
+ #if defined DEBUG && !defined NO_CHUNKSIZE
+  chunk_autotuned = autotune_apply(files, manual_chunk_size != 0);
+ #elif !defined NO_CHUNKSIZE
+  autotune_apply(files, manual_chunk_size != 0);
+ #else
+  autotune_apply(files, 1);
+ #endif
+  /* Hash candidates in disk order if requested (-x schedule) */
+  schedule_hashes(files);
+  if (unlikely(interrupt)) goto interrupt_exit;
+#endif /* NO_TUNE */
+  /* Bring each size group together so it can be acted on as it completes */
+  if (stream_actions != 0) files = stream_sort(files);
+
   curfile = files;
   progress = 0;
 
@@ -726,8 +809,10 @@ skip_partialonly_noise:
 
     LOUD(fprintf(stderr, "\nMAIN: current file: %s\n", curfile->d_name));
 
-    if (!checktree) registerfile(&checktree, NONE, curfile);
-    else match = checkmatch(checktree, curfile);
+    if (!checktree) {
+      registerfile(&checktree, NONE, curfile);
+      match = NULL;
+    } else match = checkmatch(checktree, curfile);
 
     /* Byte-for-byte check that a matched pair are actually matched */
     if (match != NULL) {
@@ -753,7 +838,7 @@ skip_partialonly_noise:
         goto skip_full_check;
       }
 
-      if (confirmmatch(curfile->d_name, (*match)->d_name, curfile->size) == 0) {
+      if (confirmmatch(curfile, *match) == 0) {
         LOUD(fprintf(stderr, "MAIN: registering matched file pair\n"));
 #ifndef NO_MTIME
         registerpair(match, curfile, (ordertype == ORDER_TIME) ? sort_pairs_by_mtime : sort_pairs_by_filename);
@@ -768,7 +853,11 @@ skip_partialonly_noise:
     }
 
 skip_full_check:
-    curfile = curfile->next;
+    /* With -x stream, no set can grow once the last file of a size is done */
+    if (stream_actions != 0 && (curfile->next == NULL || curfile->next->size != curfile->size)) {
+      stream_bucket(&files, curfile, &checktree);
+      curfile = files;
+    } else curfile = curfile->next;
 
     check_sigusr1();
     if (jc_alarm_ring != 0) {
@@ -785,6 +874,13 @@ skip_file_scan:
   signal(SIGINT, SIG_DFL);
   if (!ISFLAG(flags, F_HIDEPROGRESS)) jc_stop_alarm();
 
+  if (stream_actions != 0) {
+    /* Sets found before a -Z abort are acted on like without -x stream */
+    if (files != NULL) stream_bucket(&files, NULL, &checktree);
+    stream_finish();
+    goto skip_actions;
+  }
+
   if (files == NULL) {
     printf("%s", s_no_dupes);
     exit(exit_status);
@@ -804,6 +900,7 @@ skip_file_scan:
 #endif /* NO_HARDLINKS */
 #ifdef ENABLE_DEDUPE
   if (ISFLAG(a_flags, FA_DEDUPEFILES)) dedupefiles(files);
+  if (ISFLAG(a_flags, FA_REFLINKFILES)) linkfiles(files, 2, 0);
 #endif /* ENABLE_DEDUPE */
   if (ISFLAG(a_flags, FA_PRINTMATCHES)) printmatches(files);
   if (ISFLAG(a_flags, FA_PRINTUNIQUE)) printunique(files);
@@ -815,6 +912,7 @@ skip_file_scan:
     summarizematches(files);
   }
 
+skip_actions:
 #ifndef NO_HASHDB
   if (ISFLAG(flags, F_HASHDB)) {
     hdbout = save_hash_database(hashdb_name, 1);
@@ -833,11 +931,12 @@ skip_all_scan_code:
 #ifdef DEBUG
   if (ISFLAG(flags, F_DEBUG)) {
     fprintf(stderr, "\n%d partial(%uKiB) (+%d small) -> %d full hash -> %d full (%d partial elim) (%d hash%u fail)\n",
-        partial_hash, PARTIAL_HASH_SIZE >> 10, small_file, full_hash, partial_to_full,
+        partial_hash, (unsigned int)(partial_hash_size >> 10), small_file, full_hash, partial_to_full,
         partial_elim, hash_fail, (unsigned int)sizeof(uint64_t)*8);
     fprintf(stderr, "%" PRIuMAX " total files, %" PRIuMAX " comparisons\n", filecount, comparisons);
  #ifndef NO_CHUNKSIZE
     if (manual_chunk_size > 0) fprintf(stderr, "I/O chunk size: %ld KiB (manually set)\n", manual_chunk_size >> 10);
+    else if (chunk_autotuned != 0) fprintf(stderr, "I/O chunk size: %" PRIuMAX " KiB (device profile)\n", (uintmax_t)(auto_chunk_size >> 10));
     else {
   #ifdef __linux__
       fprintf(stderr, "I/O chunk size: %" PRIuMAX " KiB (%s)\n", (uintmax_t)(auto_chunk_size >> 10), (pci.l1 + pci.l1d) != 0 ? "dynamically sized" : "default size");
@@ -179,6 +179,8 @@ extern uint64_t flags, a_flags, p_flags;
 #define FA_PRINTNULL		(1U << 9)
 #define FA_PRINTJSON		(1U << 10)
 #define FA_ERRORONDUPE		(1U << 11)
+#define FA_REFLINKFILES		(1U << 12)
+#define FA_PRINTNDJSON		(1U << 13)
 
 /* Per-file true/false flags */
 #define FF_VALID_STAT		(1U << 0)
@@ -201,6 +203,12 @@ typedef enum {
 #ifndef PARTIAL_HASH_SIZE
  #define PARTIAL_HASH_SIZE 4096
 #endif
+/* Largest partial hash window that -x partial may produce */
+#define PARTIAL_HASH_MAX 1048576
+
+/* Runtime partial hash window (-x partial); see partial_window() */
+extern size_t partial_hash_size;
+extern int partial_hash_grow;
 
 /* Per-file information */
 typedef struct _file {
@@ -242,6 +250,17 @@ typedef struct _filetree {
   struct _filetree *right;
 } filetree_t;
 
+/* Bytes covered by the partial hash of a file of the given size
+ * Only depends on the size so that files which can match always agree */
+static inline off_t partial_window(const off_t size)
+{
+  off_t window = (off_t)partial_hash_size;
+
+  if (partial_hash_grow != 0)
+    while (window < PARTIAL_HASH_MAX && size / 1024 > window) window <<= 1;
+  return window;
+}
+
 /* Progress indicator variables */
 extern uintmax_t filecount, progress, item_progress, dupecount;
 
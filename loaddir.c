@@ -151,6 +151,10 @@ void loaddir(char * const restrict dir,
 
   item_progress++;
 
+#ifndef NO_HASHDB
+  if (ISFLAG(flags, F_HASHDB)) hashdb_enter_dir(dir);
+#endif
+
 #ifdef UNICODE
   /* Windows requires \* at the end of directory names */
   strncpy(tempname, dir, PATHBUF_SIZE * 2 - 1);
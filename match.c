@@ -12,6 +12,7 @@
 #include "jdupes.h"
 #include "likely_unlikely.h"
 #include "checks.h"
+#include "fileio.h"
 #include "filehash.h"
 #ifndef NO_HASHDB
  #include "hashdb.h"
@@ -217,7 +218,7 @@ file_t **checkmatch(filetree_t * restrict tree, file_t * const restrict file)
     LOUD(fprintf(stderr, "checkmatch: starting file data comparisons\n"));
     /* Attempt to exclude files quickly with partial file hashing */
     if (!ISFLAG(tree->file->flags, FF_HASH_PARTIAL)) {
-      filehash = get_filehash(tree->file, PARTIAL_HASH_SIZE, hash_algo);
+      filehash = get_filehash(tree->file, (size_t)partial_window(tree->file->size), hash_algo);
       if (filehash == NULL) return NULL;
 
       tree->file->filehash_partial = *filehash;
@@ -228,7 +229,7 @@ file_t **checkmatch(filetree_t * restrict tree, file_t * const restrict file)
     }
 
     if (!ISFLAG(file->flags, FF_HASH_PARTIAL)) {
-      filehash = get_filehash(file, PARTIAL_HASH_SIZE, hash_algo);
+      filehash = get_filehash(file, (size_t)partial_window(file->size), hash_algo);
       if (filehash == NULL) return NULL;
 
       file->filehash_partial = *filehash;
@@ -247,7 +248,7 @@ file_t **checkmatch(filetree_t * restrict tree, file_t * const restrict file)
     if (cmpresult == 0 && ISFLAG(p_flags, PF_PARTIAL))
       printf("\nPartial hashes match:\n   %s\n   %s\n\n", file->d_name, tree->file->d_name);
 
-    if (file->size <= PARTIAL_HASH_SIZE || ISFLAG(flags, F_PARTIALONLY)) {
+    if (file->size <= partial_window(file->size) || ISFLAG(flags, F_PARTIALONLY)) {
       if (ISFLAG(flags, F_PARTIALONLY)) { LOUD(fprintf(stderr, "checkmatch: partial only mode: treating partial hash as full hash\n")); }
       else { LOUD(fprintf(stderr, "checkmatch: small file: copying partial hash to full hash\n")); }
       /* filehash_partial = filehash if file is small enough */
@@ -363,60 +364,56 @@ file_t **checkmatch(filetree_t * restrict tree, file_t * const restrict file)
 
 /* Do a byte-by-byte comparison in case two different files produce the
    same signature. Unlikely, but better safe than sorry. */
-int confirmmatch(const char * const restrict file1, const char * const restrict file2, const off_t size)
+int confirmmatch(const file_t * const restrict file1, const file_t * const restrict file2)
 {
-  static char *c1 = NULL, *c2 = NULL;
-  FILE *fp1, *fp2;
-  size_t r1, r2;
-  off_t bytes = 0;
+  filereader_t r1, r2;
+  const char *c1 = NULL, *c2 = NULL;
+  ssize_t len1 = 0, len2 = 0;
+  size_t bytes;
+  off_t size, done = 0;
   int retval = 0;
 
   if (unlikely(file1 == NULL || file2 == NULL)) jc_nullptr("confirmmatch()");
   LOUD(fprintf(stderr, "confirmmatch running\n"));
 
-  if (unlikely(c1 == NULL || c2 == NULL)) {
-    c1 = (char *)malloc(auto_chunk_size);
-    c2 = (char *)malloc(auto_chunk_size);
+  if (file1->size != file2->size) return 1; /* file lengths are different */
+  size = file1->size;
+  if (reader_open(&r1, file1, 0, size, 0) != 0) {
+    LOUD(fprintf(stderr, "confirmmatch: warning: file open failed ('%s')\n", file1->d_name);)
+    return 1;
   }
-  if (unlikely(c1 == NULL || c2 == NULL)) jc_oom("confirmmatch() buffers");
-
-  fp1 = jc_fopen(file1, JC_FILE_MODE_RDONLY_SEQ);
-  fp2 = jc_fopen(file2, JC_FILE_MODE_RDONLY_SEQ);
-  if (fp1 == NULL) {
-    if (fp2 != NULL) fclose(fp2);
-    LOUD(fprintf(stderr, "confirmmatch: warning: file open failed ('%s')\n", file1);)
-    goto different;
-  }
-  if (fp2 == NULL) {
-    if (fp1 != NULL) fclose(fp1);
-    LOUD(fprintf(stderr, "confirmmatch: warning: file open failed ('%s')\n", file2);)
-    goto different;
+  if (reader_open(&r2, file2, 0, size, 1) != 0) {
+    LOUD(fprintf(stderr, "confirmmatch: warning: file open failed ('%s')\n", file2->d_name);)
+    reader_close(&r1);
+    return 1;
   }
 
-  fseek(fp1, 0, SEEK_SET);
-  fseek(fp2, 0, SEEK_SET);
-#ifdef __linux__
-  /* Tell Linux we will accees sequentially and soon */
-  posix_fadvise(fileno(fp1), 0, size, POSIX_FADV_SEQUENTIAL);
-  posix_fadvise(fileno(fp1), 0, size, POSIX_FADV_WILLNEED);
-  posix_fadvise(fileno(fp2), 0, size, POSIX_FADV_SEQUENTIAL);
-  posix_fadvise(fileno(fp2), 0, size, POSIX_FADV_WILLNEED);
-#endif /* __linux__ */
-
-  do {
+  /* Backends may hand out differently sized pieces; compare the overlap */
+  while (done < size) {
     if (interrupt) goto different;
-    r1 = fread(c1, sizeof(char), auto_chunk_size, fp1);
-    r2 = fread(c2, sizeof(char), auto_chunk_size, fp2);
-
-    if (r1 != r2) goto different; /* file lengths are different */
-    if (memcmp (c1, c2, r1)) goto different; /* file contents are different */
-
-    bytes += (off_t)r1;
+    if (len1 == 0) {
+      len1 = reader_next(&r1, (const void **)&c1);
+      if (len1 <= 0) goto different; /* file shrank or read error */
+    }
+    if (len2 == 0) {
+      len2 = reader_next(&r2, (const void **)&c2);
+      if (len2 <= 0) goto different;
+    }
+    bytes = (size_t)(len1 < len2 ? len1 : len2);
+    /* Holes lying at the same offsets in both files come back as the same
+     * shared zero buffer and need no comparison */
+    if (c1 != c2 && memcmp(c1, c2, bytes)) goto different; /* file contents are different */
+    c1 += bytes; len1 -= (ssize_t)bytes;
+    c2 += bytes; len2 -= (ssize_t)bytes;
+
+    done += (off_t)bytes;
     if (jc_alarm_ring != 0) {
       jc_alarm_ring = 0;
-      update_phase2_progress("confirm", (int)((bytes * 100) / size));
+      update_phase2_progress("confirm", (int)((done * 100) / size));
     }
-  } while (r2);
+  }
+  /* Only the scanned length was read; a file that grew since is different */
+  if (reader_file_size(&r1) != size || reader_file_size(&r2) != size) goto different; /* file lengths are different */
 
   /* Success: return 0 */
   goto finish_confirm;
@@ -425,7 +422,7 @@ different:
   retval = 1;
 
 finish_confirm:
-//  free(c1); free(c2);
-  fclose(fp1); fclose(fp2);
+  if (reader_close(&r1) != 0) retval = 1;
+  if (reader_close(&r2) != 0) retval = 1;
   return retval;
 }
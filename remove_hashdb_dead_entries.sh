@@ -5,29 +5,41 @@
 HASHDB="$1"
 TEMPDB="_jdupes_hashdb_clean.tmp"
 ERR=0; CNT=0
-LINELEN=87
 
 [ "$HASHDB" = "." ] && HASHDB="jdupes_hashdb.txt"
 
 clean_exit () {
 	echo "Terminated, cleaning up." >&2
 	rm -f "$TEMPDB"
+	[ "$SRCDB" != "$HASHDB" ] && rm -f "$SRCDB"
 	exit 1
 }
 
 trap clean_exit INT TERM HUP ABRT QUIT
 
-if ! grep -q -m 1 '^jdupes hashdb:2,' "$HASHDB"
-	then echo "Must be a version 2 database, exiting" >&2
+# Binary databases are cleaned as text; jdupes converts the result back
+SRCDB="$HASHDB"
+if [ "$(head -c 8 "$HASHDB")" = "JDHASHDB" ]
+	then SRCDB="_jdupes_hashdb_text.tmp"
+	HASHDB_UTIL="${HASHDB_UTIL:-hashdb_util}"
+	"$HASHDB_UTIL" "$HASHDB" dump > "$SRCDB" 2>/dev/null || { echo "Cannot dump $HASHDB with $HASHDB_UTIL" >&2; rm -f "$SRCDB"; exit 1; }
+fi
+
+# v3 adds the partial hash window size before the path
+if grep -q -m 1 '^jdupes hashdb:3,' "$SRCDB"
+	then LINELEN=96; SORTKEY=8
+elif grep -q -m 1 '^jdupes hashdb:2,' "$SRCDB"
+	then LINELEN=87; SORTKEY=7
+	else echo "Must be a version 2 or 3 database, exiting" >&2
 	exit 1
 fi
 
-SRCLINES="$(wc -l "$HASHDB" | cut -d' ' -f1)"
+SRCLINES="$(wc -l "$SRCDB" | cut -d' ' -f1)"
 SRCLINES="$((SRCLINES - 1))"
 
 echo "Cleaning out hash database $HASHDB [$SRCLINES entries]" >&2
 
-head -n 1 "$HASHDB" > "$TEMPDB" || ERR=1
+head -n 1 "$SRCDB" > "$TEMPDB" || ERR=1
 
 echo "Sorting items (this may take a little time)..." >&2
 
@@ -38,14 +50,18 @@ while read LINE
 	echo "$LINE" >> "$TEMPDB" || ERR=1
 	CNT=$((CNT + 1))
 	echo -n "Processed $CNT/$SRCLINES lines ($((CNT * 100 / SRCLINES))%)"$'\r'
-done < <(grep -v '^jdupes hashdb:' "$HASHDB" | sort -k7 -t,)
+done < <(grep -v '^jdupes hashdb:' "$SRCDB" | sort -k$SORTKEY -t,)
 
 if [ $ERR -eq 1 ]
 	then echo "Error writing out lines, not overwriting hash database" >&2
 	rm -f "$TEMPDB"
+	[ "$SRCDB" != "$HASHDB" ] && rm -f "$SRCDB"
 	exit 1
 
 	else
 	mv -f "$TEMPDB" "$HASHDB"
+	# The dump included the journal; replaying it would restore dead entries
+	rm -f "$HASHDB.journal"
+	[ "$SRCDB" != "$HASHDB" ] && rm -f "$SRCDB"
 	echo "Wrote $CNT entries; cleaned out $((SRCLINES - CNT)) entries" >&2
 fi
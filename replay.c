@@ -0,0 +1,557 @@
+/* jdupes match set replay
+ * Reads duplicate sets back from a report written earlier with -j/--json
+ * or -J/--ndjson and hands them to the usual actions without scanning or
+ * comparing anything. Each file is checked with stat() against what the
+ * report recorded (size always; inode, device and mtime if present), and
+ * with -G/--replay-confirm every file's data must also still be identical
+ * to the first file's. Files that fail are dropped from their set. A -j
+ * report records sizes only, which can't tell a rewritten file of the same
+ * size, so acting on one destructively requires -G.
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifndef NO_JSON
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <libjodycode.h>
+#include "likely_unlikely.h"
+#include "jdupes.h"
+#include "filestat.h"
+#include "match.h"
+#include "replay.h"
+
+int replay_confirm = 0;
+
+/* A set member as recorded in the report */
+struct replay_member {
+  char *path;
+  uintmax_t inode, device;
+  intmax_t mtime;
+  int have_inode, have_device, have_mtime;
+};
+
+/* Everything read so far for the set being parsed */
+struct replay_set {
+  off_t size;
+  int have_size;
+  struct replay_member *members;
+  unsigned int count, alloc;
+};
+
+static file_t *replay_head, *replay_tail;
+static uintmax_t replay_sets, replay_files, replay_skipped;
+
+static int parse_set(const char **p);
+
+
+static inline void skip_ws(const char **p)
+{
+  while (**p == ' ' || **p == '\t' || **p == '\n' || **p == '\r') (*p)++;
+  return;
+}
+
+
+static int hexval(const char c)
+{
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+
+static int parse_u16(const char *p, uint32_t * const restrict u)
+{
+  *u = 0;
+  for (int i = 0; i < 4; i++) {
+    const int v = hexval(p[i]);
+    if (v < 0) return -1;
+    *u = (*u << 4) | (uint32_t)v;
+  }
+  return 0;
+}
+
+
+/* Parse a JSON string into a new buffer (NULL on error); the result is
+ * UTF-8 apart from raw bytes that -J escaped as lone low surrogates */
+static char *parse_string(const char **p)
+{
+  const char *s = *p;
+  const char *end;
+  char *out, *o;
+  uint32_t u, lo;
+
+  if (*s != '"') return NULL;
+  s++;
+  /* Escapes never expand, so the escaped length is enough */
+  for (end = s; *end != '"'; end++) {
+    if (*end == '\0') return NULL;
+    if (*end == '\\' && *++end == '\0') return NULL;
+  }
+  o = out = (char *)malloc((size_t)(end - s) + 1);
+  if (out == NULL) jc_oom("parse_string()");
+  while (*s != '"') {
+    if (*s == '\0') goto error;
+    if (*s != '\\') {
+      *o++ = *s++;
+      continue;
+    }
+    s++;
+    switch (*s) {
+      case '"': case '\\': case '/': *o++ = *s; break;
+      case 'b': *o++ = '\b'; break;
+      case 'f': *o++ = '\f'; break;
+      case 'n': *o++ = '\n'; break;
+      case 'r': *o++ = '\r'; break;
+      case 't': *o++ = '\t'; break;
+      case 'u':
+        if (parse_u16(s + 1, &u) != 0) goto error;
+        s += 4;
+        if (u >= 0xd800 && u < 0xdc00) {
+          if (s[1] != '\\' || s[2] != 'u' || parse_u16(s + 3, &lo) != 0) goto error;
+          if (lo < 0xdc00 || lo > 0xdfff) goto error;
+          u = 0x10000 + ((u - 0xd800) << 10) + (lo - 0xdc00);
+          s += 6;
+        } else if (u >= 0xdc80 && u <= 0xdcff) {
+          /* -J writes a byte that isn't valid UTF-8 this way */
+          *o++ = (char)(u & 0xff);
+          break;
+        } else if (u >= 0xdc00 && u <= 0xdfff) goto error;
+        if (u == 0) goto error;
+        if (u < 0x80) *o++ = (char)u;
+        else if (u < 0x800) {
+          *o++ = (char)(0xc0 | (u >> 6));
+          *o++ = (char)(0x80 | (u & 0x3f));
+        } else if (u < 0x10000) {
+          *o++ = (char)(0xe0 | (u >> 12));
+          *o++ = (char)(0x80 | ((u >> 6) & 0x3f));
+          *o++ = (char)(0x80 | (u & 0x3f));
+        } else {
+          *o++ = (char)(0xf0 | (u >> 18));
+          *o++ = (char)(0x80 | ((u >> 12) & 0x3f));
+          *o++ = (char)(0x80 | ((u >> 6) & 0x3f));
+          *o++ = (char)(0x80 | (u & 0x3f));
+        }
+        break;
+      default: goto error;
+    }
+    s++;
+  }
+  *o = '\0';
+  *p = s + 1;
+  return out;
+
+error:
+  free(out);
+  return NULL;
+}
+
+
+static int parse_number(const char **p, intmax_t * const restrict n)
+{
+  char *end;
+
+  *n = strtoimax(*p, &end, 10);
+  if (end == *p) return -1;
+  /* Fractions and exponents are not expected; skip them if present */
+  while (*end == '.' || *end == 'e' || *end == 'E' || *end == '+' || *end == '-' || (*end >= '0' && *end <= '9')) end++;
+  *p = end;
+  return 0;
+}
+
+
+static int parse_unsigned(const char **p, uintmax_t * const restrict n)
+{
+  char *end;
+
+  if (**p == '-') return -1;
+  *n = strtoumax(*p, &end, 10);
+  if (end == *p) return -1;
+  *p = end;
+  return 0;
+}
+
+
+/* Skip over any JSON value */
+static int skip_value(const char **p)
+{
+  char *s, close;
+  intmax_t n;
+
+  skip_ws(p);
+  close = (**p == '{') ? '}' : ']';
+  switch (**p) {
+    case '"':
+      if ((s = parse_string(p)) == NULL) return -1;
+      free(s);
+      return 0;
+    case '{':
+    case '[':
+      (*p)++;
+      skip_ws(p);
+      if (**p == close) { (*p)++; return 0; }
+      while (1) {
+        if (close == '}') {
+          skip_ws(p);
+          if ((s = parse_string(p)) == NULL) return -1;
+          free(s);
+          skip_ws(p);
+          if (**p != ':') return -1;
+          (*p)++;
+        }
+        if (skip_value(p) != 0) return -1;
+        skip_ws(p);
+        if (**p == ',') { (*p)++; continue; }
+        if (**p == close) { (*p)++; return 0; }
+        return -1;
+      }
+    case 't': if (strncmp(*p, "true", 4) == 0) { *p += 4; return 0; } return -1;
+    case 'f': if (strncmp(*p, "false", 5) == 0) { *p += 5; return 0; } return -1;
+    case 'n': if (strncmp(*p, "null", 4) == 0) { *p += 4; return 0; } return -1;
+    default: return parse_number(p, &n);
+  }
+}
+
+
+/* Parse one { "filePath": ... } object of a fileList */
+static int parse_member(const char **p, struct replay_member * const restrict m)
+{
+  char *key;
+  intmax_t n;
+
+  memset(m, 0, sizeof(struct replay_member));
+  skip_ws(p);
+  if (**p != '{') return -1;
+  (*p)++;
+  skip_ws(p);
+  if (**p == '}') goto done;
+  while (1) {
+    skip_ws(p);
+    if ((key = parse_string(p)) == NULL) return -1;
+    skip_ws(p);
+    if (**p != ':') goto error_key;
+    (*p)++;
+    skip_ws(p);
+    if (strcmp(key, "filePath") == 0) {
+      free(m->path);
+      if ((m->path = parse_string(p)) == NULL) goto error_key;
+    } else if (strcmp(key, "inode") == 0) {
+      if (parse_unsigned(p, &m->inode) != 0) goto error_key;
+      m->have_inode = 1;
+    } else if (strcmp(key, "device") == 0) {
+      if (parse_unsigned(p, &m->device) != 0) goto error_key;
+      m->have_device = 1;
+    } else if (strcmp(key, "mtime") == 0) {
+      if (parse_number(p, &n) != 0) goto error_key;
+      m->mtime = n;
+      m->have_mtime = 1;
+    } else if (skip_value(p) != 0) goto error_key;
+    free(key);
+    skip_ws(p);
+    if (**p == ',') { (*p)++; continue; }
+    if (**p == '}') break;
+    return -1;
+  }
+done:
+  (*p)++;
+  return m->path == NULL ? -1 : 0;
+
+error_key:
+  free(key);
+  return -1;
+}
+
+
+/* Is the file still the one the report describes? */
+static int member_valid(file_t * const restrict file, const struct replay_member * const restrict m, const off_t size)
+{
+  if (getfilestats(file) != 0) return 0;
+  if (!S_ISREG(file->mode)) return 0;
+  if (file->size != size) return 0;
+  if (m->have_inode && (uintmax_t)file->inode != m->inode) return 0;
+  if (m->have_device && (uintmax_t)file->device != m->device) return 0;
+#ifndef NO_MTIME
+  if (m->have_mtime && (intmax_t)file->mtime != m->mtime) return 0;
+#endif
+  return 1;
+}
+
+
+/* Turn the members that are still valid into a duplicate chain */
+static void finish_set(struct replay_set * const restrict set)
+{
+  file_t *head = NULL, *last = NULL, *file;
+  unsigned int count = 0;
+
+  for (unsigned int i = 0; i < set->count; i++) {
+    struct replay_member * const m = &set->members[i];
+    const size_t len = strlen(m->path) + 1;
+
+    /* A size alone says nothing about whether the data is the same */
+    if (replay_confirm == 0 && (!m->have_inode || !m->have_mtime)
+        && (a_flags & (FA_DELETEFILES | FA_HARDLINKFILES | FA_MAKESYMLINKS | FA_DEDUPEFILES | FA_REFLINKFILES)) != 0) {
+      fprintf(stderr, "error: the match set file doesn't record inodes and modification times (a -j report);\n");
+      fprintf(stderr, "       add -G to compare file contents before -d, -L, -l, -B or -c act on it\n");
+      exit(EXIT_FAILURE);
+    }
+    file = (file_t *)calloc(1, sizeof(file_t));
+    if (file == NULL) jc_oom("finish_set() file");
+    file->d_name = (char *)malloc(EXTEND64(len));
+    if (file->d_name == NULL) jc_oom("finish_set() filename");
+    memcpy(file->d_name, m->path, len);
+    free(m->path);
+
+    if (!set->have_size || !member_valid(file, m, set->size)) {
+      fprintf(stderr, "warning: file changed since the match set was saved, skipping:\n-//-> ");
+      goto skip_file;
+    }
+    /* Compare all of the data; the first valid file is the reference */
+    if (replay_confirm != 0 && head != NULL && confirmmatch(head, file) != 0) {
+      fprintf(stderr, "warning: file contents changed since the match set was saved, skipping:\n-//-> ");
+      goto skip_file;
+    }
+
+    if (head == NULL) head = file;
+    else last->duplicates = file;
+    last = file;
+    count++;
+    continue;
+
+skip_file:
+    jc_fwprint(stderr, file->d_name, 1);
+    replay_skipped++;
+    free(file->d_name);
+    free(file);
+  }
+  set->count = 0;
+  set->have_size = 0;
+  if (head == NULL) return;
+
+  /* A set needs at least two files to act on */
+  if (count < 2) {
+    replay_skipped++;
+    free(head->d_name);
+    free(head);
+    return;
+  }
+  SETFLAG(head->flags, FF_HAS_DUPES);
+  for (file = head; file != NULL; file = file->duplicates) {
+    if (replay_tail == NULL) replay_head = file;
+    else replay_tail->next = file;
+    replay_tail = file;
+  }
+  replay_sets++;
+  replay_files += count;
+  return;
+}
+
+
+/* Parse a fileList array into the set */
+static int parse_filelist(const char **p, struct replay_set * const restrict set)
+{
+  skip_ws(p);
+  if (**p != '[') return -1;
+  (*p)++;
+  skip_ws(p);
+  if (**p == ']') { (*p)++; return 0; }
+  while (1) {
+    if (set->count == set->alloc) {
+      set->alloc = set->alloc ? set->alloc * 2 : 16;
+      set->members = (struct replay_member *)realloc(set->members, sizeof(struct replay_member) * set->alloc);
+      if (set->members == NULL) jc_oom("parse_filelist()");
+    }
+    if (parse_member(p, &set->members[set->count]) != 0) {
+      free(set->members[set->count].path);
+      return -1;
+    }
+    set->count++;
+    skip_ws(p);
+    if (**p == ',') { (*p)++; continue; }
+    if (**p == ']') { (*p)++; return 0; }
+    return -1;
+  }
+}
+
+
+/* Parse one object: either a match set or the -j top level holding the
+ * "matchSets" array; other keys are ignored */
+static int parse_set(const char **p)
+{
+  struct replay_set set;
+  char *key;
+  intmax_t n;
+  int ret = -1;
+
+  memset(&set, 0, sizeof(set));
+  skip_ws(p);
+  if (**p != '{') return -1;
+  (*p)++;
+  skip_ws(p);
+  if (**p == '}') { (*p)++; return 0; }
+  while (1) {
+    skip_ws(p);
+    if ((key = parse_string(p)) == NULL) goto error;
+    skip_ws(p);
+    if (**p != ':') goto error_key;
+    (*p)++;
+    skip_ws(p);
+    if (strcmp(key, "fileSize") == 0) {
+      if (parse_number(p, &n) != 0 || n < 0) goto error_key;
+      set.size = (off_t)n;
+      set.have_size = 1;
+    } else if (strcmp(key, "fileList") == 0) {
+      if (parse_filelist(p, &set) != 0) goto error_key;
+    } else if (strcmp(key, "matchSets") == 0) {
+      if (**p != '[') goto error_key;
+      (*p)++;
+      skip_ws(p);
+      if (**p == ']') (*p)++;
+      else while (1) {
+        if (parse_set(p) != 0) goto error_key;
+        skip_ws(p);
+        if (**p == ',') { (*p)++; continue; }
+        if (**p == ']') { (*p)++; break; }
+        goto error_key;
+      }
+    } else if (skip_value(p) != 0) goto error_key;
+    free(key);
+    skip_ws(p);
+    if (**p == ',') { (*p)++; continue; }
+    if (**p == '}') break;
+    goto error;
+  }
+  (*p)++;
+  if (set.count > 0) finish_set(&set);
+  ret = 0;
+  goto error;
+
+error_key:
+  free(key);
+error:
+  for (unsigned int i = 0; i < set.count; i++) free(set.members[i].path);
+  free(set.members);
+  return ret;
+}
+
+
+/* Read a whole line of any length (getline() is missing on Windows);
+ * returns its length, 0 at end of file or -1 on error */
+static ssize_t read_line(FILE * const restrict fp, char ** const restrict buf, size_t * const restrict alloc)
+{
+  size_t len = 0;
+
+  while (1) {
+    if (*alloc - len < 2) {
+      *alloc = *alloc ? *alloc * 2 : 65536;
+      *buf = (char *)realloc(*buf, *alloc);
+      if (*buf == NULL) jc_oom("read_line()");
+    }
+    if (fgets(*buf + len, (int)(*alloc - len), fp) == NULL) break;
+    len += strlen(*buf + len);
+    if ((*buf)[len - 1] == '\n') break;
+  }
+  if (ferror(fp)) return -1;
+  (*buf)[len] = '\0';
+  return (ssize_t)len;
+}
+
+
+/* Load the duplicate sets saved in a -j or -J report */
+file_t *load_replay(const char * const restrict name)
+{
+  FILE *fp;
+  char *buf = NULL;
+  const char *p = NULL, *q;
+  size_t len = 0, alloc = 0, got;
+  ssize_t linelen;
+  uintmax_t linenum = 0;
+
+  if (unlikely(name == NULL)) jc_nullptr("load_replay()");
+  LOUD(fprintf(stderr, "load_replay('%s')\n", name);)
+
+  fp = jc_fopen(name, JC_FILE_MODE_RDONLY_SEQ);
+  if (fp == NULL) goto error_open;
+
+  /* A -J report has one object per line and is parsed a line at a time,
+   * so it is never held in memory all at once */
+  while ((linelen = read_line(fp, &buf, &alloc)) > 0) {
+    linenum++;
+    p = buf;
+    skip_ws(&p);
+    if (*p != '\0') break;
+  }
+  if (linelen < 0) goto error_read;
+  if (linelen == 0) goto loaded;
+  q = p;
+  if (skip_value(&q) != 0) goto load_whole;
+  skip_ws(&q);
+  if (*q != '\0') goto load_whole;
+  while (1) {
+    p = buf;
+    skip_ws(&p);
+    if (*p != '\0') {
+      if (parse_set(&p) != 0) goto error_parse_line;
+      skip_ws(&p);
+      if (*p != '\0') goto error_parse_line;
+    }
+    if ((linelen = read_line(fp, &buf, &alloc)) <= 0) break;
+    linenum++;
+  }
+  if (linelen < 0) goto error_read;
+  goto loaded;
+
+  /* A -j report is one object over many lines */
+load_whole:
+  if (fseek(fp, 0, SEEK_SET) != 0) goto error_read;
+  len = 0;
+  do {
+    if (alloc - len < 65536) {
+      alloc = alloc ? alloc * 2 : 1048576;
+      buf = (char *)realloc(buf, alloc + 1);
+      if (buf == NULL) jc_oom("load_replay()");
+    }
+    got = fread(buf + len, 1, alloc - len, fp);
+    len += got;
+  } while (got > 0);
+  if (ferror(fp)) goto error_read;
+  buf[len] = '\0';
+  p = buf;
+  skip_ws(&p);
+  while (*p != '\0') {
+    if (parse_set(&p) != 0) goto error_parse;
+    skip_ws(&p);
+  }
+
+loaded:
+  fclose(fp);
+  free(buf);
+  if (!ISFLAG(flags, F_HIDEPROGRESS)) {
+    fprintf(stderr, "Loaded %" PRIuMAX " sets (%" PRIuMAX " files) from '%s'", replay_sets, replay_files, name);
+    if (replay_skipped > 0) fprintf(stderr, "; %" PRIuMAX " files skipped", replay_skipped);
+    fprintf(stderr, "\n");
+  }
+  return replay_head;
+
+error_open:
+  fprintf(stderr, "error: cannot open match set file '%s'\n", name);
+  exit(EXIT_FAILURE);
+error_read:
+  fprintf(stderr, "error: cannot read match set file '%s'\n", name);
+  exit(EXIT_FAILURE);
+error_parse:
+  fprintf(stderr, "error: '%s' is not a jdupes -j or -J report (parse error at byte %" PRIuMAX ")\n",
+      name, (uintmax_t)(p - buf));
+  exit(EXIT_FAILURE);
+error_parse_line:
+  fprintf(stderr, "error: '%s' is not a jdupes -j or -J report (parse error on line %" PRIuMAX ", byte %" PRIuMAX ")\n",
+      name, linenum, (uintmax_t)(p - buf) + 1);
+  exit(EXIT_FAILURE);
+}
+
+#endif /* NO_JSON */
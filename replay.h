@@ -0,0 +1,25 @@
+/* jdupes match set replay
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifndef NO_JSON
+
+#ifndef JDUPES_REPLAY_H
+#define JDUPES_REPLAY_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "jdupes.h"
+
+extern int replay_confirm;
+
+file_t *load_replay(const char * const restrict name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* JDUPES_REPLAY_H */
+
+#endif /* NO_JSON */
@@ -0,0 +1,227 @@
+/* jdupes physical-order hash scheduling
+ * checkmatch() hashes files in the order they were found, which is close to
+ * random on disk. With -x schedule, every file that shares its size with
+ * another file it is allowed to match gets its partial hash (and, if
+ * partial hashes collide, its full hash) computed up front in order of
+ * physical location, so spinning disks can stream instead of seeking
+ * between files.
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/types.h>
+#ifdef __linux__
+ #include <sys/ioctl.h>
+ #include <linux/fs.h>
+ #include <linux/fiemap.h>
+#endif
+
+#include <libjodycode.h>
+#include "likely_unlikely.h"
+#include "jdupes.h"
+#include "checks.h"
+#include "fdcache.h"
+#include "filehash.h"
+#ifndef NO_HASHDB
+ #include "hashdb.h"
+#endif
+#include "interrupt.h"
+#include "schedule.h"
+
+#ifndef NO_TUNE
+
+int schedule_reads = 0;
+
+struct sched_item {
+  file_t *file;
+  uint64_t physical;  /* Disk location of the first data, or inode number */
+};
+
+
+/* Where on the disk does this file's data start?
+ * Falls back to the inode number, which tends to follow allocation order */
+static uint64_t physical_offset(file_t * const restrict file)
+{
+#if defined __linux__ && defined FS_IOC_FIEMAP
+  struct {
+    struct fiemap fm;
+    struct fiemap_extent fe;
+  } map;
+  FILE *fp = fdcache_open(file);
+
+  if (fp != NULL) {
+    int ret;
+    memset(&map, 0, sizeof(map));
+    map.fm.fm_start = 0;
+    map.fm.fm_length = ~0ULL;
+    map.fm.fm_extent_count = 1;
+    ret = ioctl(fileno(fp), FS_IOC_FIEMAP, &map.fm);
+    fdcache_release(file, fp);
+    if (ret == 0 && map.fm.fm_mapped_extents > 0
+        && !(map.fe.fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE)))
+      return (uint64_t)map.fe.fe_physical;
+  }
+#endif
+  return (uint64_t)file->inode;
+}
+
+
+static int sort_by_size(const void *a, const void *b)
+{
+  const file_t *f1 = *(file_t * const *)a;
+  const file_t *f2 = *(file_t * const *)b;
+
+  if (f1->size != f2->size) return f1->size < f2->size ? -1 : 1;
+  /* Hard links of one another end up next to each other */
+  if (f1->device != f2->device) return f1->device < f2->device ? -1 : 1;
+  if (f1->inode != f2->inode) return f1->inode < f2->inode ? -1 : 1;
+  return 0;
+}
+
+
+/* checkmatch() reads nothing for a pair of hard links of one another */
+static int same_inode(const file_t * const restrict f1, const file_t * const restrict f2)
+{
+#ifndef NO_HARDLINKS
+  return f1->inode == f2->inode && f1->device == f2->device;
+#else
+  (void)f1; (void)f2;
+  return 0;
+#endif
+}
+
+
+static int sort_by_size_partial(const void *a, const void *b)
+{
+  const file_t *f1 = ((const struct sched_item *)a)->file;
+  const file_t *f2 = ((const struct sched_item *)b)->file;
+
+  if (f1->size != f2->size) return f1->size < f2->size ? -1 : 1;
+  return HASH_COMPARE(f1->filehash_partial, f2->filehash_partial);
+}
+
+
+static int sort_by_location(const void *a, const void *b)
+{
+  const struct sched_item *s1 = (const struct sched_item *)a;
+  const struct sched_item *s2 = (const struct sched_item *)b;
+
+  if (s1->file->device != s2->file->device) return s1->file->device < s2->file->device ? -1 : 1;
+  if (s1->physical != s2->physical) return s1->physical < s2->physical ? -1 : 1;
+  return 0;
+}
+
+
+/* Hash a list of files in physical order; returns nonzero on interrupt */
+static int hash_in_order(struct sched_item * const restrict list, const size_t count, const int full)
+{
+  uint64_t *filehash;
+
+  qsort(list, count, sizeof(struct sched_item), sort_by_location);
+  for (size_t i = 0; i < count; i++) {
+    file_t * const file = list[i].file;
+    const off_t window = partial_window(file->size);
+
+    if (interrupt) return 1;
+    if (jc_alarm_ring != 0 && !ISFLAG(flags, F_HIDEPROGRESS)) {
+      jc_alarm_ring = 0;
+      fprintf(stderr, "\rHashing in disk order: %s %zu/%zu", full ? "full" : "partial", i, count);
+    }
+    if (full == 0) {
+      if (ISFLAG(file->flags, FF_HASH_PARTIAL)) continue;
+      filehash = get_filehash(file, (size_t)window, hash_algo);
+      if (filehash == NULL) continue;
+      file->filehash_partial = *filehash;
+      SETFLAG(file->flags, FF_HASH_PARTIAL);
+      /* Small files are completely covered by the partial hash */
+      if (file->size <= window) {
+        file->filehash = file->filehash_partial;
+        SETFLAG(file->flags, FF_HASH_FULL);
+      }
+    } else {
+      if (ISFLAG(file->flags, FF_HASH_FULL)) continue;
+      filehash = get_filehash(file, 0, hash_algo);
+      if (filehash == NULL) continue;
+      file->filehash = *filehash;
+      SETFLAG(file->flags, FF_HASH_FULL);
+    }
+#ifndef NO_HASHDB
+    if (ISFLAG(flags, F_HASHDB)) add_hashdb_entry(NULL, 0, file);
+#endif
+  }
+  return 0;
+}
+
+
+void schedule_hashes(file_t *files)
+{
+  file_t **bysize;
+  struct sched_item *list;
+  char *wanted;
+  size_t count = 0, listcount = 0, i, j, run, run_end;
+
+  if (schedule_reads == 0 || files == NULL) return;
+  for (file_t *f = files; f != NULL; f = f->next) count++;
+  bysize = (file_t **)malloc(sizeof(file_t *) * count);
+  list = (struct sched_item *)malloc(sizeof(struct sched_item) * count);
+  wanted = (char *)calloc(count, 1);
+  if (bysize == NULL || list == NULL || wanted == NULL) jc_oom("schedule_hashes()");
+  count = 0;
+  for (file_t *f = files; f != NULL; f = f->next)
+    if (f->size > 0) bysize[count++] = f;
+
+  /* Only files that share their size with another file ever get hashed */
+  qsort(bysize, count, sizeof(file_t *), sort_by_size);
+  for (i = 0; i < count; i = j) {
+    for (j = i + 1; j < count && bysize[j]->size == bysize[i]->size; j++);
+    if (j - i < 2) continue;
+    /* A file needs a partner that -I, -1 and -p don't rule out from outside
+     * its own run of hard links; a group of one inode needs no hashing */
+    for (size_t k = run = run_end = i; k < j; k++) {
+      if (k == run_end) {
+        run = k;
+        for (run_end = k + 1; run_end < j && same_inode(bysize[k], bysize[run_end]); run_end++);
+        if (run == i && run_end == j) break;
+      }
+      for (size_t m = i; m < j && wanted[k] == 0; m++) {
+        if (m == run) {
+          m = run_end - 1;
+          continue;
+        }
+        if (check_conditions(bysize[k], bysize[m]) == 0) wanted[k] = wanted[m] = 1;
+      }
+      if (wanted[k] == 0) continue;
+      list[listcount].file = bysize[k];
+      list[listcount].physical = physical_offset(bysize[k]);
+      listcount++;
+    }
+  }
+  free(bysize);
+  free(wanted);
+  LOUD(fprintf(stderr, "schedule_hashes: %zu of %zu files are candidates\n", listcount, count));
+
+  if (hash_in_order(list, listcount, 0) != 0 || ISFLAG(flags, F_PARTIALONLY)) goto finish;
+
+  /* Full hashes are only needed where partial hashes collide */
+  for (i = 0, j = 0; i < listcount; i++)
+    if (ISFLAG(list[i].file->flags, FF_HASH_PARTIAL)) list[j++] = list[i];
+  listcount = j;
+  qsort(list, listcount, sizeof(struct sched_item), sort_by_size_partial);
+  count = 0;
+  for (i = 0; i < listcount; i = j) {
+    for (j = i + 1; j < listcount && sort_by_size_partial(&list[i], &list[j]) == 0; j++);
+    if (j - i < 2) continue;
+    for (size_t k = i; k < j; k++) list[count++] = list[k];
+  }
+  hash_in_order(list, count, 1);
+
+finish:
+  if (!ISFLAG(flags, F_HIDEPROGRESS)) fprintf(stderr, "\r%40s\r", "");
+  free(list);
+  return;
+}
+
+#endif /* NO_TUNE */
@@ -0,0 +1,22 @@
+/* jdupes physical-order hash scheduling
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifndef JDUPES_SCHEDULE_H
+#define JDUPES_SCHEDULE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "jdupes.h"
+
+#ifndef NO_TUNE
+extern int schedule_reads;
+void schedule_hashes(file_t *files);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* JDUPES_SCHEDULE_H */
@@ -0,0 +1,147 @@
+/* jdupes streaming actions
+ * Normally every duplicate set waits for the whole scan to finish before
+ * it is deleted, linked or deduplicated. With -x stream, the file list is
+ * ordered by size (largest first) so that all candidates for a set arrive
+ * together; as soon as the last file of a size has been checked, the sets
+ * of that size can't gain members, so the selected action runs on them and
+ * their files and match tree are freed. Work done before an interruption
+ * is kept and memory use follows the largest size group, not the scan.
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include <libjodycode.h>
+#include "likely_unlikely.h"
+#include "jdupes.h"
+#include "fdcache.h"
+#ifndef NO_DELETE
+ #include "act_deletefiles.h"
+#endif
+#ifdef ENABLE_DEDUPE
+ #include "act_dedupefiles.h"
+#endif
+#include "act_linkfiles.h"
+#ifndef NO_JSON
+ #include "act_printjson.h"
+#endif
+#include "stream.h"
+
+int stream_actions = 0;
+
+/* Duplicate sets acted on so far */
+static uintmax_t stream_sets = 0;
+
+struct stream_item {
+  file_t *file;
+  size_t order;  /* Position in the scan, to keep the sort stable */
+};
+
+
+static int sort_by_size_desc(const void *a, const void *b)
+{
+  const struct stream_item *s1 = (const struct stream_item *)a;
+  const struct stream_item *s2 = (const struct stream_item *)b;
+
+  if (s1->file->size != s2->file->size) return s1->file->size > s2->file->size ? -1 : 1;
+  return s1->order < s2->order ? -1 : 1;
+}
+
+
+/* Reorder the file list by descending size; files of equal size keep
+ * their scan order so sets come out the same as without -x stream */
+file_t *stream_sort(file_t *files)
+{
+  struct stream_item *list;
+  size_t count = 0, i;
+
+  for (file_t *f = files; f != NULL; f = f->next) count++;
+  if (count < 2) return files;
+  list = (struct stream_item *)malloc(sizeof(struct stream_item) * count);
+  if (list == NULL) jc_oom("stream_sort()");
+  i = 0;
+  for (file_t *f = files; f != NULL; f = f->next, i++) {
+    list[i].file = f;
+    list[i].order = i;
+  }
+  qsort(list, count, sizeof(struct stream_item), sort_by_size_desc);
+  for (i = 0; i < count - 1; i++) list[i].file->next = list[i + 1].file;
+  list[count - 1].file->next = NULL;
+  files = list[0].file;
+  free(list);
+  return files;
+}
+
+
+static void free_tree(filetree_t * const restrict tree)
+{
+  if (tree == NULL) return;
+  free_tree(tree->left);
+  free_tree(tree->right);
+  free(tree);
+  return;
+}
+
+
+/* Act on the sets in the files from the head of the list through 'last'
+ * (or the whole list if NULL), then free them and the match tree. The
+ * list head moves to the file after 'last' */
+void stream_bucket(file_t ** const restrict files, file_t * const restrict last, filetree_t ** const restrict tree)
+{
+  file_t *bucket, *next;
+  unsigned int sets = 0;
+
+  if (unlikely(files == NULL || tree == NULL)) jc_nullptr("stream_bucket()");
+  bucket = *files;
+  if (last != NULL) {
+    *files = last->next;
+    last->next = NULL;
+  } else *files = NULL;
+
+  for (file_t *f = bucket; f != NULL; f = f->next) if (ISFLAG(f->flags, FF_HAS_DUPES)) sets++;
+  LOUD(fprintf(stderr, "stream_bucket: size %" PRIdMAX ", %u sets\n", bucket != NULL ? (intmax_t)bucket->size : 0, sets);)
+  if (sets > 0) {
+    if (!ISFLAG(flags, F_HIDEPROGRESS)) fprintf(stderr, "\r%60s\r", " ");
+#ifndef NO_DELETE
+    if (ISFLAG(a_flags, FA_DELETEFILES)) deletefiles(bucket, 0, 0);
+#endif
+#ifndef NO_SYMLINKS
+    if (ISFLAG(a_flags, FA_MAKESYMLINKS)) linkfiles(bucket, 0, 0);
+#endif
+#ifndef NO_HARDLINKS
+    if (ISFLAG(a_flags, FA_HARDLINKFILES)) linkfiles(bucket, 1, 0);
+#endif
+#ifdef ENABLE_DEDUPE
+    if (ISFLAG(a_flags, FA_DEDUPEFILES)) dedupefiles(bucket);
+    if (ISFLAG(a_flags, FA_REFLINKFILES)) linkfiles(bucket, 2, 0);
+#endif
+#ifndef NO_JSON
+    if (ISFLAG(a_flags, FA_PRINTNDJSON)) printndjson(bucket);
+#endif
+    stream_sets += sets;
+  }
+
+  free_tree(*tree);
+  *tree = NULL;
+  for (; bucket != NULL; bucket = next) {
+    next = bucket->next;
+    fdcache_drop(bucket);
+    free(bucket->d_name);
+    free(bucket);
+  }
+  return;
+}
+
+
+/* Print what the actions would have printed once at the end of a run */
+void stream_finish(void)
+{
+  /* Keep --ndjson output parseable */
+  if (stream_sets == 0 && !ISFLAG(a_flags, FA_PRINTNDJSON)) printf("%s", s_no_dupes);
+#ifdef ENABLE_DEDUPE
+  if (ISFLAG(a_flags, FA_DEDUPEFILES)) dedupe_report();
+#endif
+  return;
+}
@@ -0,0 +1,23 @@
+/* jdupes streaming actions
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifndef JDUPES_STREAM_H
+#define JDUPES_STREAM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "jdupes.h"
+
+extern int stream_actions;
+
+file_t *stream_sort(file_t *files);
+void stream_bucket(file_t ** const restrict files, file_t * const restrict last, filetree_t ** const restrict tree);
+void stream_finish(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* JDUPES_STREAM_H */
@@ -0,0 +1,295 @@
+/* jdupes performance tuning options
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <libjodycode.h>
+#include "jdupes.h"
+#include "actexec.h"
+#include "autotune.h"
+#include "helptext.h"
+#include "schedule.h"
+#include "stream.h"
+#include "tune.h"
+
+/* Read backend used for hashing and comparison */
+int read_mode = READ_MODE_STDIO;
+int io_queue_depth = DEFAULT_QUEUE_DEPTH;
+int read_ring_count = DEFAULT_RING_COUNT;
+/* Open files kept between hashing stages; -1 = size from RLIMIT_NOFILE */
+int fdcache_size = -1;
+/* Bytes of read-ahead to request while reading; 0 = whole range up front */
+size_t read_ahead = 0;
+int autotune_mode = AUTOTUNE_LOAD;
+/* Skip reading holes in sparse files (SEEK_DATA/SEEK_HOLE) */
+int sparse_reads = 1;
+unsigned int tune_explicit = 0;
+
+#ifndef NO_TUNE
+
+/* Tuning option IDs */
+#define TUNE_READ_STDIO		1
+#define TUNE_READ_MMAP		2
+#define TUNE_READ_DIRECT	3
+#define TUNE_READ_URING		4
+#define TUNE_QUEUE_DEPTH	5
+#define TUNE_READ_THREAD	6
+#define TUNE_RING_COUNT		7
+#define TUNE_FDCACHE		8
+#define TUNE_AUTOTUNE		9
+#define TUNE_PARTIAL		10
+#define TUNE_SCHEDULE		11
+#define TUNE_NOSPARSE		12
+#define TUNE_ATHREADS		13
+#define TUNE_STREAM		14
+
+/* Tuning option flags */
+#define TF_REQ_VALUE		0x00000001U
+
+struct tune_tags {
+  const char * const tag;
+  const int id;
+  const uint32_t flags;
+};
+
+static const struct tune_tags tune_tags[] = {
+  { "stdio",	TUNE_READ_STDIO,	0 },
+  { "mmap",	TUNE_READ_MMAP,		0 },
+  { "direct",	TUNE_READ_DIRECT,	0 },
+  { "uring",	TUNE_READ_URING,	0 },
+  { "qd",	TUNE_QUEUE_DEPTH,	TF_REQ_VALUE },
+  { "thread",	TUNE_READ_THREAD,	0 },
+  { "ring",	TUNE_RING_COUNT,	TF_REQ_VALUE },
+  { "fdcache",	TUNE_FDCACHE,		TF_REQ_VALUE },
+  { "autotune",	TUNE_AUTOTUNE,		0 },
+  { "partial",	TUNE_PARTIAL,		TF_REQ_VALUE },
+  { "schedule",	TUNE_SCHEDULE,		0 },
+  { "nosparse",	TUNE_NOSPARSE,		0 },
+  { "athreads",	TUNE_ATHREADS,		TF_REQ_VALUE },
+  { "stream",	TUNE_STREAM,		0 },
+  { NULL, 0, 0 },
+};
+
+
+static void help_text_tune(void)
+{
+#ifndef NO_HELPTEXT
+  printf("Detailed help for jdupes -x/--tune options\n");
+  printf("General format: jdupes -x option[:value]\n\n");
+
+  printf("stdio                   \tRead file data with buffered stdio (default)\n");
+  printf("mmap                    \tHash and compare file data directly from\n");
+  printf("                        \tmemory-mapped pages; files that can't be\n");
+  printf("                        \tmapped fall back to stdio automatically\n");
+  printf("direct                  \tRead with O_DIRECT to keep scans out of the\n");
+  printf("                        \tpage cache (Linux only); filesystems that\n");
+  printf("                        \treject O_DIRECT drop cached pages after reads\n");
+  printf("uring                   \tKeep many reads in flight with io_uring so\n");
+  printf("                        \tfast devices stay busy (Linux only)\n");
+  printf("qd:N                    \tio_uring reads in flight per file (default %d)\n", DEFAULT_QUEUE_DEPTH);
+  printf("thread                  \tRead ahead in a helper thread so reading and\n");
+  printf("                        \thashing/comparing overlap\n");
+  printf("ring:N                  \tBuffers read ahead by the helper thread\n");
+  printf("                        \t(default %d); -C sets the size of each buffer\n", DEFAULT_RING_COUNT);
+  printf("fdcache:N               \tKeep up to N files open between the partial\n");
+  printf("                        \thash, full hash and compare steps; 0 disables\n");
+  printf("                        \t(default: based on the open file limit)\n");
+  printf("autotune[:force|off]    \tBenchmark devices without a saved profile and\n");
+  printf("                        \tsave the best chunk size, read-ahead and queue\n");
+  printf("                        \tdepth to ~/.cache/%s; saved profiles\n", AUTOTUNE_FILE);
+  printf("                        \tare used automatically unless -C/qd/ring are\n");
+  printf("                        \tgiven. 'force' benchmarks all devices again,\n");
+  printf("                        \t'off' ignores saved profiles\n");
+  printf("partial:N[k|m]|auto     \tPartial hash window (default %d bytes); must\n", PARTIAL_HASH_SIZE);
+  printf("                        \tbe a power of two up to %dk. 'auto' starts at\n", PARTIAL_HASH_MAX >> 10);
+  printf("                        \tthe filesystem block size and grows the window\n");
+  printf("                        \tfor large files\n");
+  printf("schedule                \tHash all same-size files up front in order of\n");
+  printf("                        \tdisk location (FIEMAP, else inode number) to\n");
+  printf("                        \tcut seeking on spinning disks\n");
+  printf("nosparse                \tRead holes in sparse files instead of skipping\n");
+  printf("                        \tthem with SEEK_DATA/SEEK_HOLE (stdio, mmap\n");
+  printf("                        \tand direct backends)\n");
+  printf("athreads:N              \tDelete (-dN), link or dedupe up to N duplicate\n");
+  printf("                        \tsets at once; sets sharing a directory still run\n");
+  printf("                        \tin order and output stays in set order (max %d)\n", MAX_ACTION_THREADS);
+  printf("stream                  \tRun -dN, -L, -l, -c or -B on each set as soon\n");
+  printf("                        \tas no more files can join it instead of after\n");
+  printf("                        \tthe whole scan; files are checked largest size\n");
+  printf("                        \tfirst and freed once acted on\n");
+
+  printf("\nTuning options never change which files are considered duplicates;\n");
+  printf(  "they only change how the work is done. Later options override earlier\n");
+  printf(  "options of the same kind.\n");
+#else /* NO_HELPTEXT */
+  version_text(0);
+#endif /* NO_HELPTEXT */
+}
+
+
+/* Parse and apply one -x tuning option */
+void add_tune_option(const char *option)
+{
+  char *opt, *p, *end;
+  long value;
+  const struct tune_tags *tags = tune_tags;
+
+  if (option == NULL) jc_nullptr("add_tune_option()");
+
+  LOUD(fprintf(stderr, "add_tune_option '%s'\n", option);)
+
+  /* Invoke help text if requested */
+  if (jc_strcaseeq(option, "help") == 0) { help_text_tune(); exit(EXIT_SUCCESS); }
+
+  opt = malloc(strlen(option) + 1);
+  if (opt == NULL) jc_oom("add_tune_option option");
+  strcpy(opt, option);
+  p = opt;
+
+  while (*p != ':' && *p != '\0') p++;
+
+  /* Split option string into *opt (tag) and *p (value) */
+  if (*p == ':') {
+    *p = '\0';
+    p++;
+  }
+
+  while (tags->tag != NULL && jc_strcaseeq(tags->tag, opt) != 0) tags++;
+  if (tags->tag == NULL) goto error_bad_option;
+  if (tags->flags & TF_REQ_VALUE && *p == '\0') goto error_value_missing;
+
+  switch (tags->id) {
+    case TUNE_READ_STDIO:
+      read_mode = READ_MODE_STDIO;
+      break;
+    case TUNE_READ_MMAP:
+#if defined ON_WINDOWS || defined NO_MMAP
+      fprintf(stderr, "warning: -x mmap is not supported in this build, ignoring\n");
+#else
+      read_mode = READ_MODE_MMAP;
+#endif
+      break;
+    case TUNE_READ_DIRECT:
+#if !defined __linux__ || defined NO_DIRECTIO
+      fprintf(stderr, "warning: -x direct is not supported in this build, ignoring\n");
+#else
+      read_mode = READ_MODE_DIRECT;
+#endif
+      break;
+    case TUNE_READ_URING:
+#if !defined __linux__ || defined NO_IO_URING
+      fprintf(stderr, "warning: -x uring is not supported in this build, ignoring\n");
+#else
+      read_mode = READ_MODE_URING;
+#endif
+      break;
+    case TUNE_QUEUE_DEPTH:
+      value = strtol(p, &end, 10);
+      if (*end != '\0' || value < 1 || value > MAX_QUEUE_DEPTH) goto error_value_missing;
+      io_queue_depth = (int)value;
+      tune_explicit |= TUNE_SET_QD;
+      break;
+    case TUNE_READ_THREAD:
+#if defined ON_WINDOWS || defined NO_THREADS
+      fprintf(stderr, "warning: -x thread is not supported in this build, ignoring\n");
+#else
+      read_mode = READ_MODE_THREAD;
+#endif
+      break;
+    case TUNE_RING_COUNT:
+      value = strtol(p, &end, 10);
+      if (*end != '\0' || value < 2 || value > MAX_RING_COUNT) goto error_value_missing;
+      read_ring_count = (int)value;
+      tune_explicit |= TUNE_SET_RING;
+      break;
+    case TUNE_FDCACHE:
+      value = strtol(p, &end, 10);
+      if (*end != '\0' || value < 0 || value > 1048576) goto error_value_missing;
+      fdcache_size = (int)value;
+      break;
+    case TUNE_AUTOTUNE:
+      if (*p == '\0') autotune_mode = AUTOTUNE_BENCH;
+      else if (jc_strcaseeq(p, "force") == 0) autotune_mode = AUTOTUNE_FORCE;
+      else if (jc_strcaseeq(p, "off") == 0) autotune_mode = AUTOTUNE_OFF;
+      else goto error_value_missing;
+#ifdef ON_WINDOWS
+      if (autotune_mode != AUTOTUNE_OFF) {
+        fprintf(stderr, "warning: -x autotune benchmarks are not supported on Windows, ignoring\n");
+        autotune_mode = AUTOTUNE_LOAD;
+      }
+#endif
+      break;
+    case TUNE_SCHEDULE:
+      schedule_reads = 1;
+      break;
+    case TUNE_NOSPARSE:
+      sparse_reads = 0;
+      break;
+    case TUNE_ATHREADS:
+      value = strtol(p, &end, 10);
+      if (*end != '\0' || value < 1 || value > MAX_ACTION_THREADS) goto error_value_missing;
+#if defined ON_WINDOWS || defined NO_THREADS
+      fprintf(stderr, "warning: -x athreads is not supported in this build, ignoring\n");
+#else
+      action_threads = (int)value;
+#endif
+      break;
+    case TUNE_STREAM:
+      stream_actions = 1;
+      break;
+    case TUNE_PARTIAL:
+      if (jc_strcaseeq(p, "auto") == 0) {
+        partial_hash_grow = 1;
+        break;
+      }
+      value = strtol(p, &end, 10);
+      if (*end == 'k' || *end == 'K') { value <<= 10; end++; }
+      else if (*end == 'm' || *end == 'M') { value <<= 20; end++; }
+      if (*end != '\0' || value < PARTIAL_HASH_SIZE || value > PARTIAL_HASH_MAX || (value & (value - 1)) != 0) goto error_value_missing;
+      partial_hash_size = (size_t)value;
+      partial_hash_grow = 0;
+      break;
+    default:
+      goto error_bad_option;
+  }
+
+  LOUD(fprintf(stderr, "Added tune option: tag '%s', value '%s'\n", opt, p);)
+  free(opt);
+  return;
+
+error_value_missing:
+  fprintf(stderr, "tune option value missing or invalid: -x option:value\n");
+  goto tune_help_and_exit;
+error_bad_option:
+  fprintf(stderr, "Invalid tune option name was specified\n");
+  goto tune_help_and_exit;
+tune_help_and_exit:
+  help_text_tune();
+  exit(EXIT_FAILURE);
+}
+
+
+
+/* With -x partial:auto, raise the partial hash window to at least the
+ * preferred I/O size of the filesystem holding a file/directory argument */
+void tune_partial_base(const char * const restrict path)
+{
+#ifndef ON_WINDOWS
+  struct JC_STAT s;
+  size_t blksize = PARTIAL_HASH_SIZE;
+
+  if (partial_hash_grow == 0 || path == NULL) return;
+  if (jc_stat(path, &s) != 0) return;
+  while (blksize < (size_t)s.st_blksize && blksize < PARTIAL_HASH_MAX) blksize <<= 1;
+  if (blksize > partial_hash_size) partial_hash_size = blksize;
+  LOUD(fprintf(stderr, "tune_partial_base: '%s' blksize %ld, window %zu\n", path, (long)s.st_blksize, partial_hash_size);)
+#else
+  (void)path;
+#endif /* ON_WINDOWS */
+  return;
+}
+
+#endif /* NO_TUNE */
@@ -0,0 +1,49 @@
+/* jdupes performance tuning options
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifndef JDUPES_TUNE_H
+#define JDUPES_TUNE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "jdupes.h"
+
+/* File data read backends (see fileio.c) */
+#define READ_MODE_STDIO		0
+#define READ_MODE_MMAP		1
+#define READ_MODE_DIRECT	2
+#define READ_MODE_URING		3
+#define READ_MODE_THREAD	4
+
+/* Reads kept in flight per file by the io_uring backend */
+#define DEFAULT_QUEUE_DEPTH	32
+#define MAX_QUEUE_DEPTH		1024
+/* Chunk buffers filled ahead by the reader thread backend */
+#define DEFAULT_RING_COUNT	4
+#define MAX_RING_COUNT		256
+
+extern int read_mode;
+extern int io_queue_depth;
+extern int read_ring_count;
+extern int fdcache_size;
+extern size_t read_ahead;
+extern int autotune_mode;
+extern int sparse_reads;
+
+/* Settings given explicitly that autotuning must not override */
+#define TUNE_SET_QD		0x1
+#define TUNE_SET_RING		0x2
+extern unsigned int tune_explicit;
+
+#ifndef NO_TUNE
+void add_tune_option(const char *option);
+void tune_partial_base(const char * const restrict path);
+#endif /* NO_TUNE */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* JDUPES_TUNE_H */